@@ -0,0 +1,821 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Workload benchmark running esFtl on the NAND simulator. Every workload
+ * starts from a freshly formatted device and prints one JSON line with the
+ * write amplification, erase count, throughput, latency percentiles on the
+ * simulated clock, the spread of the block erase counts, the writes which
+ * had to wait for an erase and the cost of mounting the result. The append
+ * workload adds records of BENCH_RECORDSIZE bytes to the sectors of a log and
+ * rewrites a few config sectors in between, the pattern a write buffer built
+ * with ESFTL_WRITEBUFFERSECTORS merges.
+ *
+ *   cc -O2 -o bench bench.c esFtl_bbm.c esFtl_cache.c esFtl_defragment.c \
+ *      esFtl_init.c esFtl_read.c esFtl_write.c esFtl_disk_simulator.c esFtl_hybrid.c esFtl_checkpoint.c esFtl_summary.c esFtl_blocks.c esFtl_buffer.c esFtl_vector.c esFtl_checksum.c esFtl_readcache.c esFtl_readahead.c esFtl_scrub.c -lm
+ *   ./bench [--workload seq|random|zipf|fat|mixed|append|meta|stream|all] [--ops N] [--span N]
+ *           [--fill PCT] [--seed N] [--timing mt29f1g01|w25n01gv] [--badblocks N] [--batch N]
+ *
+ * --batch N makes the seq workload write runs of N sectors with one
+ * esFtl_WriteSectors call and verifies the image with esFtl_ReadSectors.
+ * The span defaults to the sectors the device holds, so --fill is the share
+ * of the device written before the measurement and the mixed fill levels
+ * reach the defragment; a smaller span leaves the rest of the device free.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "esFtl.h"
+#include "esFtl_cache.h"
+#include "esFtl_hybrid.h"
+#include "esFtl_disk_simulator.h"
+
+#if ESFTL_HYBRIDMAPPING
+#define BENCH_DEVICESECTORS (ESFTL_HYBRIDLOGICALBLOCKS * ESFTL_NANDNUMPAGEBLOCK)
+#else
+#define BENCH_DEVICESECTORS ESFTL_MAXSECTORS
+#endif
+#define BENCH_MAXSPAN BENCH_DEVICESECTORS /* the FTL refuses the sectors above */
+#define BENCH_ZIPFTHETA 0.99
+#define BENCH_MIXEDREADPCT 70
+#define BENCH_METAREADPCT 90 /* the meta workload reads and rewrites a few hot sectors, like FAT and directory updates */
+#define BENCH_STREAMRUN 256 /* sectors of a file the stream workload reads from start to end */
+#define BENCH_RECORDSIZE 64
+#define BENCH_CONFIGSECTORS 4
+#define BENCH_CONFIGEVERY 8 /* every 8th write of the append workload updates a config sector */
+#define BENCH_MAXBATCH 64
+
+typedef struct
+{
+    const char *workload;
+    uint32_t ops;
+    uint32_t span;
+    uint32_t fill;
+    uint32_t seed;
+    uint32_t badBlocks;
+    uint32_t batch;
+    const char *timingName;
+    const esFtl_SimTiming *timing;
+} BenchOptions;
+
+typedef struct
+{
+    uint64_t *samples;
+    uint32_t count;
+    uint32_t size;
+} LatencyLog;
+
+typedef struct
+{
+    uint32_t hostWrites;
+    uint32_t hostReads;
+    uint32_t releases;
+    uint32_t defrags;
+    uint64_t defragTime;
+    uint32_t verifyErrors;
+    uint32_t writeErrors; /* writes the FTL refused, the sectors keep their previous version */
+    uint32_t eraseWaits;
+    LatencyLog writeLat;
+    LatencyLog readLat;
+    LatencyLog eraseWaitLat; /* the writes which had to erase a block themselves */
+} BenchResult;
+
+static BenchOptions options = {"all", 100000, BENCH_DEVICESECTORS, 75, 1, 0, 1, "mt29f1g01", &esFtl_SimTimingMT29F1G01};
+static uint32_t rngState = 1;
+static uint32_t *versions = NULL;
+static uint8_t pageBuff[ESFTL_NANDPAGESIZE];
+static uint8_t expectBuff[ESFTL_NANDPAGESIZE];
+static uint8_t runBuff[BENCH_MAXBATCH * ESFTL_NANDPAGEDATASIZE];
+static uint32_t appendStart = BENCH_MAXSPAN; /* sectors from here are written record by record */
+static uint64_t tickTime = 0;
+static double *zipfCdf = NULL;
+static uint16_t *zipfOrder = NULL;
+static uint32_t zipfCount = 0;
+static uint32_t writeErrors = 0; /* of all the workloads, the program fails if there is one */
+
+static uint32_t Random(void);
+static void PrepareDevice(void);
+static void HostWrite(BenchResult *res, uint16_t sno);
+static void HostWriteRun(BenchResult *res, uint16_t sno, uint16_t count);
+static void HostRead(BenchResult *res, uint16_t sno);
+static void HostRelease(BenchResult *res, uint16_t sno);
+static void FillSector(uint8_t *buff, uint16_t sno);
+static void TickBuffer(void);
+static void Prefill(BenchResult *res, uint32_t sectors);
+static void PrepareZipf(uint32_t n);
+static uint16_t NextZipf(void);
+static void RecordLatency(LatencyLog *log, uint64_t ns);
+static uint64_t Percentile(LatencyLog *log, double pct);
+static double WallTime(void);
+static void RunWorkload(const char *name, uint32_t fill);
+static void PrintLatency(const char *name, LatencyLog *log);
+
+int main(int argc, char **argv)
+{
+    static const uint32_t mixedFills[] = {25, 50, 75, 90};
+    int fillGiven = 0;
+    int i = 0;
+
+    for (i = 1; i + 1 < argc; i += 2)
+    {
+        if (!strcmp(argv[i], "--workload"))
+            options.workload = argv[i + 1];
+        else if (!strcmp(argv[i], "--ops"))
+            options.ops = strtoul(argv[i + 1], NULL, 0);
+        else if (!strcmp(argv[i], "--span"))
+            options.span = strtoul(argv[i + 1], NULL, 0);
+        else if (!strcmp(argv[i], "--fill"))
+        {
+            options.fill = strtoul(argv[i + 1], NULL, 0);
+            fillGiven = 1;
+        }
+        else if (!strcmp(argv[i], "--seed"))
+            options.seed = strtoul(argv[i + 1], NULL, 0);
+        else if (!strcmp(argv[i], "--badblocks"))
+            options.badBlocks = strtoul(argv[i + 1], NULL, 0);
+        else if (!strcmp(argv[i], "--batch"))
+            options.batch = strtoul(argv[i + 1], NULL, 0);
+        else if (!strcmp(argv[i], "--timing"))
+        {
+            options.timingName = argv[i + 1];
+            if (!strcmp(argv[i + 1], "w25n01gv"))
+                options.timing = &esFtl_SimTimingW25N01GV;
+            else if (!strcmp(argv[i + 1], "mt29f1g01"))
+                options.timing = &esFtl_SimTimingMT29F1G01;
+            else
+            {
+                fprintf(stderr, "unknown timing %s\n", argv[i + 1]);
+                return 2;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    if (options.span == 0 || options.span > BENCH_MAXSPAN || options.fill > 100)
+    {
+        fprintf(stderr, "span must be 1..%d and fill 0..100\n", BENCH_MAXSPAN);
+        return 2;
+    }
+
+    if (options.batch == 0 || options.batch > BENCH_MAXBATCH)
+    {
+        fprintf(stderr, "batch must be 1..%d\n", BENCH_MAXBATCH);
+        return 2;
+    }
+
+    versions = calloc(options.span, sizeof(uint32_t));
+    if (!versions)
+        return 1;
+
+    if (!strcmp(options.workload, "all"))
+    {
+        RunWorkload("seq", options.fill);
+        RunWorkload("random", options.fill);
+        RunWorkload("zipf", options.fill);
+        RunWorkload("fat", options.fill);
+        RunWorkload("append", options.fill);
+        RunWorkload("meta", options.fill);
+        RunWorkload("stream", options.fill);
+        if (fillGiven)
+            RunWorkload("mixed", options.fill);
+        else
+        {
+            for (i = 0; i < (int)(sizeof(mixedFills) / sizeof(mixedFills[0])); i++)
+                RunWorkload("mixed", mixedFills[i]);
+        }
+    }
+    else
+    {
+        RunWorkload(options.workload, options.fill);
+    }
+
+    esFtl_SimClose();
+    free(versions);
+    free(zipfCdf);
+    free(zipfOrder);
+
+    if (writeErrors)
+    {
+        fprintf(stderr, "%u writes failed\n", writeErrors);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * @brief run one workload on a fresh device and print its result line
+ *
+ * @param name
+ * @param fill percentage of the span written before the measurement
+ */
+static void RunWorkload(const char *name, uint32_t fill)
+{
+    BenchResult res;
+    esFtl_SimStats before, after, mount;
+    esFtl_WriteBufferStats bufferBefore, bufferAfter;
+    esFtl_ReadCacheStats cacheBefore, cacheAfter;
+    esFtl_ReadAheadStats aheadBefore, aheadAfter;
+#if !ESFTL_HYBRIDMAPPING
+    esFtl_WearStats wear;
+#endif
+    uint64_t simStart = 0, simEnd = 0, mountStart = 0;
+    double wallStart = 0, wallEnd = 0, mountWall = 0;
+    uint32_t filled = options.span * fill / 100, i = 0, fatSectors = 0, dataStart = 0, next = 0;
+    uint32_t files[64][2];
+    uint32_t fileHead = 0, fileCount = 0, used = 0, len = 0, j = 0, n = 0;
+    uint64_t hostBytes = 0;
+
+    if (filled == 0)
+        filled = 1;
+
+    memset(&res, 0, sizeof(res));
+    res.writeLat.size = options.ops + 16;
+    res.readLat.size = options.ops + 16;
+    res.eraseWaitLat.size = options.ops + 16;
+    res.writeLat.samples = malloc(res.writeLat.size * sizeof(uint64_t));
+    res.readLat.samples = malloc(res.readLat.size * sizeof(uint64_t));
+    res.eraseWaitLat.samples = malloc(res.eraseWaitLat.size * sizeof(uint64_t));
+    if (!res.writeLat.samples || !res.readLat.samples || !res.eraseWaitLat.samples)
+        exit(1);
+
+    rngState = options.seed ? options.seed : 1;
+    memset(versions, 0, options.span * sizeof(uint32_t));
+    appendStart = BENCH_MAXSPAN;
+    PrepareDevice();
+
+    if (!strcmp(name, "random") || !strcmp(name, "zipf") || !strcmp(name, "mixed") || !strcmp(name, "meta") ||
+        !strcmp(name, "stream"))
+    {
+        Prefill(&res, filled);
+        res.writeLat.count = 0;
+        res.eraseWaitLat.count = 0;
+        res.eraseWaits = 0;
+        res.hostWrites = 0;
+    }
+
+    if (!strcmp(name, "zipf") || !strcmp(name, "meta"))
+        PrepareZipf(filled);
+
+    esFtl_SimGetStats(&before);
+    esFtl_GetWriteBufferStats(&bufferBefore);
+    esFtl_GetReadCacheStats(&cacheBefore);
+    esFtl_GetReadAheadStats(&aheadBefore);
+    simStart = esFtl_SimGetTime();
+    wallStart = WallTime();
+
+    if (!strcmp(name, "seq") && options.batch > 1)
+    {
+        for (i = 0; i < options.ops; i += n)
+        {
+            /* a run does not wrap at the end of the span */
+            n = options.span - i % options.span;
+            if (n > options.batch)
+                n = options.batch;
+            if (n > options.ops - i)
+                n = options.ops - i;
+            HostWriteRun(&res, i % options.span, n);
+        }
+    }
+    else if (!strcmp(name, "seq"))
+    {
+        for (i = 0; i < options.ops; i++)
+            HostWrite(&res, i % options.span);
+    }
+    else if (!strcmp(name, "random"))
+    {
+        for (i = 0; i < options.ops; i++)
+            HostWrite(&res, Random() % filled);
+    }
+    else if (!strcmp(name, "zipf"))
+    {
+        for (i = 0; i < options.ops; i++)
+            HostWrite(&res, NextZipf());
+    }
+    else if (!strcmp(name, "stream"))
+    {
+        for (i = 0; i < options.ops; i++)
+        {
+            /* every file is read from its first sector to its end */
+            if (i % BENCH_STREAMRUN == 0)
+                next = Random() % filled;
+            HostRead(&res, next);
+            next = (next + 1) % filled;
+        }
+    }
+    else if (!strcmp(name, "meta"))
+    {
+        for (i = 0; i < options.ops; i++)
+        {
+            if (Random() % 100 < BENCH_METAREADPCT)
+                HostRead(&res, NextZipf());
+            else
+                HostWrite(&res, NextZipf());
+        }
+    }
+    else if (!strcmp(name, "mixed"))
+    {
+        for (i = 0; i < options.ops; i++)
+        {
+            if (Random() % 100 < BENCH_MIXEDREADPCT)
+                HostRead(&res, Random() % filled);
+            else
+                HostWrite(&res, Random() % filled);
+        }
+    }
+    else if (!strcmp(name, "fat"))
+    {
+        /* one FAT sector maps 1024 clusters, the sector after the FAT is the directory */
+        fatSectors = (options.span + 1023) / 1024;
+        dataStart = fatSectors + 1;
+        next = dataStart;
+
+        if (dataStart >= options.span)
+        {
+            fprintf(stderr, "span too small for the fat workload\n");
+            exit(2);
+        }
+
+        while (res.hostWrites + res.releases < options.ops)
+        {
+            len = 1 + Random() % 8;
+
+            while (fileCount > 0 && (used + len > filled || fileCount == 64))
+            {
+                for (j = 0; j < files[fileHead][1]; j++)
+                    HostRelease(&res, dataStart + (files[fileHead][0] + j) % (options.span - dataStart));
+                HostWrite(&res, files[fileHead][0] / 1024 % fatSectors);
+                HostWrite(&res, fatSectors);
+                used -= files[fileHead][1];
+                fileHead = (fileHead + 1) % 64;
+                fileCount--;
+            }
+
+            files[(fileHead + fileCount) % 64][0] = next - dataStart;
+            files[(fileHead + fileCount) % 64][1] = len;
+            fileCount++;
+            used += len;
+
+            for (j = 0; j < len; j++)
+            {
+                HostWrite(&res, next);
+                next++;
+                if (next >= options.span)
+                    next = dataStart;
+            }
+
+            HostWrite(&res, (next - dataStart) / 1024 % fatSectors);
+            HostWrite(&res, fatSectors);
+        }
+    }
+    else if (!strcmp(name, "append"))
+    {
+        if (BENCH_CONFIGSECTORS + 1 >= options.span)
+        {
+            fprintf(stderr, "span too small for the append workload\n");
+            exit(2);
+        }
+
+        /* the log wraps over its sectors, a full sector is released before it is written again */
+        appendStart = BENCH_CONFIGSECTORS;
+        next = appendStart;
+        for (i = 0; i < options.ops; i++)
+        {
+            if (i % BENCH_CONFIGEVERY == BENCH_CONFIGEVERY - 1)
+            {
+                HostWrite(&res, Random() % BENCH_CONFIGSECTORS);
+                continue;
+            }
+
+            if (versions[next] == ESFTL_NANDPAGEDATASIZE / BENCH_RECORDSIZE)
+            {
+                next++;
+                if (next >= options.span)
+                    next = appendStart;
+                HostRelease(&res, next);
+            }
+
+            HostWrite(&res, next);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "unknown workload %s\n", name);
+        exit(2);
+    }
+
+    /* the host flushes the write buffer before the power goes */
+    esFtl_Sync();
+
+    wallEnd = WallTime();
+    simEnd = esFtl_SimGetTime();
+    esFtl_SimGetStats(&after);
+    esFtl_GetWriteBufferStats(&bufferAfter);
+    esFtl_GetReadCacheStats(&cacheAfter);
+    esFtl_GetReadAheadStats(&aheadAfter);
+
+    esFtl_SimResetStats();
+    mountStart = esFtl_SimGetTime();
+    mountWall = WallTime();
+    esFtl_Init(0);
+    mountWall = WallTime() - mountWall;
+    esFtl_SimGetStats(&mount);
+    mountStart = esFtl_SimGetTime() - mountStart;
+
+    for (i = 0; i < options.span; i += n)
+    {
+        n = options.span - i;
+        if (n > options.batch)
+            n = options.batch;
+
+        memset(runBuff, 0, n * ESFTL_NANDPAGEDATASIZE);
+        if (options.batch > 1)
+            esFtl_ReadSectors(i, runBuff, n);
+        else if (versions[i])
+            esFtl_Read(i, runBuff, 0, ESFTL_NANDPAGEDATASIZE);
+
+        for (j = 0; j < n; j++)
+        {
+            if (!versions[i + j])
+                continue;
+
+            FillSector(expectBuff, i + j);
+            if (memcmp(&runBuff[j * ESFTL_NANDPAGEDATASIZE], expectBuff, ESFTL_NANDPAGEDATASIZE))
+                res.verifyErrors++;
+        }
+    }
+
+    hostBytes = (uint64_t)res.hostWrites * (ESFTL_NANDPAGEDATASIZE + 4);
+
+    printf("{\"workload\":\"%s\",\"timing\":\"%s\",\"span\":%u,\"fill\":%u,\"ops\":%u,\"seed\":%u,\"badblocks\":%u,",
+           name, options.timingName, options.span, fill, options.ops, options.seed, options.badBlocks);
+    printf("\"host_writes\":%u,\"host_reads\":%u,\"releases\":%u,\"write_errors\":%u,", res.hostWrites, res.hostReads,
+           res.releases, res.writeErrors);
+    printf("\"nand_reads\":%u,\"nand_programs\":%u,\"nand_erases\":%u,\"nand_copies\":%u,",
+           after.reads - before.reads, after.programs - before.programs, after.erases - before.erases,
+           after.copies - before.copies);
+    printf("\"write_amplification\":%.4f,\"erases_per_write\":%.6f,",
+           hostBytes ? (double)(after.bytesProgrammed - before.bytesProgrammed) / hostBytes : 0.0,
+           res.hostWrites ? (double)(after.erases - before.erases) / res.hostWrites : 0.0);
+    printf("\"defrags\":%u,\"defrag_ns\":%llu,\"sim_ns\":%llu,\"wall_s\":%.3f,",
+           res.defrags, (unsigned long long)res.defragTime, (unsigned long long)(simEnd - simStart), wallEnd - wallStart);
+    printf("\"sim_ops_per_s\":%.1f,\"wall_ops_per_s\":%.1f,",
+           simEnd > simStart ? (res.hostWrites + res.hostReads + res.releases) * 1e9 / (simEnd - simStart) : 0.0,
+           wallEnd > wallStart ? (res.hostWrites + res.hostReads + res.releases) / (wallEnd - wallStart) : 0.0);
+    printf("\"sim_write_mb_per_s\":%.3f,\"sim_read_mb_per_s\":%.3f,",
+           simEnd > simStart ? (double)res.hostWrites * ESFTL_NANDPAGEDATASIZE * 1e3 / (simEnd - simStart) : 0.0,
+           simEnd > simStart ? (double)res.hostReads * ESFTL_NANDPAGEDATASIZE * 1e3 / (simEnd - simStart) : 0.0);
+    PrintLatency("write_lat_ns", &res.writeLat);
+    PrintLatency("read_lat_ns", &res.readLat);
+#if !ESFTL_HYBRIDMAPPING
+    esFtl_GetWearStats(&wear);
+    printf("\"erases_min\":%u,\"erases_max\":%u,\"static_wear_moves\":%u,", wear.minErases, wear.maxErases, wear.staticMoves);
+    printf("\"erase_waits\":%u,", res.eraseWaits);
+    PrintLatency("erase_wait_lat_ns", &res.eraseWaitLat);
+#endif
+#if ESFTL_WRITEBUFFERSECTORS
+    printf("\"buffer_merges\":%u,\"buffer_fills\":%u,\"buffer_flushes\":%u,", bufferAfter.merges - bufferBefore.merges,
+           bufferAfter.fills - bufferBefore.fills, bufferAfter.flushes - bufferBefore.flushes);
+#endif
+#if ESFTL_READCACHESECTORS
+    printf("\"cache_hits\":%u,\"cache_misses\":%u,", cacheAfter.hits - cacheBefore.hits, cacheAfter.misses - cacheBefore.misses);
+#endif
+#if ESFTL_READAHEADSECTORS
+    printf("\"readahead_windows\":%u,\"readahead_hits\":%u,\"readahead_wasted\":%u,", aheadAfter.windows - aheadBefore.windows,
+           aheadAfter.hits - aheadBefore.hits, aheadAfter.wasted - aheadBefore.wasted);
+#endif
+    printf("\"mount_ns\":%llu,\"mount_nand_reads\":%u,\"mount_nand_programs\":%u,\"mount_wall_s\":%.4f,\"verify_errors\":%u}\n",
+           (unsigned long long)mountStart, mount.reads, mount.programs, mountWall, res.verifyErrors);
+    fflush(stdout);
+    writeErrors += res.writeErrors;
+
+    free(res.writeLat.samples);
+    free(res.readLat.samples);
+    free(res.eraseWaitLat.samples);
+}
+
+/*
+ * @brief start with an empty image, the injected bad blocks are spread over the device
+ *
+ */
+static void PrepareDevice(void)
+{
+    static uint16_t bad[ESFTL_NANDNUMBLOCKS];
+    esFtl_SimConfig cfg;
+    uint32_t i = 0;
+
+    for (i = 0; i < options.badBlocks && i < ESFTL_NANDNUMBLOCKS; i++)
+        bad[i] = (uint16_t)((i * 977 + 13) % ESFTL_NANDNUMBLOCKS);
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.badBlocks = bad;
+    cfg.numBadBlocks = i;
+    cfg.strict = 1;
+
+    esFtl_SimConfigure(&cfg);
+    esFtl_SimSetTiming(options.timing);
+    esFtl_Init(1);
+    esFtl_SimResetStats();
+    tickTime = esFtl_SimGetTime();
+}
+
+static void HostWrite(BenchResult *res, uint16_t sno)
+{
+    uint64_t t = esFtl_SimGetTime(), d = 0;
+    uint32_t idx = 0, count = ESFTL_NANDPAGEDATASIZE;
+#if !ESFTL_HYBRIDMAPPING
+    esFtl_EraseStats erase;
+    uint32_t waits = 0;
+
+    esFtl_GetEraseStats(&erase);
+    waits = erase.eraseWaits;
+#endif
+
+    TickBuffer();
+
+    versions[sno]++;
+    FillSector(pageBuff, sno);
+
+    /* a log sector gets only its new record */
+    if (sno >= appendStart)
+    {
+        idx = (versions[sno] - 1) * BENCH_RECORDSIZE;
+        count = BENCH_RECORDSIZE;
+    }
+
+    if (esFtl_FtlDriverWrite(sno, pageBuff, idx, count))
+    {
+        versions[sno]--;
+        res->writeErrors++;
+        return;
+    }
+
+    if (esFtl_IsDefragNeeded())
+    {
+        d = esFtl_SimGetTime();
+        esFtl_Defrag();
+        res->defrags++;
+        res->defragTime += esFtl_SimGetTime() - d;
+    }
+
+    res->hostWrites++;
+    RecordLatency(&res->writeLat, esFtl_SimGetTime() - t);
+
+#if !ESFTL_HYBRIDMAPPING
+    /* an erase in the write path is the stall the erased pool is meant to avoid */
+    esFtl_GetEraseStats(&erase);
+    if (erase.eraseWaits != waits)
+    {
+        res->eraseWaits += erase.eraseWaits - waits;
+        RecordLatency(&res->eraseWaitLat, esFtl_SimGetTime() - t);
+    }
+#endif
+}
+
+/*
+ * @brief write count consecutive sectors with one call, the latency of the call
+ * is recorded once for every sector of it. A run which fails may have written
+ * its first sectors, they are read back to learn which ones
+ *
+ * @param res
+ * @param sno
+ * @param count
+ */
+static void HostWriteRun(BenchResult *res, uint16_t sno, uint16_t count)
+{
+    uint64_t t = esFtl_SimGetTime(), d = 0;
+    uint16_t i = 0, written = count;
+
+    TickBuffer();
+
+    for (i = 0; i < count; i++)
+    {
+        versions[sno + i]++;
+        FillSector(&runBuff[i * ESFTL_NANDPAGEDATASIZE], sno + i);
+    }
+
+    if (esFtl_WriteSectors(sno, runBuff, count))
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (!esFtl_Read(sno + i, pageBuff, 0, ESFTL_NANDPAGEDATASIZE) &&
+                !memcmp(pageBuff, &runBuff[i * ESFTL_NANDPAGEDATASIZE], ESFTL_NANDPAGEDATASIZE))
+                continue;
+
+            versions[sno + i]--;
+            res->writeErrors++;
+            written--;
+        }
+    }
+
+    if (esFtl_IsDefragNeeded())
+    {
+        d = esFtl_SimGetTime();
+        esFtl_Defrag();
+        res->defrags++;
+        res->defragTime += esFtl_SimGetTime() - d;
+    }
+
+    res->hostWrites += written;
+    for (i = 0; i < written; i++)
+        RecordLatency(&res->writeLat, (esFtl_SimGetTime() - t) / count);
+}
+
+static void HostRead(BenchResult *res, uint16_t sno)
+{
+    uint64_t t = esFtl_SimGetTime();
+
+    TickBuffer();
+
+    esFtl_Read(sno, pageBuff, 0, ESFTL_NANDPAGEDATASIZE);
+    FillSector(expectBuff, sno);
+    if (versions[sno] && memcmp(pageBuff, expectBuff, ESFTL_NANDPAGEDATASIZE))
+        res->verifyErrors++;
+
+    res->hostReads++;
+    RecordLatency(&res->readLat, esFtl_SimGetTime() - t);
+}
+
+static void HostRelease(BenchResult *res, uint16_t sno)
+{
+    if (!versions[sno])
+        return;
+
+    esFtl_FtlDriverRelease(sno);
+    versions[sno] = 0;
+    res->releases++;
+}
+
+/*
+ * @brief build the content a sector has after its last write, a log sector
+ * holds one record per write and is erased after the last one
+ *
+ * @param buff
+ * @param sno
+ */
+static void FillSector(uint8_t *buff, uint16_t sno)
+{
+    uint32_t i = 0;
+
+    if (sno < appendStart)
+    {
+        memset(buff, (uint8_t)versions[sno], ESFTL_NANDPAGEDATASIZE);
+        memcpy(&buff[0], &(uint32_t){sno}, 4);
+        memcpy(&buff[4], &versions[sno], 4);
+        return;
+    }
+
+    memset(buff, 0xFF, ESFTL_NANDPAGEDATASIZE);
+    for (i = 0; i < versions[sno]; i++)
+        memset(&buff[i * BENCH_RECORDSIZE], (uint8_t)(sno * 31 + i), BENCH_RECORDSIZE);
+    if (versions[sno])
+        memcpy(&buff[0], &(uint32_t){sno}, 4);
+}
+
+/*
+ * @brief pass the simulated time to the write buffer in whole ms
+ *
+ */
+static void TickBuffer(void)
+{
+    uint64_t ms = (esFtl_SimGetTime() - tickTime) / 1000000;
+
+    if (!ms)
+        return;
+
+    esFtl_WriteBufferTick((uint32_t)ms);
+    tickTime += ms * 1000000;
+}
+
+static void Prefill(BenchResult *res, uint32_t sectors)
+{
+    uint32_t i = 0;
+
+    for (i = 0; i < sectors; i++)
+        HostWrite(res, i);
+}
+
+/*
+ * @brief build the cumulative distribution of a zipfian popularity over n sectors,
+ * the ranks are shuffled so that the hot set is scattered over the volume
+ *
+ * @param n
+ */
+static void PrepareZipf(uint32_t n)
+{
+    double sum = 0;
+    uint32_t i = 0, j = 0;
+    uint16_t tmp = 0;
+
+    free(zipfCdf);
+    free(zipfOrder);
+    zipfCdf = malloc(n * sizeof(double));
+    zipfOrder = malloc(n * sizeof(uint16_t));
+    if (!zipfCdf || !zipfOrder)
+        exit(1);
+
+    for (i = 0; i < n; i++)
+    {
+        sum += 1.0 / pow(i + 1, BENCH_ZIPFTHETA);
+        zipfCdf[i] = sum;
+        zipfOrder[i] = (uint16_t)i;
+    }
+
+    for (i = 0; i < n; i++)
+        zipfCdf[i] /= sum;
+
+    for (i = n - 1; i > 0; i--)
+    {
+        j = Random() % (i + 1);
+        tmp = zipfOrder[i];
+        zipfOrder[i] = zipfOrder[j];
+        zipfOrder[j] = tmp;
+    }
+
+    zipfCdf[n - 1] = 1.0;
+    zipfCount = n;
+}
+
+static uint16_t NextZipf(void)
+{
+    double u = (Random() + 0.5) / 4294967296.0;
+    uint32_t lo = 0, hi = zipfCount - 1, mid = 0;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (zipfCdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return zipfOrder[lo];
+}
+
+static uint32_t Random(void)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+static void RecordLatency(LatencyLog *log, uint64_t ns)
+{
+    if (log->count < log->size)
+        log->samples[log->count++] = ns;
+}
+
+static int CompareU64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t Percentile(LatencyLog *log, double pct)
+{
+    uint32_t idx = 0;
+
+    if (!log->count)
+        return 0;
+
+    idx = (uint32_t)(pct / 100.0 * (log->count - 1) + 0.5);
+    return log->samples[idx];
+}
+
+static void PrintLatency(const char *name, LatencyLog *log)
+{
+    qsort(log->samples, log->count, sizeof(uint64_t), CompareU64);
+    printf("\"%s\":{\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},", name,
+           (unsigned long long)Percentile(log, 50), (unsigned long long)Percentile(log, 90),
+           (unsigned long long)Percentile(log, 99), (unsigned long long)Percentile(log, 99.9),
+           (unsigned long long)Percentile(log, 100));
+}
+
+static double WallTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
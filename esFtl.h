@@ -24,5 +24,12 @@
 #include "esFtl_read.h"
 #include "esFtl_write.h"
 #include "esFtl_defragment.h"
+#include "esFtl_blocks.h"
+#include "esFtl_buffer.h"
+#include "esFtl_vector.h"
+#include "esFtl_checksum.h"
+#include "esFtl_readcache.h"
+#include "esFtl_readahead.h"
+#include "esFtl_scrub.h"
 
 #endif
\ No newline at end of file
@@ -19,26 +19,145 @@
 #include "esFtl_cache.h"
 #include "esFtl_disk.h"
 #include "esFtl_write.h"
+#include "esFtl_checksum.h"
 #include "esFtl_bbm.h"
+#include "esFtl_checkpoint.h"
+
+/*
+ * The bad blocks are kept in a table, a bit per block, of which every one of
+ * the ESFTL_BBTBLOCKS reserved blocks holds a copy on its first page with a
+ * version and a crc. A mount reads the copies and takes the newest whole
+ * one, a copy which is missing or older is written again. The copies are
+ * written one after the other, so a power loss leaves at least one of them
+ * whole. Only a format or a mount which finds no copy tests every block.
+ * The table also holds the checksum kind of the image, the only place every
+ * mount reads in both modes.
+ */
+#define BBTMAGIC 0x54424645
+#define GOODMARKER 0xFF /* first spare byte of the first page of a block good from the factory, the FTL never programs it */
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint16_t numBlocks;
+    uint16_t crc;
+    uint16_t checksum; /* format flag, the kind of every checksum of the image */
+    uint16_t reserved;
+} BbtHeader;
 
 static uint8_t blockStatus[ESFTL_NANDNUMBLOCKS / 8];
+static uint8_t bbtPage[sizeof(BbtHeader) + ESFTL_NANDNUMBLOCKS / 8];
+static uint32_t bbtVersion = 0;
+static uint16_t bbtChecksum = ESFTL_CHECKSUM;
+
+static int ReadTable(uint16_t block, uint32_t *version, uint16_t *checksum);
+static int WriteTable(void);
+static void SetBad(uint16_t block);
 
 /*
- * @brief determine bad blocks
+ * @brief load the bad block table and select the checksum of the image, the
+ * blocks are tested if there is no table or if a format is requested. A format
+ * takes the checksum selected before, ESFTL_CHECKSUM
  *
+ * @param format
+ * @return 0 if it is successful, -1 if the checksum of the image is unknown or
+ * this build can not compute it, nothing is written then
  */
-void esFtl_TestForBadBlocks(void)
+int esFtl_LoadBadBlocks(uint8_t format)
 {
-    uint8_t tmp[2] = {0};
-    int i = 0;
+    uint32_t version = 0;
+    uint16_t checksum = 0, kind = esFtl_GetChecksum();
+    int i = 0, copies = 0;
 
     memset(blockStatus, 0, sizeof(blockStatus));
+    bbtVersion = 0;
+
+    for (i = 0; i < ESFTL_BBTBLOCKS; i++)
+    {
+        if (ReadTable(ESFTL_BBTFIRSTBLOCK + i, &version, &checksum))
+            continue;
+
+        if (!copies || version > bbtVersion)
+        {
+            memcpy(blockStatus, &bbtPage[sizeof(BbtHeader)], sizeof(blockStatus));
+            bbtVersion = version;
+            kind = checksum;
+            copies = 0;
+        }
+
+        if (version == bbtVersion)
+            copies++;
+    }
+
+    if (format)
+        kind = esFtl_GetChecksum();
+
+    if (copies && esFtl_SelectChecksum(kind))
+        return -1;
+
+    bbtChecksum = kind;
+
+    /* a format keeps the blocks known to be bad, they may not show a marker any more */
+    if (!copies || format)
+    {
+        if (esFtl_TestForBadBlocks() && !format)
+        {
+            /* the table is lost on an image holding data, only a checkpoint still tells its checksum */
+#if ESFTL_HYBRIDMAPPING
+            return -1;
+#else
+            if (esFtl_ReadCheckpointChecksum(&kind) || esFtl_SelectChecksum(kind))
+                return -1;
+            bbtChecksum = kind;
+#endif
+        }
+        WriteTable();
+    }
+    else if (copies < ESFTL_BBTBLOCKS)
+    {
+        WriteTable();
+    }
+
+    return 0;
+}
+
+/*
+ * @brief test every block which is not known to be bad, the table is not written
+ *
+ * @return 1 if a block holds data of the FTL
+ */
+int esFtl_TestForBadBlocks(void)
+{
+    uint8_t tmp[2] = {0}, spare[16];
+    int i = 0, j = 0, used = 0;
+
     for (i = 0; i < ESFTL_NANDNUMBLOCKS; i++)
     {
+        if (esFtl_IsBadBlockTable(i) || blockStatus[i / 8] & (1 << (i % 8)))
+            continue;
+
+        if (esFtl_NandFlashRead(i * ESFTL_NANDNUMPAGEBLOCK, ESFTL_NANDPAGEDATASIZE, spare, sizeof(spare)))
+            memset(spare, 0xFF, sizeof(spare));
+
+        if (spare[0] != GOODMARKER)
+        {
+            SetBad(i);
+            ESFTL_LOG("Factory bad block %d!!\n", i);
+            continue;
+        }
+
+        /* the sector number, the block tag or the hybrid header of the first page */
+        for (j = 1; j < (int)sizeof(spare); j++)
+        {
+            if (spare[j] != 0xFF)
+                used = 1;
+        }
+
         tmp[0] = 0x55;
         if (esFtl_NandFlashWrite(i * ESFTL_NANDNUMPAGEBLOCK, ESFTL_NANDPAGEDATASIZE + 48, tmp, 1))
         {
-            blockStatus[i / 8] |= 1 << (i % 8);
+            SetBad(i);
             ESFTL_LOG("Test block fail %d!!\n", i);
         }
 
@@ -46,100 +165,91 @@ void esFtl_TestForBadBlocks(void)
         esFtl_NandFlashRead(i * ESFTL_NANDNUMPAGEBLOCK, ESFTL_NANDPAGEDATASIZE + 48, &tmp[1], 1);
         if (tmp[1] != 0x55)
         {
-            blockStatus[i / 8] |= 1 << (i % 8);
+            SetBad(i);
             ESFTL_LOG("Test block fail %d!!\n", i);
         }
     }
+
+    return used;
 }
 
 /*
- * @brief ask whether the block is corrupted
+ * @brief erase every block for a format, the bad blocks keep their markers and the reserved ones the table
+ *
+ */
+void esFtl_FormatBlocks(void)
+{
+    int i = 0, failed = 0;
+
+    for (i = 0; i < ESFTL_NANDNUMBLOCKS; i++)
+    {
+        if (esFtl_IsBadBlockTable(i) || blockStatus[i / 8] & (1 << (i % 8)))
+            continue;
+
+        if (esFtl_NandFlashBlockErase(i) != 0)
+        {
+            ESFTL_LOG("Erase block fail %d!!\n", i);
+            SetBad(i);
+            failed = 1;
+        }
+    }
+
+    if (failed)
+        WriteTable();
+}
+
+/*
+ * @brief ask whether the block is corrupted, the blocks of the bad block table and of the checkpoints are never used by the log either
  *
  * @param block
  * @return 1 if the block is corrupted
  */
 int esFtl_IsBadBlock(uint16_t block)
 {
-    if (block >= ESFTL_NANDNUMBLOCKS)
+    if (block >= ESFTL_NANDNUMBLOCKS || esFtl_IsBadBlockTable(block))
+        return 1;
+#if !ESFTL_HYBRIDMAPPING
+    if (esFtl_IsCheckpointBlock(block))
         return 1;
+#endif
     return blockStatus[block / 8] & (1 << (block % 8));
 }
 
 /*
- * @brief ask whether the page belongs to a bad block
+ * @brief retire the block after a failed program or erase, the table on the flash is written again
  *
- * @param pno
- * @return 1 if the block is corrupted
+ * @param block
  */
-int esFtl_CheckIfPageInBadBlock(int pno)
+void esFtl_MarkBadBlock(uint16_t block)
 {
-    int bno = pno / ESFTL_NANDNUMPAGEBLOCK;
-    return esFtl_IsBadBlock(bno);
+    if (block >= ESFTL_NANDNUMBLOCKS || esFtl_IsBadBlockTable(block) || blockStatus[block / 8] & (1 << (block % 8)))
+        return;
+
+    SetBad(block);
+    WriteTable();
 }
 
 /*
- * @brief determines corrupted pages by controling their crcs
+ * @brief ask whether the block is reserved for a copy of the bad block table
  *
+ * @param block
+ * @return 1 if it is reserved
  */
-void esFtl_ControlPageCorruptions(void)
+int esFtl_IsBadBlockTable(uint16_t block)
 {
-    uint16_t sno, crc, crcTmp;
-    int corruptedPages = 0, checkedPages = 0;
-    uint8_t buff[ESFTL_NANDPAGEDATASIZE + 4];
-    uint8_t sectorTable[ESFTL_SECTORCACHESIZE];
-    int i = 0;
-
-    memset(buff, 0, sizeof(buff));
-    memset(sectorTable, 0, sizeof(sectorTable));
-
-    if (cursorEnd != cursorStart)
-    {
-        for (i = cursorEnd - 1; i != cursorStart; i--)
-        {
-            if (i < 0)
-            {
-                i = ESFTL_NANDNUMBLOCKS * ESFTL_NANDNUMPAGEBLOCK - 2;
-            }
-
-            memset(buff, 0, ESFTL_NANDPAGEDATASIZE + 4);
-            if (!esFtl_NandFlashRead(i, ESFTL_NANDPAGEDATASIZE, &buff[ESFTL_NANDPAGEDATASIZE], 4))
-            {
-                memcpy(&sno, &buff[ESFTL_NANDPAGEDATASIZE], 2);
-                memcpy(&crc, &buff[ESFTL_NANDPAGEDATASIZE + 2], 2);
-
-                if (sectorTable[sno / 8] & (1 << sno % 8))
-                {
-                    continue;
-                }
-                else
-                {
-                    if (!esFtl_NandFlashRead(i, 0, buff, ESFTL_NANDPAGEDATASIZE))
-                    {
-                        crcTmp = esFtl_CalcCrc16(0xFFFF, buff, ESFTL_NANDPAGEDATASIZE);
-
-                        if (crc != crcTmp)
-                        {
-                            ESFTL_LOG("Page %d is corrupted (Sector %d)\n", i, sno);
-                            corruptedPages++;
-                        }
-
-                        checkedPages++;
-                        sectorTable[sno / 8] |= 1 << sno % 8;
-                    }
-                    else
-                    {
-                        ESFTL_LOG("esFtl: FATAL ERROR: %d %s %d\n", i, __FILE__, __LINE__);
-                    }
-                }
-            }
-            else
-            {
-                ESFTL_LOG("esFtl: FATAL ERROR: %d %s %d\n", i, __FILE__, __LINE__);
-            }
-        }
-    }
+    return block >= ESFTL_BBTFIRSTBLOCK && block < ESFTL_BBTFIRSTBLOCK + ESFTL_BBTBLOCKS;
+}
 
-    ESFTL_LOG("%d pages are checked %d corrupted found\n", checkedPages, corruptedPages);
+/*
+ * @brief ask whether the page belongs to a bad block
+ *
+ * @param pno
+ * @return 1 if the block is corrupted
+ */
+int esFtl_CheckIfPageInBadBlock(int pno)
+{
+    int bno = pno / ESFTL_NANDNUMPAGEBLOCK;
+    return esFtl_IsBadBlock(bno);
 }
 
 /*
@@ -159,14 +269,14 @@ int esFtl_CheckCorruption(uint16_t sno, uint8_t *buff)
     pno = esFtl_FindSectorPage(sno);
     if (pno >= 0)
     {
-        memset(buff, 0, ESFTL_NANDPAGEDATASIZE + 4);
-        if (!esFtl_NandFlashRead(pno, 0, buff, ESFTL_NANDPAGEDATASIZE + 4))
+        memset(buff, 0, ESFTL_PAGEBUFFSIZE);
+        if (!esFtl_NandFlashRead(pno, 0, buff, ESFTL_PAGEBUFFSIZE))
         {
-            memcpy(&snoTmp, &buff[ESFTL_NANDPAGEDATASIZE], 2);
+            memcpy(&snoTmp, &buff[ESFTL_SPAREOFFSET], 2);
             if (sno == snoTmp)
             {
-                memcpy(&crc, &buff[ESFTL_NANDPAGEDATASIZE + 2], 2);
-                crcTmp = esFtl_CalcCrc16(0xFFFF, buff, ESFTL_NANDPAGEDATASIZE);
+                memcpy(&crc, &buff[ESFTL_SPAREOFFSET + 2], 2);
+                crcTmp = esFtl_CalcChecksum(buff, ESFTL_NANDPAGEDATASIZE);
                 if (crc != crcTmp)
                 {
                     ESFTL_LOG("Page %d is corrupted (Sector %d)\n", pno, sno);
@@ -190,3 +300,79 @@ int esFtl_CheckCorruption(uint16_t sno, uint8_t *buff)
 
     return 0;
 }
+
+/*
+ * @brief read a copy of the table to bbtPage
+ *
+ * @param block
+ * @param version set to the version of the copy
+ * @param checksum set to the checksum kind of the image
+ * @return 0 if the copy is whole
+ */
+static int ReadTable(uint16_t block, uint32_t *version, uint16_t *checksum)
+{
+    BbtHeader hdr;
+    uint16_t crc = 0;
+
+    if (esFtl_NandFlashRead(block * ESFTL_NANDNUMPAGEBLOCK, 0, bbtPage, sizeof(bbtPage)))
+        return -1;
+
+    memcpy(&hdr, bbtPage, sizeof(hdr));
+    if (hdr.magic != BBTMAGIC || hdr.numBlocks != ESFTL_NANDNUMBLOCKS)
+        return -1;
+
+    /* the crc is computed with its own field cleared */
+    crc = hdr.crc;
+    hdr.crc = 0;
+    memcpy(bbtPage, &hdr, sizeof(hdr));
+    if (esFtl_CalcCrc16(0xFFFF, bbtPage, sizeof(bbtPage)) != crc)
+    {
+        ESFTL_LOG("Bad block table of block %d is corrupted\n", block);
+        return -1;
+    }
+
+    *version = hdr.version;
+    *checksum = hdr.checksum;
+    return 0;
+}
+
+/*
+ * @brief write a new version of the table to every reserved block
+ *
+ * @return 0 if at least one copy is written
+ */
+static int WriteTable(void)
+{
+    BbtHeader hdr;
+    int i = 0, written = 0;
+    uint16_t block = 0;
+
+    hdr.magic = BBTMAGIC;
+    hdr.version = ++bbtVersion;
+    hdr.numBlocks = ESFTL_NANDNUMBLOCKS;
+    hdr.crc = 0;
+    hdr.checksum = bbtChecksum;
+    hdr.reserved = 0xFFFF;
+    memcpy(bbtPage, &hdr, sizeof(hdr));
+    memcpy(&bbtPage[sizeof(hdr)], blockStatus, sizeof(blockStatus));
+    hdr.crc = esFtl_CalcCrc16(0xFFFF, bbtPage, sizeof(bbtPage));
+    memcpy(bbtPage, &hdr, sizeof(hdr));
+
+    for (i = 0; i < ESFTL_BBTBLOCKS; i++)
+    {
+        block = ESFTL_BBTFIRSTBLOCK + i;
+        if (esFtl_NandFlashBlockErase(block) || esFtl_NandFlashWrite(block * ESFTL_NANDNUMPAGEBLOCK, 0, bbtPage, sizeof(bbtPage)))
+        {
+            ESFTL_LOG("Write bad block table fail %d!!\n", block);
+            continue;
+        }
+        written++;
+    }
+
+    return written ? 0 : -1;
+}
+
+static void SetBad(uint16_t block)
+{
+    blockStatus[block / 8] |= 1 << (block % 8);
+}
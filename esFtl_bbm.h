@@ -18,9 +18,18 @@
 #ifndef ESFTL_BBM_H__
 #define ESFTL_BBM_H__
 
-void esFtl_TestForBadBlocks(void);
+#if ESFTL_HYBRIDMAPPING
+#define ESFTL_BBTFIRSTBLOCK (ESFTL_NANDNUMBLOCKS - ESFTL_BBTBLOCKS)
+#else
+#define ESFTL_BBTFIRSTBLOCK (ESFTL_NANDNUMBLOCKS - ESFTL_CHECKPOINTBLOCKS - ESFTL_BBTBLOCKS)
+#endif
+
+int esFtl_LoadBadBlocks(uint8_t format);
+int esFtl_TestForBadBlocks(void);
+void esFtl_FormatBlocks(void);
 int esFtl_IsBadBlock(uint16_t block);
-void esFtl_ControlPageCorruptions(void);
+void esFtl_MarkBadBlock(uint16_t block);
+int esFtl_IsBadBlockTable(uint16_t block);
 int esFtl_CheckIfPageInBadBlock(int pno);
 int esFtl_CheckCorruption(uint16_t sno, uint8_t *buff);
 
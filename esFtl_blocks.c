@@ -0,0 +1,1007 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "esFtl_definitions.h"
+#include "esFtl_disk.h"
+#include "esFtl_bbm.h"
+#include "esFtl_cache.h"
+#include "esFtl_summary.h"
+#include "esFtl_blocks.h"
+
+#if !ESFTL_HYBRIDMAPPING
+
+/*
+ * The log is a chain of blocks ordered by the sequence number which is put
+ * to the spare of the first page when a block is allocated, so any block can
+ * be cleaned and reused. A block erased after the last checkpoint is not
+ * allocated again until the next one, the allocations after a checkpoint
+ * are then repeatable at mount. Sequence numbers wrap at 16 bits, the
+ * defragment keeps every block younger than ESFTL_GCMAXAGE allocations.
+ * The byte before the sequence number tells the cold blocks, which take the
+ * pages moved by the defragment, from the blocks of the host writes.
+ *
+ * Every block has an erase counter, kept in the checkpoint and written after
+ * the sequence number when the block is allocated. The least worn free block
+ * is allocated first, which depends only on the state of the last checkpoint
+ * since the blocks erased after it are not free yet.
+ *
+ * A block cleaned by a defragment step of a write is not erased there, its
+ * tag is cleared instead and it is erased later while the device is idle or
+ * when it is allocated. Such dirty blocks count as free.
+ */
+#define BLOCKTAGOFFSET (ESFTL_SPAREOFFSET + 5)
+#define BLOCKTAGSIZE 7
+#define BLOCKTAGHOST 0xFF
+#define BLOCKTAGCOLD 0xC0
+#define BLOCKTAGDIRTY 0x00
+#define ERASESUNKNOWN 0xFFFFFFFF
+
+static uint16_t blockSeq[ESFTL_NANDNUMBLOCKS];
+static uint8_t validPages[ESFTL_NANDNUMBLOCKS];
+static uint8_t validBitmap[ESFTL_NANDNUMBLOCKS * ESFTL_NANDNUMPAGEBLOCK / 8]; /* pages holding the current copy of a sector or a translation page */
+static uint8_t releasedBlocks[ESFTL_NANDNUMBLOCKS / 8];
+static uint8_t coldBlocks[ESFTL_NANDNUMBLOCKS / 8];
+static uint8_t dirtyBlocks[ESFTL_NANDNUMBLOCKS / 8]; /* blocks out of the log which still wait for their erase */
+static uint8_t suspectBlocks[ESFTL_NANDNUMBLOCKS / 8]; /* log blocks holding a page the scrubber found corrupted */
+static uint8_t failedBlocks[ESFTL_NANDNUMBLOCKS / 8];  /* log blocks where a program failed, they are marked bad once they are cleaned */
+static uint32_t eraseCounts[ESFTL_NANDNUMBLOCKS];
+static uint32_t staticMoves = 0;
+static uint32_t eraseWaits = 0;
+static uint32_t idleErases = 0;
+static int numDirtyBlocks = 0;
+static int numSuspectBlocks = 0;
+static uint16_t nextSeq = 0;
+static uint16_t checkpointSeq = 0;
+static int freeBlocks = 0;
+static int numReleasedBlocks = 0;
+static uint8_t validPagesKnown = 0;
+static int lastLogBlock = -1;
+static int lastAllocated = -1;
+
+static int OldestLogBlock(void);
+static int IsReleased(uint16_t block);
+static int NextCandidate(int after);
+static int IsDirty(uint16_t block);
+static int EraseBlock(uint16_t block);
+static void TakeBlock(uint16_t block, uint8_t cold);
+static int LeastWornLogBlock(uint32_t *maxErases);
+static void CountFreeBlocks(void);
+static void ClearBlockValidity(uint16_t block);
+
+/*
+ * @brief forget every block, all the good ones are free
+ *
+ */
+void esFtl_ResetBlocks(void)
+{
+    memset(blockSeq, 0xFF, sizeof(blockSeq));
+    memset(validPages, 0, sizeof(validPages));
+    memset(validBitmap, 0, sizeof(validBitmap));
+    memset(releasedBlocks, 0, sizeof(releasedBlocks));
+    memset(coldBlocks, 0, sizeof(coldBlocks));
+    memset(dirtyBlocks, 0, sizeof(dirtyBlocks));
+    memset(suspectBlocks, 0, sizeof(suspectBlocks));
+    memset(failedBlocks, 0, sizeof(failedBlocks));
+    memset(eraseCounts, 0, sizeof(eraseCounts));
+    nextSeq = 0;
+    checkpointSeq = 0;
+    numReleasedBlocks = 0;
+    numDirtyBlocks = 0;
+    numSuspectBlocks = 0;
+    validPagesKnown = 0;
+    lastLogBlock = -1;
+    lastAllocated = -1;
+    CountFreeBlocks();
+}
+
+/*
+ * @brief read the sequence number of every block, it sets cursorStart to the oldest block
+ *
+ * @param newestCold set to the newest cold block, -1 if there is none
+ * @return the newest block of the host writes, -1 if there is none
+ */
+int esFtl_ScanBlocks(int *newestCold)
+{
+    uint8_t tag[BLOCKTAGSIZE];
+    uint16_t seq = 0, ref = 0;
+    int16_t offset = 0, oldestOffset = 0, newestOffset = 0, hostOffset = 0, coldOffset = 0;
+    int block = 0, oldest = -1, newest = -1, host = -1, known = 0;
+    uint64_t erases = 0;
+
+    esFtl_ResetBlocks();
+    *newestCold = -1;
+
+    for (block = 0; block < ESFTL_NANDNUMBLOCKS; block++)
+    {
+        if (esFtl_IsBadBlock(block))
+            continue;
+
+        if (esFtl_NandFlashRead(block * ESFTL_NANDNUMPAGEBLOCK, BLOCKTAGOFFSET, tag, sizeof(tag)))
+        {
+            ESFTL_LOG("esFTL: FATAL ERROR: %d %s %d\n", block, __FILE__, __LINE__);
+            continue;
+        }
+
+        memcpy(&seq, &tag[1], sizeof(seq));
+        if (seq == ESFTL_BLOCKFREE)
+        {
+            eraseCounts[block] = ERASESUNKNOWN;
+            continue;
+        }
+
+        /* the count was written when the block was allocated, it has been erased once more since */
+        memcpy(&eraseCounts[block], &tag[3], sizeof(uint32_t));
+        if (eraseCounts[block] != ERASESUNKNOWN)
+        {
+            erases += eraseCounts[block];
+            known++;
+        }
+
+        /* a dirty block is out of the log, its erase is already counted */
+        if (tag[0] == BLOCKTAGDIRTY)
+        {
+            if (eraseCounts[block] != ERASESUNKNOWN)
+                eraseCounts[block]++;
+            dirtyBlocks[block / 8] |= 1 << (block % 8);
+            numDirtyBlocks++;
+            continue;
+        }
+
+        if (newest < 0)
+            ref = seq;
+
+        /* the blocks of the log are within half of the sequence space */
+        offset = (int16_t)(seq - ref);
+        if (newest < 0 || offset > newestOffset)
+        {
+            newest = block;
+            newestOffset = offset;
+        }
+        if (oldest < 0 || offset < oldestOffset)
+        {
+            oldest = block;
+            oldestOffset = offset;
+        }
+
+        if (tag[0] == BLOCKTAGCOLD)
+        {
+            coldBlocks[block / 8] |= 1 << (block % 8);
+            if (*newestCold < 0 || offset > coldOffset)
+            {
+                *newestCold = block;
+                coldOffset = offset;
+            }
+        }
+        else if (host < 0 || offset > hostOffset)
+        {
+            host = block;
+            hostOffset = offset;
+        }
+
+        blockSeq[block] = seq;
+        freeBlocks--;
+    }
+
+    /* the erased blocks do not tell their counts, they are taken as average */
+    for (block = 0; block < ESFTL_NANDNUMBLOCKS; block++)
+    {
+        if (eraseCounts[block] == ERASESUNKNOWN)
+            eraseCounts[block] = known ? (uint32_t)(erases / known) : 0;
+    }
+
+    if (newest < 0)
+        return -1;
+
+    nextSeq = blockSeq[newest] + 1;
+    if (nextSeq == ESFTL_BLOCKFREE)
+        nextSeq = 0;
+    checkpointSeq = nextSeq;
+    lastAllocated = newest;
+    cursorStart = oldest * ESFTL_NANDNUMPAGEBLOCK;
+
+    return host;
+}
+
+/*
+ * @brief copy the block table for a checkpoint, the released blocks are stored as free
+ *
+ * @param table
+ */
+void esFtl_SaveBlocks(esFtl_BlockTable *table)
+{
+    int block = 0;
+
+    memcpy(table->blockSeq, blockSeq, sizeof(blockSeq));
+    memcpy(table->coldBlocks, coldBlocks, sizeof(coldBlocks));
+    memcpy(table->dirtyBlocks, dirtyBlocks, sizeof(dirtyBlocks));
+
+    table->eraseBase = ERASESUNKNOWN;
+    for (block = 0; block < ESFTL_NANDNUMBLOCKS; block++)
+    {
+        if (eraseCounts[block] < table->eraseBase)
+            table->eraseBase = eraseCounts[block];
+    }
+
+    for (block = 0; block < ESFTL_NANDNUMBLOCKS; block++)
+    {
+        table->eraseCounts[block] = (eraseCounts[block] - table->eraseBase > 0xFFFF) ? 0xFFFF
+                                                                                     : eraseCounts[block] - table->eraseBase;
+    }
+    table->nextSeq = nextSeq;
+    table->reserved = 0xFFFF;
+}
+
+/*
+ * @brief restore the block table from a checkpoint
+ *
+ * @param table
+ */
+void esFtl_LoadBlocks(const esFtl_BlockTable *table)
+{
+    uint16_t last = (table->nextSeq ? table->nextSeq : ESFTL_BLOCKFREE) - 1;
+    int block = 0;
+
+    esFtl_ResetBlocks();
+    memcpy(blockSeq, table->blockSeq, sizeof(blockSeq));
+    memcpy(coldBlocks, table->coldBlocks, sizeof(coldBlocks));
+    memcpy(dirtyBlocks, table->dirtyBlocks, sizeof(dirtyBlocks));
+    nextSeq = table->nextSeq;
+    checkpointSeq = table->nextSeq;
+    CountFreeBlocks();
+
+    for (block = 0; block < ESFTL_NANDNUMBLOCKS; block++)
+    {
+        eraseCounts[block] = table->eraseBase + table->eraseCounts[block];
+        if (IsDirty(block))
+            numDirtyBlocks++;
+        if (blockSeq[block] == last)
+            lastAllocated = block;
+    }
+}
+
+/*
+ * @brief take the least worn free block for a write frontier
+ *
+ * @param cold 1 if the block takes the pages moved by the defragment
+ * @return block number, -1 if there is no free block
+ */
+int esFtl_AllocateBlock(uint8_t cold)
+{
+    uint8_t tag[BLOCKTAGSIZE], want[BLOCKTAGSIZE];
+    int block = 0;
+
+    want[0] = cold ? BLOCKTAGCOLD : BLOCKTAGHOST;
+    memcpy(&want[1], &nextSeq, sizeof(nextSeq));
+
+    while ((block = NextCandidate(-1)) >= 0)
+    {
+        /* no erased block was left for the write, it waits for the erase */
+        if (IsDirty(block))
+        {
+            eraseWaits++;
+            if (EraseBlock(block))
+                continue;
+        }
+
+        memcpy(&want[3], &eraseCounts[block], sizeof(uint32_t));
+        if (esFtl_NandFlashRead(block * ESFTL_NANDNUMPAGEBLOCK, BLOCKTAGOFFSET, tag, sizeof(tag)))
+            memset(tag, 0xFF, sizeof(tag));
+
+        if (memcmp(tag, want, sizeof(tag)) && esFtl_NandFlashWrite(block * ESFTL_NANDNUMPAGEBLOCK, BLOCKTAGOFFSET, want, sizeof(want)))
+        {
+            ESFTL_LOG("Allocate block fail %d!!\n", block);
+            esFtl_MarkBadBlock(block);
+            freeBlocks--;
+            continue;
+        }
+
+        TakeBlock(block, cold);
+        return block;
+    }
+
+    return -1;
+}
+
+/*
+ * @brief take over the next block which was allocated after the checkpoint
+ * the table comes from, the allocations are found again in the same order
+ *
+ * @param cold set to 1 if it is a cold block
+ * @return block number, -1 if no more block was allocated
+ */
+int esFtl_AdoptBlock(uint8_t *cold)
+{
+    uint8_t tag[BLOCKTAGSIZE];
+    uint16_t seq = 0;
+    int block = 0;
+
+    while ((block = NextCandidate(-1)) >= 0)
+    {
+        if (esFtl_NandFlashRead(block * ESFTL_NANDNUMPAGEBLOCK, BLOCKTAGOFFSET, tag, sizeof(tag)))
+            return -1;
+
+        memcpy(&seq, &tag[1], sizeof(seq));
+        if (seq == nextSeq && tag[0] != BLOCKTAGDIRTY)
+        {
+            *cold = tag[0] == BLOCKTAGCOLD;
+            TakeBlock(block, *cold);
+            return block;
+        }
+
+        /* a dirty block still waiting for its erase was not allocated */
+        if (tag[0] == BLOCKTAGDIRTY && IsDirty(block))
+            return -1;
+
+        if (seq == ESFTL_BLOCKFREE && tag[0] == 0xFF)
+        {
+            if (IsDirty(block))
+            {
+                dirtyBlocks[block / 8] &= ~(1 << (block % 8));
+                numDirtyBlocks--;
+            }
+            return -1;
+        }
+
+        /* the allocation of the block failed before, it was not used */
+        esFtl_MarkBadBlock(block);
+        freeBlocks--;
+    }
+
+    return -1;
+}
+
+/*
+ * @brief take an erased block out of the log, it is free after the next checkpoint
+ *
+ * @param block
+ */
+void esFtl_ReleaseBlock(uint16_t block)
+{
+    if (blockSeq[block] == ESFTL_BLOCKFREE)
+        return;
+
+    eraseCounts[block]++;
+
+    blockSeq[block] = ESFTL_BLOCKFREE;
+    coldBlocks[block / 8] &= ~(1 << (block % 8));
+    ClearBlockValidity(block);
+    failedBlocks[block / 8] &= ~(1 << (block % 8));
+
+    if (esFtl_IsSuspectBlock(block))
+    {
+        suspectBlocks[block / 8] &= ~(1 << (block % 8));
+        numSuspectBlocks--;
+    }
+
+    if (!esFtl_IsBadBlock(block))
+    {
+        releasedBlocks[block / 8] |= 1 << (block % 8);
+        numReleasedBlocks++;
+    }
+
+    if (block == cursorStart / ESFTL_NANDNUMPAGEBLOCK)
+        cursorStart = OldestLogBlock() * ESFTL_NANDNUMPAGEBLOCK;
+}
+
+/*
+ * @brief take a block out of the log without erasing it, its tag is cleared
+ * so that a scan does not take it for a part of the log. It is erased by
+ * esFtl_EraseDirtyBlock or when it is allocated
+ *
+ * @param block
+ */
+void esFtl_RetireBlock(uint16_t block)
+{
+    uint8_t tag = BLOCKTAGDIRTY;
+
+    if (blockSeq[block] == ESFTL_BLOCKFREE)
+        return;
+
+    if (esFtl_NandFlashWrite(block * ESFTL_NANDNUMPAGEBLOCK, BLOCKTAGOFFSET, &tag, sizeof(tag)))
+    {
+        ESFTL_LOG("Retire block fail %d!!\n", block);
+        esFtl_MarkBadBlock(block);
+    }
+    else
+    {
+        dirtyBlocks[block / 8] |= 1 << (block % 8);
+        numDirtyBlocks++;
+    }
+
+    esFtl_ReleaseBlock(block);
+}
+
+/*
+ * @brief erase a dirty block which is allocated soon, it is meant to be
+ * called while the device is idle so that the writes find erased blocks
+ *
+ * @param ahead count of the blocks allocated next which are looked at, all
+ * the dirty blocks are erased one by one if it is at least the count of blocks
+ * @return 1 if a block is erased
+ */
+int esFtl_EraseDirtyBlock(uint16_t ahead)
+{
+    int i = 0, block = -1;
+
+    if (!numDirtyBlocks)
+        return 0;
+
+    if (ahead >= ESFTL_NANDNUMBLOCKS)
+    {
+        for (block = 0; block < ESFTL_NANDNUMBLOCKS && !IsDirty(block); block++)
+            ;
+    }
+    else
+    {
+        for (i = 0; i < ahead; i++)
+        {
+            block = NextCandidate(block);
+            if (block < 0 || IsDirty(block))
+                break;
+        }
+    }
+
+    if (block < 0 || block >= ESFTL_NANDNUMBLOCKS || !IsDirty(block))
+        return 0;
+
+    idleErases++;
+    EraseBlock(block);
+    return 1;
+}
+
+/*
+ * @brief a checkpoint is written, the released blocks can be allocated again
+ *
+ */
+void esFtl_ReuseReleasedBlocks(void)
+{
+    memset(releasedBlocks, 0, sizeof(releasedBlocks));
+    freeBlocks += numReleasedBlocks;
+    numReleasedBlocks = 0;
+    checkpointSeq = nextSeq;
+}
+
+/*
+ * @brief count of the blocks which are free or become free at the next checkpoint
+ *
+ * @return count of blocks
+ */
+int esFtl_NumFreeBlocks(void)
+{
+    return freeBlocks + numReleasedBlocks;
+}
+
+/*
+ * @brief count of the blocks which wait for the next checkpoint to be reused
+ *
+ * @return count of blocks
+ */
+int esFtl_NumReleasedBlocks(void)
+{
+    return numReleasedBlocks;
+}
+
+/*
+ * @brief ask whether a block can be allocated now
+ *
+ * @param keep free blocks which have to be left to the others
+ * @return 1 if there is one
+ */
+int esFtl_HasFreeBlock(int keep)
+{
+    return freeBlocks > keep;
+}
+
+/*
+ * @brief ask whether the block belongs to the log
+ *
+ * @param block
+ * @return 1 if it does
+ */
+int esFtl_IsLogBlock(uint16_t block)
+{
+    return block < ESFTL_NANDNUMBLOCKS && blockSeq[block] != ESFTL_BLOCKFREE;
+}
+
+/*
+ * @brief ask whether the block takes the pages moved by the defragment
+ *
+ * @param block
+ * @return 1 if it does
+ */
+int esFtl_IsColdBlock(uint16_t block)
+{
+    return (coldBlocks[block / 8] >> (block % 8)) & 1;
+}
+
+/*
+ * @brief collect the erase counts of the good blocks, the checkpoint blocks are not counted
+ *
+ * @param stats
+ */
+void esFtl_GetWearStats(esFtl_WearStats *stats)
+{
+    int block = 0, blocks = 0;
+
+    memset(stats, 0, sizeof(esFtl_WearStats));
+    stats->minErases = ERASESUNKNOWN;
+
+    for (block = 0; block < ESFTL_NANDNUMBLOCKS; block++)
+    {
+        if (esFtl_IsBadBlock(block))
+            continue;
+
+        if (eraseCounts[block] < stats->minErases)
+            stats->minErases = eraseCounts[block];
+        if (eraseCounts[block] > stats->maxErases)
+            stats->maxErases = eraseCounts[block];
+        stats->totalErases += eraseCounts[block];
+        blocks++;
+    }
+
+    if (!blocks)
+        stats->minErases = 0;
+    else
+        stats->meanErases = (uint32_t)(stats->totalErases / blocks);
+    stats->staticMoves = staticMoves;
+}
+
+/*
+ * @brief collect how the blocks are erased ahead of the writes
+ *
+ * @param stats
+ */
+void esFtl_GetEraseStats(esFtl_EraseStats *stats)
+{
+    int block = 0;
+
+    memset(stats, 0, sizeof(esFtl_EraseStats));
+    for (block = 0; block < ESFTL_NANDNUMBLOCKS; block++)
+    {
+        if (blockSeq[block] != ESFTL_BLOCKFREE || esFtl_IsBadBlock(block))
+            continue;
+
+        if (IsDirty(block))
+            stats->dirtyBlocks++;
+        else
+            stats->erasedBlocks++;
+    }
+
+    stats->eraseWaits = eraseWaits;
+    stats->idleErases = idleErases;
+}
+
+/*
+ * @brief count of the blocks allocated after the block
+ *
+ * @param block
+ * @return age of the block
+ */
+uint16_t esFtl_BlockAge(uint16_t block)
+{
+    return nextSeq - blockSeq[block] - 1;
+}
+
+/*
+ * @brief position of the page in the log counted from cursorStart, the blocks
+ * released from the middle of the log leave gaps
+ *
+ * @param pno
+ * @return order, 0xFFFFFFFF if the page is not in the log
+ */
+uint32_t esFtl_LogOrder(int pno)
+{
+    uint16_t block = pno / ESFTL_NANDNUMPAGEBLOCK;
+
+    if (blockSeq[block] == ESFTL_BLOCKFREE)
+        return 0xFFFFFFFF;
+
+    return (uint32_t)(uint16_t)(blockSeq[block] - blockSeq[cursorStart / ESFTL_NANDNUMPAGEBLOCK]) * ESFTL_NANDNUMPAGEBLOCK +
+           pno % ESFTL_NANDNUMPAGEBLOCK;
+}
+
+/*
+ * @brief find the page of the log at the given position, a position in a gap
+ * is moved to the nearest page in the given direction
+ *
+ * @param order it is updated if it is in a gap
+ * @param backward
+ * @return page number, -1 if there is no page in that direction
+ */
+int esFtl_LogPage(uint32_t *order, uint8_t backward)
+{
+    uint16_t base = blockSeq[cursorStart / ESFTL_NANDNUMPAGEBLOCK], offset = 0, bestOffset = 0;
+    uint32_t want = *order / ESFTL_NANDNUMPAGEBLOCK;
+    int block = 0, best = -1;
+
+    /* the log is mostly walked page by page, the last block is tried first */
+    if (lastLogBlock >= 0 && blockSeq[lastLogBlock] != ESFTL_BLOCKFREE &&
+        (uint16_t)(blockSeq[lastLogBlock] - base) == want)
+        return lastLogBlock * ESFTL_NANDNUMPAGEBLOCK + *order % ESFTL_NANDNUMPAGEBLOCK;
+
+    for (block = 0; block < ESFTL_NANDNUMBLOCKS; block++)
+    {
+        if (blockSeq[block] == ESFTL_BLOCKFREE)
+            continue;
+
+        offset = blockSeq[block] - base;
+        if (backward ? (offset <= want && (best < 0 || offset > bestOffset))
+                     : (offset >= want && (best < 0 || offset < bestOffset)))
+        {
+            best = block;
+            bestOffset = offset;
+        }
+    }
+
+    if (best < 0)
+        return -1;
+
+    if (bestOffset != want)
+        *order = (uint32_t)bestOffset * ESFTL_NANDNUMPAGEBLOCK + (backward ? ESFTL_NANDNUMPAGEBLOCK - 1 : 0);
+
+    lastLogBlock = best;
+    return best * ESFTL_NANDNUMPAGEBLOCK + *order % ESFTL_NANDNUMPAGEBLOCK;
+}
+
+/*
+ * @brief start tracking the valid pages from none
+ *
+ */
+void esFtl_ResetValidPages(void)
+{
+    memset(validPages, 0, sizeof(validPages));
+    memset(validBitmap, 0, sizeof(validBitmap));
+    validPagesKnown = 1;
+}
+
+/*
+ * @brief ask whether the valid pages are tracked since the mount
+ *
+ * @return 1 if they are
+ */
+int esFtl_ValidPagesKnown(void)
+{
+    return validPagesKnown;
+}
+
+/*
+ * @brief a page becomes valid or invalid, the count of its block follows the bit
+ *
+ * @param pno
+ * @param valid
+ */
+void esFtl_SetPageValid(uint16_t pno, uint8_t valid)
+{
+    uint8_t bit = 1 << (pno % 8);
+
+    if (!validPagesKnown || !(validBitmap[pno / 8] & bit) == !valid)
+        return;
+
+    validBitmap[pno / 8] ^= bit;
+    if (valid)
+        validPages[pno / ESFTL_NANDNUMPAGEBLOCK]++;
+    else
+        validPages[pno / ESFTL_NANDNUMPAGEBLOCK]--;
+}
+
+/*
+ * @brief ask whether the page holds the current copy of its sector, the valid pages must be tracked
+ *
+ * @param pno
+ * @return 1 if it does
+ */
+int esFtl_IsPageValid(uint16_t pno)
+{
+    return (validBitmap[pno / 8] >> (pno % 8)) & 1;
+}
+
+/*
+ * @brief select the block which is cleaned next, a suspect block goes first.
+ * The blocks allocated after the last checkpoint and the blocks being filled
+ * are not cleaned
+ *
+ * @return block number, -1 if no block is worth cleaning
+ */
+int esFtl_SelectVictimBlock(void)
+{
+    uint16_t sinceCheckpoint = nextSeq - checkpointSeq, age = 0, bestAge = 0;
+    uint8_t bestValid = 0;
+    uint32_t maxErases = 0;
+    int block = 0, best = -1, open = cursorEnd / ESFTL_NANDNUMPAGEBLOCK;
+    int openCold = cursorCold < 0 ? -1 : cursorCold / ESFTL_NANDNUMPAGEBLOCK;
+
+    block = esFtl_SuspectVictim();
+    if (block >= 0)
+        return block;
+
+    block = cursorStart / ESFTL_NANDNUMPAGEBLOCK;
+    if (block != open && block != openCold && esFtl_BlockAge(block) > ESFTL_GCMAXAGE)
+        return block;
+
+    /* static data keeps its block out of the wear, it is moved once the others are worn too far ahead */
+    block = LeastWornLogBlock(&maxErases);
+    if (block >= 0 && maxErases - eraseCounts[block] > ESFTL_WEARLEVELSPREAD)
+    {
+        staticMoves++;
+        return block;
+    }
+
+    for (block = 0; block < ESFTL_NANDNUMBLOCKS; block++)
+    {
+        if (blockSeq[block] == ESFTL_BLOCKFREE || block == open || block == openCold || validPages[block] >= ESFTL_SUMMARYENTRIES)
+            continue;
+
+        age = esFtl_BlockAge(block);
+        if (age < sinceCheckpoint)
+            continue;
+
+#if ESFTL_GCPOLICY == ESFTL_GCFIFO
+        if (best < 0 || age > bestAge)
+#elif ESFTL_GCPOLICY == ESFTL_GCGREEDY
+        if (best < 0 || validPages[block] < bestValid || (validPages[block] == bestValid && age > bestAge))
+#else
+        /* benefit per cost, (free space gained * age) / (pages read and written) */
+        if (best < 0 || (uint64_t)(ESFTL_SUMMARYENTRIES - validPages[block]) * (age + 1) * (ESFTL_SUMMARYENTRIES + bestValid) >
+                            (uint64_t)(ESFTL_SUMMARYENTRIES - bestValid) * (bestAge + 1) * (ESFTL_SUMMARYENTRIES + validPages[block]))
+#endif
+        {
+            best = block;
+            bestAge = age;
+            bestValid = validPages[block];
+        }
+    }
+
+    return best;
+}
+
+/*
+ * @brief mark a log block which holds a corrupted page, it is cleaned before any other
+ *
+ * @param block
+ * @return 1 if the block was not marked yet
+ */
+int esFtl_SuspectBlock(uint16_t block)
+{
+    if (blockSeq[block] == ESFTL_BLOCKFREE || esFtl_IsSuspectBlock(block))
+        return 0;
+
+    suspectBlocks[block / 8] |= 1 << (block % 8);
+    numSuspectBlocks++;
+    return 1;
+}
+
+/*
+ * @brief note a log block where a page failed to be programmed, no more pages
+ * are written to it and it is cleaned first. It stays in the log until then
+ * since a scan at mount skips the bad blocks
+ *
+ * @param block
+ */
+void esFtl_FailBlock(uint16_t block)
+{
+    if (blockSeq[block] == ESFTL_BLOCKFREE)
+        return;
+
+    failedBlocks[block / 8] |= 1 << (block % 8);
+    esFtl_SuspectBlock(block);
+}
+
+/*
+ * @brief ask whether a page of the block failed to be programmed
+ *
+ * @param block
+ * @return 1 if it did
+ */
+int esFtl_IsFailedBlock(uint16_t block)
+{
+    return (failedBlocks[block / 8] >> (block % 8)) & 1;
+}
+
+/*
+ * @brief ask whether the block holds a page the scrubber found corrupted
+ *
+ * @param block
+ * @return 1 if it does
+ */
+int esFtl_IsSuspectBlock(uint16_t block)
+{
+    return (suspectBlocks[block / 8] >> (block % 8)) & 1;
+}
+
+/*
+ * @brief find a suspect block which may be cleaned now, the blocks being
+ * filled and the blocks allocated after the last checkpoint wait
+ *
+ * @return block number, -1 if there is none
+ */
+int esFtl_SuspectVictim(void)
+{
+    uint16_t sinceCheckpoint = nextSeq - checkpointSeq;
+    int block = 0, open = cursorEnd / ESFTL_NANDNUMPAGEBLOCK;
+    int openCold = cursorCold < 0 ? -1 : cursorCold / ESFTL_NANDNUMPAGEBLOCK;
+
+    if (!numSuspectBlocks)
+        return -1;
+
+    for (block = 0; block < ESFTL_NANDNUMBLOCKS; block++)
+    {
+        if (esFtl_IsSuspectBlock(block) && block != open && block != openCold && esFtl_BlockAge(block) >= sinceCheckpoint)
+            return block;
+    }
+
+    return -1;
+}
+
+static int OldestLogBlock(void)
+{
+    int block = 0, oldest = cursorEnd / ESFTL_NANDNUMPAGEBLOCK;
+
+    for (block = 0; block < ESFTL_NANDNUMBLOCKS; block++)
+    {
+        if (blockSeq[block] != ESFTL_BLOCKFREE && esFtl_BlockAge(block) > esFtl_BlockAge(oldest))
+            oldest = block;
+    }
+
+    return oldest;
+}
+
+static int IsReleased(uint16_t block)
+{
+    return releasedBlocks[block / 8] & (1 << (block % 8));
+}
+
+/*
+ * @brief find the block which is allocated next, the least worn free one, the
+ * first after the last allocated block among equally worn ones
+ *
+ * @param after the candidate before the one wanted, -1 for the first
+ * @return block number, -1 if there is none
+ */
+static int NextCandidate(int after)
+{
+    int i = 0, block = lastAllocated, best = -1, afterIndex = -1;
+
+    for (i = 0; i < ESFTL_NANDNUMBLOCKS; i++)
+    {
+        block = (block + 1) % ESFTL_NANDNUMBLOCKS;
+        if (block == after)
+            afterIndex = i;
+        if (blockSeq[block] != ESFTL_BLOCKFREE || esFtl_IsBadBlock(block) || IsReleased(block))
+            continue;
+
+        /* the candidates come in the order of their erase count and then of their distance */
+        if (after >= 0 && (eraseCounts[block] < eraseCounts[after] ||
+                           (eraseCounts[block] == eraseCounts[after] && (afterIndex < 0 || block == after))))
+            continue;
+
+        if (best < 0 || eraseCounts[block] < eraseCounts[best])
+            best = block;
+    }
+
+    return best;
+}
+
+static int IsDirty(uint16_t block)
+{
+    return (dirtyBlocks[block / 8] >> (block % 8)) & 1;
+}
+
+/*
+ * @brief erase a dirty block, it is marked bad if the erase fails
+ *
+ * @param block
+ * @return 0 if it is erased
+ */
+static int EraseBlock(uint16_t block)
+{
+    dirtyBlocks[block / 8] &= ~(1 << (block % 8));
+    numDirtyBlocks--;
+
+    if (!esFtl_NandFlashBlockErase(block))
+        return 0;
+
+    ESFTL_LOG("Erase block fail %d!!\n", block);
+    esFtl_MarkBadBlock(block);
+    if (IsReleased(block))
+    {
+        releasedBlocks[block / 8] &= ~(1 << (block % 8));
+        numReleasedBlocks--;
+    }
+    else if (blockSeq[block] == ESFTL_BLOCKFREE)
+    {
+        freeBlocks--;
+    }
+    return -1;
+}
+
+/*
+ * @brief find the least worn block of the log which may be cleaned
+ *
+ * @param maxErases set to the highest erase count of the good blocks
+ * @return block number, -1 if there is none
+ */
+static int LeastWornLogBlock(uint32_t *maxErases)
+{
+    uint16_t sinceCheckpoint = nextSeq - checkpointSeq;
+    int block = 0, least = -1, open = cursorEnd / ESFTL_NANDNUMPAGEBLOCK;
+    int openCold = cursorCold < 0 ? -1 : cursorCold / ESFTL_NANDNUMPAGEBLOCK;
+
+    for (block = 0; block < ESFTL_NANDNUMBLOCKS; block++)
+    {
+        if (esFtl_IsBadBlock(block))
+            continue;
+
+        if (eraseCounts[block] > *maxErases)
+            *maxErases = eraseCounts[block];
+
+        if (blockSeq[block] == ESFTL_BLOCKFREE || block == open || block == openCold ||
+            esFtl_BlockAge(block) < sinceCheckpoint)
+            continue;
+
+        if (least < 0 || eraseCounts[block] < eraseCounts[least])
+            least = block;
+    }
+
+    return least;
+}
+
+static void TakeBlock(uint16_t block, uint8_t cold)
+{
+    blockSeq[block] = nextSeq;
+    if (cold)
+        coldBlocks[block / 8] |= 1 << (block % 8);
+    else
+        coldBlocks[block / 8] &= ~(1 << (block % 8));
+    ClearBlockValidity(block);
+
+    if (esFtl_IsSuspectBlock(block))
+    {
+        suspectBlocks[block / 8] &= ~(1 << (block % 8));
+        numSuspectBlocks--;
+    }
+    if (IsDirty(block))
+    {
+        dirtyBlocks[block / 8] &= ~(1 << (block % 8));
+        numDirtyBlocks--;
+    }
+    freeBlocks--;
+    lastAllocated = block;
+
+    nextSeq++;
+    if (nextSeq == ESFTL_BLOCKFREE)
+        nextSeq = 0;
+}
+
+static void CountFreeBlocks(void)
+{
+    int block = 0;
+
+    freeBlocks = 0;
+    for (block = 0; block < ESFTL_NANDNUMBLOCKS; block++)
+    {
+        if (blockSeq[block] == ESFTL_BLOCKFREE && !esFtl_IsBadBlock(block))
+            freeBlocks++;
+    }
+}
+
+static void ClearBlockValidity(uint16_t block)
+{
+    memset(&validBitmap[block * ESFTL_NANDNUMPAGEBLOCK / 8], 0, ESFTL_NANDNUMPAGEBLOCK / 8);
+    validPages[block] = 0;
+}
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef ESFTL_BLOCKS_H__
+#define ESFTL_BLOCKS_H__
+
+#define ESFTL_BLOCKFREE 0xFFFF /* sequence number of an erased block */
+
+typedef struct
+{
+    uint32_t minErases;
+    uint32_t maxErases;
+    uint32_t meanErases;
+    uint64_t totalErases;
+    uint32_t staticMoves; /* blocks cleaned because they were the least worn */
+} esFtl_WearStats;
+
+typedef struct
+{
+    uint32_t erasedBlocks; /* free blocks ready for a write */
+    uint32_t dirtyBlocks; /* free blocks still waiting for their erase */
+    uint32_t eraseWaits; /* blocks a write had to erase itself */
+    uint32_t idleErases; /* blocks erased by esFtl_Idle or esFtl_Defrag ahead of the writes */
+} esFtl_EraseStats;
+
+/* the block table as a checkpoint stores it */
+typedef struct
+{
+    uint16_t nextSeq;
+    uint16_t reserved;
+    uint32_t eraseBase; /* lowest erase count */
+    uint16_t blockSeq[ESFTL_NANDNUMBLOCKS]; /* released blocks are stored as free */
+    uint16_t eraseCounts[ESFTL_NANDNUMBLOCKS]; /* above eraseBase, saturated at 16 bits */
+    uint8_t coldBlocks[ESFTL_NANDNUMBLOCKS / 8]; /* a bit per block, set for the cold blocks */
+    uint8_t dirtyBlocks[ESFTL_NANDNUMBLOCKS / 8]; /* set for the free blocks which are not erased yet */
+} esFtl_BlockTable;
+
+void esFtl_ResetBlocks(void);
+int esFtl_ScanBlocks(int *newestCold);
+void esFtl_SaveBlocks(esFtl_BlockTable *table);
+void esFtl_LoadBlocks(const esFtl_BlockTable *table);
+int esFtl_AllocateBlock(uint8_t cold);
+int esFtl_AdoptBlock(uint8_t *cold);
+void esFtl_ReleaseBlock(uint16_t block);
+void esFtl_RetireBlock(uint16_t block);
+int esFtl_EraseDirtyBlock(uint16_t ahead);
+void esFtl_ReuseReleasedBlocks(void);
+int esFtl_NumFreeBlocks(void);
+int esFtl_NumReleasedBlocks(void);
+int esFtl_HasFreeBlock(int keep);
+int esFtl_IsLogBlock(uint16_t block);
+int esFtl_IsColdBlock(uint16_t block);
+void esFtl_GetWearStats(esFtl_WearStats *stats);
+void esFtl_GetEraseStats(esFtl_EraseStats *stats);
+uint16_t esFtl_BlockAge(uint16_t block);
+uint32_t esFtl_LogOrder(int pno);
+int esFtl_LogPage(uint32_t *order, uint8_t backward);
+void esFtl_ResetValidPages(void);
+int esFtl_ValidPagesKnown(void);
+void esFtl_SetPageValid(uint16_t pno, uint8_t valid);
+int esFtl_IsPageValid(uint16_t pno);
+int esFtl_SelectVictimBlock(void);
+int esFtl_SuspectBlock(uint16_t block);
+int esFtl_IsSuspectBlock(uint16_t block);
+int esFtl_SuspectVictim(void);
+void esFtl_FailBlock(uint16_t block);
+int esFtl_IsFailedBlock(uint16_t block);
+
+#endif
\ No newline at end of file
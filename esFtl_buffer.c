@@ -0,0 +1,295 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "esFtl_definitions.h"
+#include "esFtl_disk.h"
+#include "esFtl_read.h"
+#include "esFtl_write.h"
+#include "esFtl_buffer.h"
+
+#if ESFTL_WRITEBUFFERSECTORS
+
+/*
+ * The sectors written by the host are held in RAM and written to the flash
+ * as a whole page when they are evicted, on esFtl_Sync or once they waited
+ * ESFTL_WRITEBUFFERAGE ms. Repeated writes of a sector and writes of parts of
+ * it are merged here and cost one program. A partial write of a sector which
+ * is not held reads its last copy first. The held sectors do not survive a
+ * power loss, a host which needs them on the flash calls esFtl_Sync.
+ */
+#define SLOTFREE 0xFFFF
+
+typedef struct
+{
+    uint8_t data[ESFTL_PAGEBUFFSIZE]; /* room for the spare bytes while it is written */
+    uint16_t sno;
+    uint32_t lastUse;
+    uint32_t since; /* time of the oldest write which is not on the flash */
+} BufferSlot;
+
+static BufferSlot slots[ESFTL_WRITEBUFFERSECTORS];
+static esFtl_WriteBufferStats bufferStats;
+static uint32_t bufferClock = 0;
+static uint32_t bufferTime = 0;
+
+static BufferSlot *FindSlot(uint16_t sno);
+static BufferSlot *TakeSlot(void);
+static int FlushSlot(BufferSlot *slot);
+
+/*
+ * @brief forget the held sectors, a mount starts with an empty buffer
+ *
+ */
+void esFtl_ResetWriteBuffer(void)
+{
+    int i = 0;
+
+    for (i = 0; i < ESFTL_WRITEBUFFERSECTORS; i++)
+        slots[i].sno = SLOTFREE;
+    bufferClock = 0;
+}
+
+/*
+ * @brief merge the written part of a sector into the buffer, the least recently
+ * written sector is written to the flash when there is no room
+ *
+ * @param sno
+ * @param buffer sector data, only the bytes from idx are taken
+ * @param idx
+ * @param count
+ * @return 0 if it is successful
+ */
+int esFtl_BufferWrite(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count)
+{
+    BufferSlot *slot = FindSlot(sno);
+
+    if (idx >= ESFTL_NANDPAGEDATASIZE)
+        return -1;
+
+    if (count > ESFTL_NANDPAGEDATASIZE - idx)
+        count = ESFTL_NANDPAGEDATASIZE - idx;
+
+    bufferStats.hostWrites++;
+
+    if (slot)
+    {
+        bufferStats.merges++;
+    }
+    else
+    {
+        slot = TakeSlot();
+        if (!slot)
+            return -1;
+
+        /* the bytes which are not written keep their last content, 0xFF for a new sector */
+        if (count < ESFTL_NANDPAGEDATASIZE && !esFtl_Read(sno, slot->data, 0, ESFTL_NANDPAGEDATASIZE))
+            bufferStats.fills++;
+
+        slot->sno = sno;
+        slot->since = bufferTime;
+    }
+
+    memcpy(&slot->data[idx], &buffer[idx], count);
+    slot->lastUse = ++bufferClock;
+
+    esFtl_BufferFlushExpired(ESFTL_WRITEBUFFERSECTORS);
+    return 0;
+}
+
+/*
+ * @brief serve a read from the buffer, the data is put to the buffer like a flash read does
+ *
+ * @param sno
+ * @param buffer
+ * @param idx
+ * @param count
+ * @return 0 if the sector is held
+ */
+int esFtl_BufferRead(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count)
+{
+    BufferSlot *slot = FindSlot(sno);
+
+    if (!slot || idx >= ESFTL_NANDPAGEDATASIZE)
+        return -1;
+
+    if (count > ESFTL_NANDPAGEDATASIZE - idx)
+        count = ESFTL_NANDPAGEDATASIZE - idx;
+
+    memcpy(buffer, &slot->data[idx], count);
+    bufferStats.readHits++;
+    return 0;
+}
+
+/*
+ * @brief forget a held sector, it is released
+ *
+ * @param sno
+ */
+void esFtl_BufferDrop(uint16_t sno)
+{
+    BufferSlot *slot = FindSlot(sno);
+
+    if (slot)
+        slot->sno = SLOTFREE;
+}
+
+/*
+ * @brief write the sectors which waited longer than ESFTL_WRITEBUFFERAGE ms
+ *
+ * @param sectors count of sectors which may be written
+ * @return count of the written sectors
+ */
+int esFtl_BufferFlushExpired(uint16_t sectors)
+{
+    int i = 0, written = 0;
+
+    for (i = 0; i < ESFTL_WRITEBUFFERSECTORS && written < sectors; i++)
+    {
+        if (slots[i].sno == SLOTFREE || bufferTime - slots[i].since < ESFTL_WRITEBUFFERAGE)
+            continue;
+
+        if (!FlushSlot(&slots[i]))
+            written++;
+    }
+
+    return written;
+}
+
+/*
+ * @brief write every held sector to the flash, in sector order so that the
+ * sectors sharing a translation page are written one after the other
+ *
+ * @return 0 if it is successful
+ */
+int esFtl_Sync(void)
+{
+    BufferSlot *slot;
+    int last = -1, rv = 0, i = 0;
+
+    while (1)
+    {
+        slot = NULL;
+        for (i = 0; i < ESFTL_WRITEBUFFERSECTORS; i++)
+        {
+            if (slots[i].sno != SLOTFREE && (int)slots[i].sno > last && (!slot || slots[i].sno < slot->sno))
+                slot = &slots[i];
+        }
+
+        if (!slot)
+            break;
+
+        last = slot->sno;
+        if (FlushSlot(slot))
+            rv = -1;
+    }
+
+    return rv;
+}
+
+/*
+ * @brief advance the clock of the buffer, it is meant to be called from a
+ * periodic timer and does no flash access, the expired sectors are written by
+ * the next write or esFtl_Idle
+ *
+ * @param ms time since the last call
+ */
+void esFtl_WriteBufferTick(uint32_t ms)
+{
+    bufferTime += ms;
+}
+
+/*
+ * @brief copy the counters of the buffer
+ *
+ * @param stats
+ */
+void esFtl_GetWriteBufferStats(esFtl_WriteBufferStats *stats)
+{
+    *stats = bufferStats;
+}
+
+static BufferSlot *FindSlot(uint16_t sno)
+{
+    int i = 0;
+
+    for (i = 0; i < ESFTL_WRITEBUFFERSECTORS; i++)
+    {
+        if (slots[i].sno == sno)
+            return &slots[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * @brief get a free slot, the least recently written sector is evicted if there is none
+ *
+ * @return NULL if the evicted sector can not be written
+ */
+static BufferSlot *TakeSlot(void)
+{
+    BufferSlot *slot = &slots[0];
+    int i = 0;
+
+    for (i = 0; i < ESFTL_WRITEBUFFERSECTORS; i++)
+    {
+        if (slots[i].sno == SLOTFREE)
+            return &slots[i];
+
+        if (slots[i].lastUse < slot->lastUse)
+            slot = &slots[i];
+    }
+
+    if (FlushSlot(slot))
+        return NULL;
+
+    return slot;
+}
+
+static int FlushSlot(BufferSlot *slot)
+{
+    if (esFtl_WriteSector(slot->sno, slot->data))
+        return -1;
+
+    slot->sno = SLOTFREE;
+    bufferStats.flushes++;
+    return 0;
+}
+
+#else
+
+/*
+ * @brief nothing is held without a write buffer
+ *
+ * @return 0
+ */
+int esFtl_Sync(void)
+{
+    return 0;
+}
+
+void esFtl_WriteBufferTick(uint32_t ms)
+{
+    (void)ms;
+}
+
+void esFtl_GetWriteBufferStats(esFtl_WriteBufferStats *stats)
+{
+    memset(stats, 0, sizeof(esFtl_WriteBufferStats));
+}
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef ESFTL_BUFFER_H__
+#define ESFTL_BUFFER_H__
+
+typedef struct
+{
+    uint32_t hostWrites;
+    uint32_t merges; /* writes to a sector which was already held, they cost no program */
+    uint32_t fills; /* partial writes of a sector which is not held, its old data is read first */
+    uint32_t readHits;
+    uint32_t flushes; /* sectors written to the flash by an eviction, a sync or the timer */
+} esFtl_WriteBufferStats;
+
+int esFtl_Sync(void);
+void esFtl_WriteBufferTick(uint32_t ms);
+void esFtl_GetWriteBufferStats(esFtl_WriteBufferStats *stats);
+#if ESFTL_WRITEBUFFERSECTORS
+void esFtl_ResetWriteBuffer(void);
+int esFtl_BufferWrite(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count);
+int esFtl_BufferRead(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count);
+void esFtl_BufferDrop(uint16_t sno);
+int esFtl_BufferFlushExpired(uint16_t sectors);
+#endif
+
+#endif
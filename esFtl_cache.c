@@ -18,22 +18,115 @@
 #include "esFtl_definitions.h"
 #include "esFtl_disk.h"
 #include "esFtl_read.h"
+#include "esFtl_bbm.h"
+#include "esFtl_write.h"
 #include "esFtl_cache.h"
+#include "esFtl_checkpoint.h"
+#include "esFtl_summary.h"
+#include "esFtl_blocks.h"
+
+#if !ESFTL_HYBRIDMAPPING
 
 typedef struct
 {
     uint16_t sno;
     uint16_t crc;
     uint8_t released;
-    uint8_t firstBlock;
 } SpareData;
 
-static uint16_t sectorCache[ESFTL_SECTORCACHESIZE];
+/*
+ * The sector map is kept on flash in ESFTL_MAPPAGES translation pages which
+ * are appended to the log like any sector. Only ESFTL_MAPCACHEPAGES of them
+ * are held in RAM and a dirty one is written back when it is evicted. Sectors
+ * written after the last copy of their translation page are replayed from the
+ * log at mount.
+ */
+typedef struct
+{
+    uint16_t entries[(ESFTL_PAGEBUFFSIZE + 1) / 2]; /* room for the spare bytes while it is written */
+    uint16_t index;
+    uint8_t dirty;
+    uint8_t relocated; /* it holds pages moved by the defragment, they are not replayed */
+    uint8_t flushWanted; /* a release of a batch waits for it to be written */
+    uint16_t dirtySince; /* oldest page whose entry is not on the flash yet */
+    uint32_t lastUse;
+} MapCachePage;
+
+/*
+ * A checkpoint holds the translation page locations and the cursors. The
+ * cached translation pages are not written for it, the log from the oldest
+ * update which is only in RAM serves as the journal and is replayed at mount.
+ * Translation pages dirty for longer than ESFTL_CHECKPOINTINTERVAL pages are
+ * written so that the journal stays short, a clean shutdown writes all of
+ * them and leaves nothing to replay.
+ */
+typedef struct
+{
+    uint16_t cursorStart;
+    uint16_t cursorEnd;
+    uint16_t replayFrom;
+    uint16_t lastOpSectorNo;
+    uint8_t clean;
+    uint8_t reserved;
+    uint16_t cursorCold;
+    uint16_t mapDirectory[ESFTL_MAPPAGES];
+    esFtl_BlockTable blocks;
+} CheckpointRecord;
+
+/*
+ * After a lazy mount the log between the replay start and the write frontier
+ * is scanned and replayed in steps. Until it is finished the sectors written
+ * meanwhile are kept in pendingWrites and other lookups search the log
+ * backwards from the frontier.
+ */
+typedef struct
+{
+    uint16_t sno;
+    uint16_t pno;
+} PendingWrite;
+
+#define SPAREDATASIZE 5
+#define ORDERNONE 0xFFFFFFFF
+#define REPLAYDONE 0
+#define REPLAYSCAN 1
+#define REPLAYAPPLY 2
+
+static MapCachePage mapCache[ESFTL_MAPCACHEPAGES];
+static uint16_t mapDirectory[ESFTL_MAPPAGES];
+static uint32_t mapCacheClock = 0;
+static uint32_t pagesSinceCheckpoint = 0;
+static uint32_t replayMapOrder[ESFTL_MAPPAGES];
+static uint32_t replayDataOrder[ESFTL_MAPPAGES];
+static uint32_t replayStart = 0, replayPos = 0, replayEnd = 0;
+static int replayFrontier[2];
+static uint8_t replayPhase = REPLAYDONE;
+static PendingWrite pendingWrites[ESFTL_LAZYMOUNTWRITES];
+static int numPendingWrites = 0;
+static uint8_t mountPending = 0;
+static CheckpointRecord checkpointRecord;
 int cursorEnd = 0;
 int cursorStart = 0;
+int cursorCold = -1;
 uint16_t lastOpSectorNo = 0;
 uint8_t defragmentNeeded = 0;
 
+static MapCachePage *LoadMapPage(uint16_t index);
+static int FlushMapPage(MapCachePage *slot);
+static void ResetMapCache(void);
+static void ReplayLog(uint32_t fromOrder);
+static void BeginReplay(uint32_t fromOrder, uint32_t endOrder);
+static int ReplayStep(uint32_t pages);
+static void ReplayPage(uint32_t order, uint16_t pno, SpareData *sData);
+static int PagesPastFrontier(int pno);
+static uint32_t LogEnd(void);
+static int ReadCheckpointRecord(CheckpointRecord *cp);
+static void FindLog(void);
+static void FindFrontiers(int host, int cold);
+static int FindFrontier(int pno, uint8_t cold);
+static int LookupPending(uint16_t sno);
+static int FindPendingWrite(uint16_t sno);
+static void MarkDirty(MapCachePage *slot, uint16_t pno);
+
 /*
  * @brief ask whether the defragment is necessary
  *
@@ -45,144 +138,1082 @@ uint8_t esFtl_IsDefragNeeded(void)
 }
 
 /*
- * @brief determine the cursor points and fill the cache data
+ * @brief determine the cursor points, locate the translation pages and replay
+ * the sectors written after them
  *
  */
 void esFtl_EvaluateCursorAndCache(void)
 {
-    SpareData sData;
-    uint16_t pno = 0;
+    ResetMapCache();
+    FindLog();
+    ReplayLog(0);
+}
+
+/*
+ * @brief determine the cursor points only, the map is built by esFtl_MountStep
+ *
+ */
+void esFtl_EvaluateCursorLazy(void)
+{
+    ResetMapCache();
+    FindLog();
+    BeginReplay(0, LogEnd());
+    mountPending = 1;
+
+    /* nothing of the map is on a checkpoint yet */
+    pagesSinceCheckpoint = ESFTL_CHECKPOINTINTERVAL;
+}
+
+/*
+ * @brief build a part of the map after a lazy mount, it is meant to be called while the device is idle
+ *
+ * @return 1 if there is more to do
+ */
+int esFtl_MountStep(void)
+{
+    if (!mountPending)
+        return 0;
+
+    if (ReplayStep(ESFTL_LAZYMOUNTSTEPPAGES))
+        return 1;
+
+    esFtl_FinishMount();
+    return 0;
+}
+
+/*
+ * @brief complete the map after a lazy mount at once
+ *
+ */
+void esFtl_FinishMount(void)
+{
     int i = 0;
 
-    memset(sectorCache, 0xFF, sizeof(sectorCache));
+    if (!mountPending)
+        return;
+
+    while (ReplayStep(0xFFFFFFFF))
+        ;
+
+    mountPending = 0;
+    for (i = 0; i < numPendingWrites; i++)
+    {
+        if (esFtl_SetSectorCache(pendingWrites[i].sno, pendingWrites[i].pno))
+            ESFTL_LOG("esFtl: FATAL ERROR:%d %s %d\n", pendingWrites[i].sno, __FILE__, __LINE__);
+    }
+    numPendingWrites = 0;
+}
+
+/*
+ * @brief restore the map from the newest checkpoint and replay the pages written after it
+ *
+ * @param lazy 1 if the replay is left to esFtl_MountStep
+ * @return 0 if it is successful, -1 if the whole log has to be evaluated
+ */
+int esFtl_LoadCheckpoint(uint8_t lazy)
+{
+    CheckpointRecord *cp = &checkpointRecord;
+
+    if (ReadCheckpointRecord(cp))
+        return -1;
 
-    for (i = 0; i < ESFTL_NANDNUMBLOCKS * ESFTL_NANDNUMPAGEBLOCK; i++)
+    ResetMapCache();
+    esFtl_LoadBlocks(&cp->blocks);
+    memcpy(mapDirectory, cp->mapDirectory, sizeof(mapDirectory));
+    cursorStart = cp->cursorStart;
+    cursorEnd = cp->cursorEnd;
+    cursorCold = (cp->cursorCold == 0xFFFF) ? -1 : cp->cursorCold;
+    lastOpSectorNo = cp->lastOpSectorNo;
+    pagesSinceCheckpoint = 0;
+
+    if (!cp->clean)
     {
-        if (!esFtl_NandFlashRead(i, ESFTL_NANDPAGEDATASIZE, (uint8_t *)&sData, sizeof(SpareData)))
+        FindFrontiers(cp->cursorEnd, cursorCold);
+        pagesSinceCheckpoint = esFtl_LogOrder(cursorEnd) - esFtl_LogOrder(cp->cursorEnd);
+
+        if (lazy)
         {
-            if (i % ESFTL_NANDNUMPAGEBLOCK == 0 && sData.firstBlock == 0x55)
-            {
-                cursorStart = i;
-                break;
-            }
+            BeginReplay(esFtl_LogOrder(cp->replayFrom), LogEnd());
+            mountPending = 1;
         }
         else
         {
-            ESFTL_LOG("esFTL: FATAL ERROR: %d %s %d\n", i, __FILE__, __LINE__);
+            ReplayLog(esFtl_LogOrder(cp->replayFrom));
         }
+        return 0;
     }
 
-    for (i = 0; i < ESFTL_NANDNUMBLOCKS * ESFTL_NANDNUMPAGEBLOCK; i++)
+    /* the log is going to change, a later mount must not trust the clean mark any more */
+    cp->clean = 0;
+    return esFtl_WriteCheckpoint((uint8_t *)cp, sizeof(CheckpointRecord));
+}
+
+/*
+ * @brief write the modified translation pages and a checkpoint of the map
+ *
+ * @param clean 1 if nothing is written to the log until the next mount
+ * @return 0 if it is successful
+ */
+int esFtl_Checkpoint(uint8_t clean)
+{
+    CheckpointRecord *cp = &checkpointRecord;
+    uint32_t endOrder = 0;
+    int i = 0;
+
+    esFtl_FinishMount();
+    endOrder = esFtl_LogOrder(cursorEnd);
+
+    for (i = 0; i < ESFTL_MAPCACHEPAGES; i++)
+    {
+        if (mapCache[i].index == 0xFFFF || !mapCache[i].dirty)
+            continue;
+
+        /* a defragment may have erased the page the update is waiting since */
+        if (clean || esFtl_LogOrder(mapCache[i].dirtySince) >= endOrder ||
+            endOrder - esFtl_LogOrder(mapCache[i].dirtySince) > ESFTL_CHECKPOINTINTERVAL)
+        {
+            if (FlushMapPage(&mapCache[i]))
+                return -1;
+        }
+    }
+
+    cp->cursorStart = cursorStart;
+    cp->cursorEnd = cursorEnd;
+    cp->cursorCold = (cursorCold < 0) ? 0xFFFF : cursorCold;
+    cp->replayFrom = cursorEnd;
+    cp->lastOpSectorNo = lastOpSectorNo;
+    cp->clean = clean;
+    cp->reserved = 0xFF;
+    memcpy(cp->mapDirectory, mapDirectory, sizeof(mapDirectory));
+    esFtl_SaveBlocks(&cp->blocks);
+
+    for (i = 0; i < ESFTL_MAPCACHEPAGES; i++)
+    {
+        if (mapCache[i].index != 0xFFFF && mapCache[i].dirty && esFtl_LogOrder(mapCache[i].dirtySince) < esFtl_LogOrder(cp->replayFrom))
+            cp->replayFrom = mapCache[i].dirtySince;
+    }
+
+    pagesSinceCheckpoint = 0;
+    if (esFtl_WriteCheckpoint((uint8_t *)cp, sizeof(CheckpointRecord)))
+        return -1;
+
+    esFtl_ReuseReleasedBlocks();
+    return 0;
+}
+
+/*
+ * @brief write a checkpoint when ESFTL_CHECKPOINTINTERVAL pages are appended since the last one
+ *
+ */
+void esFtl_CheckpointIfDue(void)
+{
+    if (!mountPending && pagesSinceCheckpoint >= ESFTL_CHECKPOINTINTERVAL)
+        esFtl_Checkpoint(0);
+}
+
+/*
+ * @brief find which page belongs to the sector, it costs at most one flash read
+ *
+ * @param sno
+ * @return -1 if the sector is not assigned yet
+ */
+int esFtl_FindSectorPage(uint16_t sno)
+{
+    MapCachePage *slot;
+    uint16_t pno = 0;
+
+    if (esFtl_IsMapSector(sno))
+        pno = mapDirectory[sno - ESFTL_MAPSNOBASE];
+    else if (mountPending)
+        return LookupPending(sno);
+    else
+    {
+        if (sno > lastOpSectorNo)
+            return -1;
+
+        slot = LoadMapPage(sno / ESFTL_MAPENTRIESPERPAGE);
+        if (!slot)
+            return -1;
+
+        pno = slot->entries[sno % ESFTL_MAPENTRIESPERPAGE];
+    }
+
+    if (pno == 0xFFFF)
+        return -1;
+
+    return pno;
+}
+
+/*
+ * @brief find the pages of consecutive sectors, a translation page is looked
+ * up once for all its sectors of the run
+ *
+ * @param sno
+ * @param count
+ * @param pages set to 0xFFFF for a sector which is not assigned
+ */
+void esFtl_FindSectorPages(uint16_t sno, uint16_t count, uint16_t *pages)
+{
+    MapCachePage *slot;
+    uint16_t i = 0, j = 0, n = 0;
+    int pno = 0;
+
+    while (i < count)
     {
-        pno = (cursorStart + i) % (ESFTL_NANDNUMBLOCKS * ESFTL_NANDNUMPAGEBLOCK);
-        if (pno == 0xFFFF)
+        if (mountPending || esFtl_IsMapSector(sno + i))
         {
+            pno = esFtl_FindSectorPage(sno + i);
+            pages[i++] = (pno < 0) ? 0xFFFF : pno;
             continue;
         }
 
-        if (!esFtl_NandFlashRead(pno, ESFTL_NANDPAGEDATASIZE, (uint8_t *)&sData, sizeof(SpareData) - 1))
+        n = ESFTL_MAPENTRIESPERPAGE - (sno + i) % ESFTL_MAPENTRIESPERPAGE;
+        if (n > count - i)
+            n = count - i;
+
+        slot = (sno + i > lastOpSectorNo) ? NULL : LoadMapPage((sno + i) / ESFTL_MAPENTRIESPERPAGE);
+        for (j = 0; j < n; j++, i++)
+            pages[i] = (!slot || sno + i > lastOpSectorNo) ? 0xFFFF : slot->entries[(sno + i) % ESFTL_MAPENTRIESPERPAGE];
+    }
+}
+
+/*
+ * @brief increment one a write frontier, a new block is allocated after the last page of a block
+ *
+ * @param cold 1 for cursorCold, the frontier of the pages moved by the defragment
+ */
+void esFtl_IncrementCursor(uint8_t cold)
+{
+    int *cursor = cold ? &cursorCold : &cursorEnd;
+    int block = 0;
+
+    pagesSinceCheckpoint++;
+    if ((*cursor + 1) % ESFTL_NANDNUMPAGEBLOCK)
+    {
+        (*cursor)++;
+        return;
+    }
+
+    block = esFtl_AllocateBlock(cold);
+    if (block < 0)
+    {
+        ESFTL_LOG("esFtl: FATAL ERROR: no free block %s %d\n", __FILE__, __LINE__);
+        return;
+    }
+
+    *cursor = block * ESFTL_NANDNUMPAGEBLOCK;
+}
+
+/*
+ * @brief write the cached translation pages which wait for an update on the
+ * block or hold moved pages, it is called before the block is erased since
+ * the release marks and the sectors on it can not be replayed any more. The
+ * moved pages are never replayed, until their translation page is written
+ * the map on the flash points to the pages they are moved from
+ *
+ * @param block
+ * @return 0 if it is successful
+ */
+int esFtl_FlushMapJournal(uint16_t block)
+{
+    uint32_t lastOrder = esFtl_LogOrder(block * ESFTL_NANDNUMPAGEBLOCK + ESFTL_NANDNUMPAGEBLOCK - 1);
+    int i = 0, rv = 0;
+
+    for (i = 0; i < ESFTL_MAPCACHEPAGES; i++)
+    {
+        if (mapCache[i].index != 0xFFFF && mapCache[i].dirty &&
+            (mapCache[i].relocated || esFtl_LogOrder(mapCache[i].dirtySince) <= lastOrder))
         {
-            if (sData.sno == 0xFFFF)
-            {
-                cursorEnd = pno;
-                break;
-            }
-            else
-            {
-                if (sData.released == 0xFF)
-                {
-                    esFtl_SetSectorCache(sData.sno, pno);
-
-                    if (lastOpSectorNo < sData.sno)
-                        lastOpSectorNo = sData.sno;
-                }
-                else
-                {
-                    esFtl_SetSectorCache(sData.sno, 0xFFFF);
-                }
-            }
+            if (FlushMapPage(&mapCache[i]))
+                rv = -1;
         }
+    }
+
+    return rv;
+}
+
+/*
+ * @brief mark the valid pages and count them per block from the map, it is
+ * done once after a mount and the marks are kept up to date from then on
+ *
+ */
+void esFtl_BuildValidPages(void)
+{
+    uint16_t entries[ESFTL_MAPENTRIESPERPAGE];
+    uint16_t *page = entries;
+    int index = 0, i = 0, j = 0;
+
+    if (esFtl_ValidPagesKnown())
+        return;
+
+    esFtl_FinishMount();
+    esFtl_ResetValidPages();
+
+    for (index = 0; index < ESFTL_MAPPAGES; index++)
+    {
+        for (i = 0; i < ESFTL_MAPCACHEPAGES && mapCache[i].index != index; i++)
+            ;
+
+        if (i < ESFTL_MAPCACHEPAGES)
+            page = mapCache[i].entries;
+        else if (mapDirectory[index] != 0xFFFF && !esFtl_NandFlashRead(mapDirectory[index], 0, (uint8_t *)entries, sizeof(entries)))
+            page = entries;
         else
+            continue;
+
+        for (j = 0; j < ESFTL_MAPENTRIESPERPAGE; j++)
         {
-            ESFTL_LOG("esFTL: FATAL ERROR: %d %s %d\n", i, __FILE__, __LINE__);
+            if (page[j] != 0xFFFF)
+                esFtl_SetPageValid(page[j], 1);
         }
+
+        if (mapDirectory[index] != 0xFFFF)
+            esFtl_SetPageValid(mapDirectory[index], 1);
     }
 }
 
 /*
- * @brief find which page belongs to the sector
+ * @brief bring the translation page of a sector into the cache before the
+ * sector is programmed, a write-back the log has no room for fails the write
+ * before it is acknowledged
  *
  * @param sno
- * @return -1 if the sector is not assigned yet
+ * @return 0 if the sector can be mapped, -1 if the evicted page can not be written
  */
-int esFtl_FindSectorPage(uint16_t sno)
+int esFtl_PrepareSectorCache(uint16_t sno)
 {
-    SpareData sData;
+    if (esFtl_IsMapSector(sno))
+        return 0;
+
+    if (mountPending)
+    {
+        /* a sector the pending writes can hold is mapped once the mount is finished */
+        if (numPendingWrites < ESFTL_LAZYMOUNTWRITES || LookupPending(sno) >= 0)
+            return 0;
+
+        esFtl_FinishMount();
+    }
+
+    return LoadMapPage(sno / ESFTL_MAPENTRIESPERPAGE) ? 0 : -1;
+}
+
+/*
+ * @brief assign page to a sector in the map
+ *
+ * @param sno
+ * @param pno
+ * @return 0 if it is successful, -1 if the translation page can not be loaded
+ */
+int esFtl_SetSectorCache(uint16_t sno, uint16_t pno)
+{
+    MapCachePage *slot;
+
     int i = 0;
 
-    if (sno < ESFTL_SECTORCACHESIZE)
+    if (esFtl_IsMapSector(sno))
     {
-        if (sectorCache[sno] != 0xFFFF)
-            return sectorCache[sno];
-        else
-            return -1;
+        mapDirectory[sno - ESFTL_MAPSNOBASE] = pno;
+        return 0;
     }
 
-    if (sno > lastOpSectorNo)
+    if (mountPending)
+    {
+        for (i = 0; i < numPendingWrites && pendingWrites[i].sno != sno; i++)
+            ;
+
+        if (i < ESFTL_LAZYMOUNTWRITES)
+        {
+            pendingWrites[i].sno = sno;
+            pendingWrites[i].pno = pno;
+            if (i == numPendingWrites)
+                numPendingWrites++;
+            return 0;
+        }
+
+        esFtl_FinishMount();
+    }
+
+    slot = LoadMapPage(sno / ESFTL_MAPENTRIESPERPAGE);
+    if (!slot)
         return -1;
 
-    if (cursorEnd == cursorStart)
+    if (slot->entries[sno % ESFTL_MAPENTRIESPERPAGE] != 0xFFFF)
+        esFtl_SetPageValid(slot->entries[sno % ESFTL_MAPENTRIESPERPAGE], 0);
+    esFtl_SetPageValid(pno, 1);
+
+    slot->entries[sno % ESFTL_MAPENTRIESPERPAGE] = pno;
+    MarkDirty(slot, pno);
+    return 0;
+}
+
+/*
+ * @brief remove the sector from the map before its page is marked as released,
+ * a release mark older than the stored translation page is not replayed at mount
+ * and a filled block is replayed from its summary which does not see the mark,
+ * so the translation page is written at once in these cases
+ *
+ * @param sno
+ * @param pno page which is going to be marked
+ * @param defer 1 if the translation page is written by esFtl_FlushWantedMapPages after a batch of releases
+ * @return 0 if it is successful
+ */
+int esFtl_ReleaseSectorCache(uint16_t sno, uint16_t pno, uint8_t defer)
+{
+    MapCachePage *slot;
+    uint16_t index = sno / ESFTL_MAPENTRIESPERPAGE;
+
+    /* a release older than a translation page can not wait for the map */
+    esFtl_FinishMount();
+
+    slot = LoadMapPage(index);
+    if (!slot)
         return -1;
 
-    for (i = cursorEnd - 1; i != cursorStart; i--)
+    if (slot->entries[sno % ESFTL_MAPENTRIESPERPAGE] != 0xFFFF)
+        esFtl_SetPageValid(slot->entries[sno % ESFTL_MAPENTRIESPERPAGE], 0);
+
+    slot->entries[sno % ESFTL_MAPENTRIESPERPAGE] = 0xFFFF;
+    MarkDirty(slot, pno);
+
+    if ((mapDirectory[index] != 0xFFFF && esFtl_LogOrder(mapDirectory[index]) > esFtl_LogOrder(pno)) ||
+        pno / ESFTL_NANDNUMPAGEBLOCK != cursorEnd / ESFTL_NANDNUMPAGEBLOCK)
     {
-        if (i < 0)
+        if (!defer)
+            return FlushMapPage(slot);
+        slot->flushWanted = 1;
+    }
+
+    return 0;
+}
+
+/*
+ * @brief write the translation pages which the releases of a batch left waiting
+ *
+ * @return 0 if it is successful
+ */
+int esFtl_FlushWantedMapPages(void)
+{
+    int i = 0, rv = 0;
+
+    for (i = 0; i < ESFTL_MAPCACHEPAGES; i++)
+    {
+        if (mapCache[i].index != 0xFFFF && mapCache[i].flushWanted)
         {
-            i = ESFTL_NANDNUMBLOCKS * ESFTL_NANDNUMPAGEBLOCK - 2;
+            if (FlushMapPage(&mapCache[i]))
+                rv = -1;
         }
+    }
+
+    return rv;
+}
+
+/*
+ * @brief ask whether the sector number belongs to a translation page
+ *
+ * @param sno
+ * @return 1 if it is a translation page
+ */
+int esFtl_IsMapSector(uint16_t sno)
+{
+    return sno >= ESFTL_MAPSNOBASE && sno < ESFTL_MAPSNOBASE + ESFTL_MAPPAGES;
+}
+
+/*
+ * @brief write the current content of a translation page to the end of the log
+ *
+ * @param sno
+ * @return 0 if it is successful
+ */
+int esFtl_RelocateMapPage(uint16_t sno)
+{
+    MapCachePage *slot;
+
+    if (!esFtl_IsMapSector(sno))
+        return -1;
+
+    slot = LoadMapPage(sno - ESFTL_MAPSNOBASE);
+    if (!slot)
+        return -1;
 
-        if (!esFtl_NandFlashRead(i, ESFTL_NANDPAGEDATASIZE, (uint8_t *)&sData, 5))
+    return FlushMapPage(slot);
+}
+
+/*
+ * @brief write every modified translation page to the flash
+ *
+ * @return 0 if it is successful
+ */
+int esFtl_FlushSectorCache(void)
+{
+    int i = 0, rv = 0;
+
+    for (i = 0; i < ESFTL_MAPCACHEPAGES; i++)
+    {
+        if (mapCache[i].index != 0xFFFF && mapCache[i].dirty)
         {
-            if (sData.sno != 0xFFFF && sData.sno == sno)
+            if (FlushMapPage(&mapCache[i]))
+                rv = -1;
+        }
+    }
+
+    return rv;
+}
+
+/*
+ * @brief bring a translation page into the cache, the least recently used one is evicted
+ *
+ * @param index
+ * @return NULL if the page can not be loaded
+ */
+static MapCachePage *LoadMapPage(uint16_t index)
+{
+    MapCachePage *slot = &mapCache[0];
+    int i = 0;
+
+    for (i = 0; i < ESFTL_MAPCACHEPAGES; i++)
+    {
+        if (mapCache[i].index == index)
+        {
+            mapCache[i].lastUse = ++mapCacheClock;
+            return &mapCache[i];
+        }
+    }
+
+    for (i = 0; i < ESFTL_MAPCACHEPAGES; i++)
+    {
+        if (mapCache[i].index == 0xFFFF)
+        {
+            slot = &mapCache[i];
+            break;
+        }
+
+        if (mapCache[i].lastUse < slot->lastUse)
+            slot = &mapCache[i];
+    }
+
+    if (slot->index != 0xFFFF && slot->dirty)
+    {
+        if (FlushMapPage(slot))
+            return NULL;
+    }
+
+    slot->index = 0xFFFF;
+    slot->dirty = 0;
+    slot->relocated = 0;
+    slot->flushWanted = 0;
+
+    if (mapDirectory[index] == 0xFFFF)
+    {
+        memset(slot->entries, 0xFF, ESFTL_NANDPAGEDATASIZE);
+    }
+    else if (esFtl_NandFlashRead(mapDirectory[index], 0, (uint8_t *)slot->entries, ESFTL_NANDPAGEDATASIZE))
+    {
+        ESFTL_LOG("esFtl: FATAL ERROR: %d %s %d\n", mapDirectory[index], __FILE__, __LINE__);
+        return NULL;
+    }
+
+    slot->index = index;
+    slot->lastUse = ++mapCacheClock;
+    return slot;
+}
+
+static int FlushMapPage(MapCachePage *slot)
+{
+    int pno = 0, i = 0;
+
+    /* the sectors written before a lazy mount is finished go in too, a later mount does not replay them over the page */
+    for (i = 0; i < numPendingWrites; i++)
+    {
+        if (pendingWrites[i].sno / ESFTL_MAPENTRIESPERPAGE == slot->index)
+            slot->entries[pendingWrites[i].sno % ESFTL_MAPENTRIESPERPAGE] = pendingWrites[i].pno;
+    }
+
+    pno = esFtl_WritePage(ESFTL_MAPSNOBASE + slot->index, (uint8_t *)slot->entries);
+    if (pno < 0)
+        return -1;
+
+    if (mapDirectory[slot->index] != 0xFFFF)
+        esFtl_SetPageValid(mapDirectory[slot->index], 0);
+    esFtl_SetPageValid(pno, 1);
+
+    mapDirectory[slot->index] = pno;
+    slot->dirty = 0;
+    slot->relocated = 0;
+    slot->flushWanted = 0;
+    return 0;
+}
+
+static void ResetMapCache(void)
+{
+    int i = 0;
+
+    memset(mapDirectory, 0xFF, sizeof(mapDirectory));
+    mountPending = 0;
+    numPendingWrites = 0;
+    replayPhase = REPLAYDONE;
+    for (i = 0; i < ESFTL_MAPCACHEPAGES; i++)
+    {
+        mapCache[i].index = 0xFFFF;
+        mapCache[i].dirty = 0;
+        mapCache[i].relocated = 0;
+        mapCache[i].flushWanted = 0;
+        mapCache[i].lastUse = 0;
+    }
+}
+
+/*
+ * @brief mark the translation page as modified by the sector written to the given page
+ *
+ * @param slot
+ * @param pno
+ */
+static void MarkDirty(MapCachePage *slot, uint16_t pno)
+{
+    /* a moved page is not replayed, the update waits for the host frontier only */
+    if (esFtl_IsColdBlock(pno / ESFTL_NANDNUMPAGEBLOCK))
+    {
+        slot->relocated = 1;
+        pno = cursorEnd;
+    }
+
+    if (!slot->dirty || esFtl_LogOrder(pno) < esFtl_LogOrder(slot->dirtySince))
+        slot->dirtySince = pno;
+
+    slot->dirty = 1;
+}
+
+/*
+ * @brief scan the log from the given position to the frontier, locate the
+ * translation pages and replay the sectors written after them
+ *
+ * @param fromOrder
+ */
+static void ReplayLog(uint32_t fromOrder)
+{
+    BeginReplay(fromOrder, LogEnd());
+    while (ReplayStep(0xFFFFFFFF))
+        ;
+}
+
+/*
+ * @brief prepare the replay of the log between two positions
+ *
+ * @param fromOrder
+ * @param endOrder
+ */
+static void BeginReplay(uint32_t fromOrder, uint32_t endOrder)
+{
+    memset(replayMapOrder, 0xFF, sizeof(replayMapOrder));
+    memset(replayDataOrder, 0xFF, sizeof(replayDataOrder));
+    replayStart = fromOrder;
+    replayPos = fromOrder;
+    replayEnd = endOrder;
+    replayFrontier[0] = cursorEnd;
+    replayFrontier[1] = cursorCold;
+    replayPhase = REPLAYSCAN;
+}
+
+/*
+ * @brief handle some pages of the replay, the translation pages are located by
+ * the first pass and the sectors written after them are applied by the second
+ *
+ * @param pages
+ * @return 1 if the replay is not finished
+ */
+static int ReplayStep(uint32_t pages)
+{
+    esFtl_BlockSummary summary;
+    SpareData sData;
+    uint32_t order = 0;
+    uint16_t index = 0;
+    int i = 0, pno = 0;
+
+    for (; pages > 0 && replayPhase != REPLAYDONE; pages--)
+    {
+        if (replayPos >= replayEnd)
+        {
+            if (replayPhase == REPLAYAPPLY)
+            {
+                replayPhase = REPLAYDONE;
+                break;
+            }
+
+            replayPhase = REPLAYAPPLY;
+            replayPos = replayEnd;
+            for (index = 0; index < ESFTL_MAPPAGES; index++)
+            {
+                if (replayDataOrder[index] == ORDERNONE)
+                    continue;
+
+                if (replayMapOrder[index] == ORDERNONE)
+                    replayPos = replayStart;
+                else if (replayDataOrder[index] > replayMapOrder[index] && replayMapOrder[index] + 1 < replayPos)
+                    replayPos = replayMapOrder[index] + 1;
+            }
+            continue;
+        }
+
+        /* the blocks cleaned out of the middle of the log are skipped */
+        order = replayPos;
+        pno = esFtl_LogPage(&order, 0);
+        if (pno < 0 || order >= replayEnd)
+        {
+            replayPos = replayEnd;
+            continue;
+        }
+        replayPos = order + 1;
+
+        /* the moved pages are looked at only for the sector numbers, the erased pages after a frontier not at all */
+        if (PagesPastFrontier(pno) || (replayPhase == REPLAYAPPLY && esFtl_IsColdBlock(pno / ESFTL_NANDNUMPAGEBLOCK)))
+        {
+            replayPos = order - pno % ESFTL_NANDNUMPAGEBLOCK + ESFTL_NANDNUMPAGEBLOCK;
+            continue;
+        }
+
+        /* a filled block is handled at once from its summary */
+        if (pno % ESFTL_NANDNUMPAGEBLOCK == 0 && order + ESFTL_NANDNUMPAGEBLOCK <= replayEnd &&
+            !esFtl_ReadBlockSummary(pno / ESFTL_NANDNUMPAGEBLOCK, &summary))
+        {
+            for (i = 0; i < ESFTL_SUMMARYENTRIES; i++)
             {
-                if (sData.released == 0xFF)
-                {
-                    return i;
-                }
-                else
-                {
-                    return -1;
-                }
+                sData.sno = summary.sno[i];
+                sData.released = summary.released[i];
+                if (sData.sno != 0xFFFF)
+                    ReplayPage(order + i, pno + i, &sData);
             }
+
+            replayPos = order + ESFTL_NANDNUMPAGEBLOCK;
+            continue;
+        }
+
+        if (esFtl_NandFlashRead(pno, ESFTL_SPAREOFFSET, (uint8_t *)&sData, SPAREDATASIZE))
+        {
+            ESFTL_LOG("esFTL: FATAL ERROR: %d %s %d\n", order, __FILE__, __LINE__);
+            continue;
+        }
+
+        ReplayPage(order, pno, &sData);
+    }
+
+    return replayPhase != REPLAYDONE;
+}
+
+/*
+ * @brief handle one page of the replay in the current phase
+ *
+ * @param order
+ * @param pno
+ * @param sData
+ */
+static void ReplayPage(uint32_t order, uint16_t pno, SpareData *sData)
+{
+    MapCachePage *slot;
+    uint16_t index = 0;
+
+    /* the summary and the pages which failed to be written */
+    if (sData->sno == ESFTL_SUMMARYSNO || sData->sno == 0xFFFF)
+        return;
+
+    /* a moved page only tells that its sector is in use */
+    if (esFtl_IsColdBlock(pno / ESFTL_NANDNUMPAGEBLOCK))
+    {
+        if (sData->released == 0xFF && lastOpSectorNo < sData->sno)
+            lastOpSectorNo = sData->sno;
+        return;
+    }
+
+    if (replayPhase == REPLAYSCAN)
+    {
+        if (esFtl_IsMapSector(sData->sno))
+        {
+            index = sData->sno - ESFTL_MAPSNOBASE;
+            mapDirectory[index] = pno;
+            replayMapOrder[index] = order;
         }
         else
         {
-            ESFTL_LOG("esFtl: FATAL ERROR: %d %s %d\n", i, __FILE__, __LINE__);
+            replayDataOrder[sData->sno / ESFTL_MAPENTRIESPERPAGE] = order;
+
+            if (sData->released == 0xFF && lastOpSectorNo < sData->sno)
+                lastOpSectorNo = sData->sno;
         }
+        return;
     }
 
-    return -1;
+    if (esFtl_IsMapSector(sData->sno))
+        return;
+
+    /* a sector written while the mount is pending is newer than anything replayed */
+    index = sData->sno / ESFTL_MAPENTRIESPERPAGE;
+    if ((replayMapOrder[index] != ORDERNONE && order < replayMapOrder[index]) || FindPendingWrite(sData->sno) >= 0)
+        return;
+
+    slot = LoadMapPage(index);
+    if (slot)
+    {
+        slot->entries[sData->sno % ESFTL_MAPENTRIESPERPAGE] = (sData->released == 0xFF) ? pno : 0xFFFF;
+        MarkDirty(slot, pno);
+    }
+}
+
+/*
+ * @brief ask whether the page is after a write frontier of the replay, that is erased
+ *
+ * @param pno
+ * @return count of the pages from the frontier to the page, 0 if the page is before it
+ */
+static int PagesPastFrontier(int pno)
+{
+    int i = 0;
+
+    for (i = 0; i < 2; i++)
+    {
+        if (replayFrontier[i] >= 0 && pno / ESFTL_NANDNUMPAGEBLOCK == replayFrontier[i] / ESFTL_NANDNUMPAGEBLOCK &&
+            pno >= replayFrontier[i])
+            return pno - replayFrontier[i] + 1;
+    }
+
+    return 0;
+}
+
+/*
+ * @brief position of the newer write frontier
+ *
+ * @return order
+ */
+static uint32_t LogEnd(void)
+{
+    uint32_t end = esFtl_LogOrder(cursorEnd);
+
+    if (cursorCold >= 0 && esFtl_LogOrder(cursorCold) > end)
+        end = esFtl_LogOrder(cursorCold);
+
+    return end;
+}
+
+/*
+ * @brief read the newest checkpoint and check that its frontiers are in its block table
+ *
+ * @param cp
+ * @return 0 if it is successful
+ */
+static int ReadCheckpointRecord(CheckpointRecord *cp)
+{
+    if (esFtl_ReadCheckpoint((uint8_t *)cp, sizeof(CheckpointRecord)))
+        return -1;
+
+    if (cp->blocks.blockSeq[cp->cursorStart / ESFTL_NANDNUMPAGEBLOCK] == ESFTL_BLOCKFREE ||
+        cp->blocks.blockSeq[cp->cursorEnd / ESFTL_NANDNUMPAGEBLOCK] == ESFTL_BLOCKFREE ||
+        (cp->cursorCold != 0xFFFF && cp->blocks.blockSeq[cp->cursorCold / ESFTL_NANDNUMPAGEBLOCK] == ESFTL_BLOCKFREE))
+    {
+        ESFTL_LOG("Checkpoint is damaged\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * @brief get the block table and find the frontiers, a block is allocated if
+ * the log is empty. The table of the newest checkpoint is taken with the
+ * blocks allocated after it, the tag of every block is read only without one.
+ * The blocks released after the checkpoint stay in the log, their pages are
+ * erased or older than the copies moved out of them
+ *
+ */
+static void FindLog(void)
+{
+    CheckpointRecord *cp = &checkpointRecord;
+    int cold = -1, block = -1;
+
+    if (!ReadCheckpointRecord(cp))
+    {
+        esFtl_LoadBlocks(&cp->blocks);
+        cursorStart = cp->cursorStart;
+        FindFrontiers(cp->cursorEnd, (cp->cursorCold == 0xFFFF) ? -1 : cp->cursorCold);
+        return;
+    }
+
+    block = esFtl_ScanBlocks(&cold);
+
+    cursorCold = (cold < 0) ? -1 : FindFrontier(cold * ESFTL_NANDNUMPAGEBLOCK, 1);
+
+    if (block >= 0)
+    {
+        cursorEnd = FindFrontier(block * ESFTL_NANDNUMPAGEBLOCK, 0);
+        return;
+    }
+
+    block = esFtl_AllocateBlock(0);
+    if (block < 0)
+        block = 0;
+
+    if (cold < 0)
+        cursorStart = block * ESFTL_NANDNUMPAGEBLOCK;
+    cursorEnd = block * ESFTL_NANDNUMPAGEBLOCK;
+}
+
+/*
+ * @brief take over the blocks allocated after the checkpoint and find the
+ * frontiers in the newest block of each
+ *
+ * @param host page of the host frontier at the checkpoint
+ * @param cold page of the cold frontier at the checkpoint, -1 if there is none
+ */
+static void FindFrontiers(int host, int cold)
+{
+    uint8_t isCold = 0;
+    int block = 0;
+
+    while ((block = esFtl_AdoptBlock(&isCold)) >= 0)
+    {
+        if (isCold)
+            cold = block * ESFTL_NANDNUMPAGEBLOCK;
+        else
+            host = block * ESFTL_NANDNUMPAGEBLOCK;
+    }
+
+    cursorEnd = FindFrontier(host, 0);
+    cursorCold = (cold < 0) ? -1 : FindFrontier(cold, 1);
 }
 
 /*
- * @brief increment one the end point of the cursor
+ * @brief find the first erased page of a frontier by a binary search over the
+ * pages of its block, a full host block is followed by a new one
  *
+ * @param pno a page which is known to be written or to be the frontier
+ * @param cold 1 for the frontier of the moved pages, a full block is followed at the next move
+ * @return page number of the frontier, -1 if the cold block is full
  */
-void esFtl_IncrementCursorEnd(void)
+static int FindFrontier(int pno, uint8_t cold)
 {
-    cursorEnd++;
-    if (cursorEnd >= 0xFFFF)
-        cursorEnd = 0;
+    SpareData sData;
+    int block = pno / ESFTL_NANDNUMPAGEBLOCK, next = 0, low = pno % ESFTL_NANDNUMPAGEBLOCK, high = ESFTL_NANDNUMPAGEBLOCK, mid = 0;
+
+    while (low < high)
+    {
+        mid = (low + high) / 2;
+        if (esFtl_NandFlashRead(block * ESFTL_NANDNUMPAGEBLOCK + mid, ESFTL_SPAREOFFSET, (uint8_t *)&sData, 2) ||
+            sData.sno != 0xFFFF)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if (low < ESFTL_NANDNUMPAGEBLOCK)
+        return block * ESFTL_NANDNUMPAGEBLOCK + low;
+
+    if (cold)
+        return -1;
+
+    next = esFtl_AllocateBlock(0);
+    if (next < 0)
+        return block * ESFTL_NANDNUMPAGEBLOCK + ESFTL_NANDNUMPAGEBLOCK - 1;
+
+    return next * ESFTL_NANDNUMPAGEBLOCK;
 }
 
 /*
- * @brief assign page to a sector in the cache
+ * @brief find the page of a sector while the map is being built, the replayed
+ * part of the log is searched backwards from the frontier
  *
  * @param sno
- * @param pno
+ * @return -1 if the sector is not assigned
+ */
+static int LookupPending(uint16_t sno)
+{
+    esFtl_BlockSummary summary;
+    SpareData sData;
+    uint16_t index = sno / ESFTL_MAPENTRIESPERPAGE, mapPno = mapDirectory[index], entry = 0xFFFF;
+    uint32_t order = 0, position = 0;
+    int i = 0, pno = 0, past = 0;
+
+    i = FindPendingWrite(sno);
+    if (i >= 0)
+        return pendingWrites[i].pno;
+
+    for (order = replayEnd; order > replayStart; order--)
+    {
+        position = order - 1;
+        pno = esFtl_LogPage(&position, 1);
+        if (pno < 0 || position < replayStart)
+            break;
+        order = position + 1;
+
+        /* the moved pages are never replayed and the erased pages after a frontier hold nothing */
+        if (esFtl_IsColdBlock(pno / ESFTL_NANDNUMPAGEBLOCK))
+        {
+            order -= pno % ESFTL_NANDNUMPAGEBLOCK;
+            continue;
+        }
+
+        past = PagesPastFrontier(pno);
+        if (past)
+        {
+            order -= past - 1;
+            continue;
+        }
+
+        /* a filled block is searched in its summary */
+        if (esFtl_IsSummaryPage(pno) && order >= replayStart + ESFTL_NANDNUMPAGEBLOCK &&
+            !esFtl_ReadBlockSummary(pno / ESFTL_NANDNUMPAGEBLOCK, &summary))
+        {
+            for (i = ESFTL_SUMMARYENTRIES - 1; i >= 0; i--)
+            {
+                if (summary.sno[i] == sno)
+                    return (summary.released[i] == 0xFF) ? pno - ESFTL_SUMMARYENTRIES + i : -1;
+
+                if (summary.sno[i] == ESFTL_MAPSNOBASE + index)
+                    break;
+            }
+
+            if (i >= 0)
+            {
+                mapPno = pno - ESFTL_SUMMARYENTRIES + i;
+                break;
+            }
+
+            order -= ESFTL_SUMMARYENTRIES;
+            continue;
+        }
+
+        if (esFtl_NandFlashRead(pno, ESFTL_SPAREOFFSET, (uint8_t *)&sData, SPAREDATASIZE))
+            continue;
+
+        if (sData.sno == sno)
+            return (sData.released == 0xFF) ? pno : -1;
+
+        if (sData.sno == ESFTL_MAPSNOBASE + index)
+        {
+            mapPno = pno;
+            break;
+        }
+    }
+
+    if (mapPno == 0xFFFF ||
+        esFtl_NandFlashRead(mapPno, (sno % ESFTL_MAPENTRIESPERPAGE) * 2, (uint8_t *)&entry, sizeof(entry)))
+        return -1;
+
+    return (entry == 0xFFFF) ? -1 : entry;
+}
+
+/*
+ * @brief find a sector among the writes done before a lazy mount is finished
+ *
+ * @param sno
+ * @return position in pendingWrites, -1 if the sector is not there
  */
-void esFtl_SetSectorCache(uint16_t sno, uint16_t pno)
+static int FindPendingWrite(uint16_t sno)
 {
-    if (sno < ESFTL_SECTORCACHESIZE)
-        sectorCache[sno] = pno;
+    int i = 0;
+
+    for (i = numPendingWrites - 1; i >= 0; i--)
+    {
+        if (pendingWrites[i].sno == sno)
+            return i;
+    }
+
+    return -1;
 }
+
+#endif
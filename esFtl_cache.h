@@ -18,14 +18,35 @@
 #ifndef ESFTL_CACHE_H__
 #define ESFTL_CACHE_H__
 
+#define ESFTL_MAPENTRIESPERPAGE (ESFTL_NANDPAGEDATASIZE / 2)
+#define ESFTL_MAPPAGES (0x10000 / ESFTL_MAPENTRIESPERPAGE)
+#define ESFTL_MAPSNOBASE 0xFF80 /* translation pages are stored as sectors ESFTL_MAPSNOBASE + index */
+#define ESFTL_MAXSECTORS ((ESFTL_NANDNUMBLOCKS - ESFTL_CHECKPOINTBLOCKS - ESFTL_BBTBLOCKS - ESFTL_SPAREBLOCKS) * (ESFTL_NANDNUMPAGEBLOCK - 1) - ESFTL_MAPPAGES) /* sectors the host can write, the rest of the log holds the translation pages and the room of the defragment */
+
 uint8_t esFtl_IsDefragNeeded(void);
 void esFtl_EvaluateCursorAndCache(void);
+void esFtl_EvaluateCursorLazy(void);
+int esFtl_MountStep(void);
+void esFtl_FinishMount(void);
+int esFtl_LoadCheckpoint(uint8_t lazy);
+int esFtl_Checkpoint(uint8_t clean);
+void esFtl_CheckpointIfDue(void);
 int esFtl_FindSectorPage(uint16_t sno);
-void esFtl_IncrementCursorEnd(void);
-void esFtl_SetSectorCache(uint16_t sno, uint16_t pno);
+void esFtl_FindSectorPages(uint16_t sno, uint16_t count, uint16_t *pages);
+void esFtl_IncrementCursor(uint8_t cold);
+int esFtl_FlushMapJournal(uint16_t block);
+void esFtl_BuildValidPages(void);
+int esFtl_PrepareSectorCache(uint16_t sno);
+int esFtl_SetSectorCache(uint16_t sno, uint16_t pno);
+int esFtl_ReleaseSectorCache(uint16_t sno, uint16_t pno, uint8_t defer);
+int esFtl_FlushWantedMapPages(void);
+int esFtl_IsMapSector(uint16_t sno);
+int esFtl_RelocateMapPage(uint16_t sno);
+int esFtl_FlushSectorCache(void);
 
 extern int cursorEnd;
 extern int cursorStart;
+extern int cursorCold;
 extern uint16_t lastOpSectorNo;
 extern uint8_t defragmentNeeded;
 
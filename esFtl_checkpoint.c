@@ -0,0 +1,303 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "esFtl_definitions.h"
+#include "esFtl_disk.h"
+#include "esFtl_write.h"
+#include "esFtl_checksum.h"
+#include "esFtl_checkpoint.h"
+
+#if !ESFTL_HYBRIDMAPPING
+
+/*
+ * Checkpoints are appended to the pages of one of the reserved blocks, when
+ * it is full the other one is erased and used. Every checkpoint carries a
+ * sequence number and a crc, so the newest complete one survives a power
+ * loss in the middle of writing the next one. A checkpoint larger than a
+ * page is split into parts written to consecutive pages of the same block.
+ */
+#define CHECKPOINTMAGIC 0x50434645
+#define CHECKPOINTWRITERETRIES 4
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint16_t size;
+    uint16_t crc;
+    uint16_t part;
+    uint16_t checksum; /* format flag, the kind of every checksum of the image */
+} CheckpointHeader;
+
+#define CHECKPOINTPAYLOAD (ESFTL_NANDPAGEDATASIZE - sizeof(CheckpointHeader))
+#define CHECKPOINTPARTS(size) (((size) + CHECKPOINTPAYLOAD - 1) / CHECKPOINTPAYLOAD)
+
+static uint8_t checkpointBuff[ESFTL_NANDPAGEDATASIZE];
+static uint32_t checkpointSeq = 0;
+static uint16_t checkpointBlock = ESFTL_CHECKPOINTFIRSTBLOCK;
+static uint8_t checkpointNextPage = 0;
+
+static int ReadHeader(uint16_t block, uint8_t page, CheckpointHeader *hdr);
+static int ReadParts(uint16_t block, int page, uint8_t *record, uint16_t size);
+static uint8_t CountWrittenPages(uint16_t block);
+
+/*
+ * @brief find the newest valid checkpoint, it also determines where the next one is written
+ *
+ * @param record
+ * @param size
+ * @return 0 if a checkpoint is found
+ */
+int esFtl_ReadCheckpoint(uint8_t *record, uint16_t size)
+{
+    CheckpointHeader hdr, first[ESFTL_CHECKPOINTBLOCKS];
+    uint16_t block = 0, newest = 0;
+    uint16_t kind = esFtl_GetChecksum();
+    int written[ESFTL_CHECKPOINTBLOCKS];
+    int i = 0, j = 0, page = 0;
+
+    checkpointSeq = 0;
+    checkpointBlock = ESFTL_CHECKPOINTFIRSTBLOCK;
+    checkpointNextPage = 0;
+
+    for (i = 0; i < ESFTL_CHECKPOINTBLOCKS; i++)
+    {
+        written[i] = 0;
+        if (!ReadHeader(ESFTL_CHECKPOINTFIRSTBLOCK + i, 0, &first[i]))
+        {
+            written[i] = 1;
+            if (first[i].seq >= checkpointSeq)
+                checkpointSeq = first[i].seq + 1;
+        }
+    }
+
+    /* blocks are tried from the newest one */
+    for (i = 0; i < ESFTL_CHECKPOINTBLOCKS; i++)
+    {
+        newest = 0xFFFF;
+        for (j = 0; j < ESFTL_CHECKPOINTBLOCKS; j++)
+        {
+            if (written[j] && (newest == 0xFFFF || first[j].seq > first[newest].seq))
+                newest = j;
+        }
+
+        if (newest == 0xFFFF)
+            break;
+
+        written[newest] = 0;
+        block = ESFTL_CHECKPOINTFIRSTBLOCK + newest;
+
+        page = CountWrittenPages(block);
+        if (i == 0)
+        {
+            checkpointBlock = block;
+            checkpointNextPage = page;
+        }
+
+        for (page = page - 1; page >= 0; page--)
+        {
+            if (ReadHeader(block, page, &hdr) || hdr.size != size || hdr.part != CHECKPOINTPARTS(size) - 1)
+                continue;
+
+            /* the bad block table tells the checksum of the image, a checkpoint of another one is not trusted */
+            if (hdr.checksum != kind)
+                continue;
+
+            if (ReadParts(block, page, record, size))
+            {
+                ESFTL_LOG("Checkpoint %d of block %d is corrupted\n", page, block);
+                continue;
+            }
+
+            if (hdr.seq >= checkpointSeq)
+                checkpointSeq = hdr.seq + 1;
+
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * @brief find the checksum kind of the newest checkpoint, it is looked at only
+ * when the bad block table which holds it is lost
+ *
+ * @param kind set to the checksum of the image
+ * @return 0 if a checkpoint is found
+ */
+int esFtl_ReadCheckpointChecksum(uint16_t *kind)
+{
+    CheckpointHeader hdr;
+    uint32_t newest = 0;
+    int i = 0, found = 0;
+
+    for (i = 0; i < ESFTL_CHECKPOINTBLOCKS; i++)
+    {
+        if (ReadHeader(ESFTL_CHECKPOINTFIRSTBLOCK + i, 0, &hdr) || (found && hdr.seq < newest))
+            continue;
+
+        newest = hdr.seq;
+        *kind = hdr.checksum;
+        found = 1;
+    }
+
+    return found ? 0 : -1;
+}
+
+/*
+ * @brief append a checkpoint to the reserved blocks
+ *
+ * @param record
+ * @param size
+ * @return 0 if it is successful
+ */
+int esFtl_WriteCheckpoint(uint8_t *record, uint16_t size)
+{
+    CheckpointHeader hdr;
+    uint16_t parts = CHECKPOINTPARTS(size), chunk = 0;
+    int retry = 0, rv = 0;
+
+    if (parts == 0 || parts > ESFTL_NANDNUMPAGEBLOCK)
+        return -1;
+
+    hdr.magic = CHECKPOINTMAGIC;
+    hdr.size = size;
+    hdr.crc = esFtl_CalcChecksum(record, size);
+    hdr.checksum = esFtl_GetChecksum();
+
+    for (retry = 0; retry < CHECKPOINTWRITERETRIES; retry++)
+    {
+        /* the parts of a checkpoint never straddle two blocks */
+        if (checkpointNextPage + parts > ESFTL_NANDNUMPAGEBLOCK)
+        {
+            checkpointBlock++;
+            if (checkpointBlock >= ESFTL_NANDNUMBLOCKS)
+                checkpointBlock = ESFTL_CHECKPOINTFIRSTBLOCK;
+            checkpointNextPage = 0;
+        }
+
+        if (checkpointNextPage == 0 && esFtl_NandFlashBlockErase(checkpointBlock))
+        {
+            ESFTL_LOG("Erase checkpoint block fail %d!!\n", checkpointBlock);
+            checkpointNextPage = ESFTL_NANDNUMPAGEBLOCK;
+            continue;
+        }
+
+        hdr.seq = checkpointSeq;
+        for (hdr.part = 0, rv = 0; hdr.part < parts && !rv; hdr.part++)
+        {
+            chunk = size - hdr.part * CHECKPOINTPAYLOAD;
+            if (chunk > CHECKPOINTPAYLOAD)
+                chunk = CHECKPOINTPAYLOAD;
+
+            memcpy(checkpointBuff, &hdr, sizeof(hdr));
+            memcpy(&checkpointBuff[sizeof(hdr)], &record[hdr.part * CHECKPOINTPAYLOAD], chunk);
+
+            rv = esFtl_NandFlashWrite(checkpointBlock * ESFTL_NANDNUMPAGEBLOCK + checkpointNextPage++, 0, checkpointBuff, sizeof(hdr) + chunk);
+        }
+
+        if (!rv)
+        {
+            checkpointSeq++;
+            return 0;
+        }
+
+        ESFTL_LOG("esFtl: FATAL ERROR:%d %s %d\n", checkpointBlock, __FILE__, __LINE__);
+    }
+
+    return -1;
+}
+
+/*
+ * @brief ask whether the block is reserved for the checkpoints
+ *
+ * @param block
+ * @return 1 if it is reserved
+ */
+int esFtl_IsCheckpointBlock(uint16_t block)
+{
+    return block >= ESFTL_CHECKPOINTFIRSTBLOCK && block < ESFTL_NANDNUMBLOCKS;
+}
+
+static int ReadHeader(uint16_t block, uint8_t page, CheckpointHeader *hdr)
+{
+    if (esFtl_NandFlashRead(block * ESFTL_NANDNUMPAGEBLOCK + page, 0, (uint8_t *)hdr, sizeof(CheckpointHeader)))
+        return -1;
+
+    return hdr->magic == CHECKPOINTMAGIC ? 0 : -1;
+}
+
+/*
+ * @brief assemble a checkpoint from its parts, the last part is at the page
+ *
+ * @param block
+ * @param page
+ * @param record
+ * @param size
+ * @return 0 if all the parts belong to the same checkpoint and the crc matches
+ */
+static int ReadParts(uint16_t block, int page, uint8_t *record, uint16_t size)
+{
+    CheckpointHeader last, hdr;
+    uint16_t parts = CHECKPOINTPARTS(size), chunk = 0;
+    int part = 0;
+
+    if (page + 1 < parts || ReadHeader(block, page, &last))
+        return -1;
+
+    for (part = parts - 1; part >= 0; part--, page--)
+    {
+        if (ReadHeader(block, page, &hdr) || hdr.seq != last.seq || hdr.size != size || hdr.part != part)
+            return -1;
+
+        chunk = size - part * CHECKPOINTPAYLOAD;
+        if (chunk > CHECKPOINTPAYLOAD)
+            chunk = CHECKPOINTPAYLOAD;
+
+        if (esFtl_NandFlashRead(block * ESFTL_NANDNUMPAGEBLOCK + page, sizeof(CheckpointHeader), &record[part * CHECKPOINTPAYLOAD], chunk))
+            return -1;
+    }
+
+    return esFtl_CalcChecksum(record, size) == last.crc ? 0 : -1;
+}
+
+/*
+ * @brief the pages of a checkpoint block are written in order, so the first erased one is found by a binary search
+ *
+ * @param block
+ * @return count of written pages
+ */
+static uint8_t CountWrittenPages(uint16_t block)
+{
+    CheckpointHeader hdr;
+    int low = 1, high = ESFTL_NANDNUMPAGEBLOCK, mid = 0;
+
+    while (low < high)
+    {
+        mid = (low + high) / 2;
+        if (esFtl_NandFlashRead(block * ESFTL_NANDNUMPAGEBLOCK + mid, 0, (uint8_t *)&hdr, sizeof(hdr)) ||
+            hdr.magic != 0xFFFFFFFF)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+#endif
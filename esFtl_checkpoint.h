@@ -0,0 +1,28 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef ESFTL_CHECKPOINT_H__
+#define ESFTL_CHECKPOINT_H__
+
+#define ESFTL_CHECKPOINTFIRSTBLOCK (ESFTL_NANDNUMBLOCKS - ESFTL_CHECKPOINTBLOCKS)
+
+int esFtl_ReadCheckpoint(uint8_t *record, uint16_t size);
+int esFtl_WriteCheckpoint(uint8_t *record, uint16_t size);
+int esFtl_ReadCheckpointChecksum(uint16_t *kind);
+int esFtl_IsCheckpointBlock(uint16_t block);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,29 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef ESFTL_CHECKSUM_H__
+#define ESFTL_CHECKSUM_H__
+
+#define ESFTL_CHECKSUMCRC16 0xFFFF /* crc-16/ccitt of esFtl_CalcCrc16, the images written before the flag existed carry it */
+#define ESFTL_CHECKSUMNAND 0x0001  /* esFtl_NandFlashChecksum of the disk driver */
+
+uint16_t esFtl_CalcCrc16(uint16_t crc, uint8_t *data_p, uint32_t length);
+uint16_t esFtl_CalcChecksum(uint8_t *data, uint32_t length);
+int esFtl_SelectChecksum(uint16_t kind);
+uint16_t esFtl_GetChecksum(void);
+
+#endif
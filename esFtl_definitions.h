@@ -23,7 +23,95 @@
 #include <stdint.h>
 
 #define ESFTL_LOG(f_, ...) //printf((f_), ##__VA_ARGS__)
-#define ESFTL_SECTORCACHESIZE 2048
-#define ESFTL_FREEBLOCKLIMITFORDEFRAGMENT 128
+#define ESFTL_SPAREOFFSET (ESFTL_NANDPAGEDATASIZE + 1) /* sector number, crc and release mark of a page, the first spare byte is left to the factory bad block marker */
+#define ESFTL_PAGEBUFFSIZE (ESFTL_SPAREOFFSET + 4) /* page data, marker byte, sector number and crc as a page is written */
+/*
+ * Translation pages kept in RAM, 2 KB each. A dirty page which is evicted is
+ * written to the log, so with random writes over more sectors than the cache
+ * maps nearly every write also writes a translation page: bench measures a
+ * write amplification of 9.2 with 2 pages, 8.7 with 8 and 5.0 with 64 (the
+ * whole map, 128 KB) for random writes over 50000 sectors at 90 % fill.
+ */
+#ifndef ESFTL_MAPCACHEPAGES
+#define ESFTL_MAPCACHEPAGES 2
+#endif
+#define ESFTL_FREEBLOCKLIMITFORDEFRAGMENT 128 /* soft limit, below it esFtl_IsDefragNeeded asks for esFtl_Idle or esFtl_Defrag */
+#define ESFTL_DEFRAGHARDLIMIT 32 /* below this many free blocks every write does a defragment step itself */
+#define ESFTL_DEFRAGSTEPPAGES 16 /* valid pages moved by the defragment step of esFtl_Idle or of a write */
+#ifndef ESFTL_ERASEDPOOLBLOCKS
+#define ESFTL_ERASEDPOOLBLOCKS 4 /* free blocks esFtl_Idle keeps erased ahead of the writes */
+#endif
+#define ESFTL_DEFRAGBLOCKS 64 /* blocks freed by a defragment beyond ESFTL_FREEBLOCKLIMITFORDEFRAGMENT */
+#ifndef ESFTL_RESERVEBLOCKS
+#define ESFTL_RESERVEBLOCKS 4 /* last free blocks, only the defragment moves and the translation pages take them, a host write fails instead */
+#endif
+#ifndef ESFTL_SPAREBLOCKS
+#define ESFTL_SPAREBLOCKS 96 /* blocks of the log the host sectors can not fill, see ESFTL_MAXSECTORS, with fewer the random writes to a full device run out of free blocks */
+#endif
+#define ESFTL_GCFIFO 0        /* the oldest block is cleaned first */
+#define ESFTL_GCGREEDY 1      /* the block with the fewest valid pages is cleaned first */
+#define ESFTL_GCCOSTBENEFIT 2 /* free space gained times age per page copied */
+#ifndef ESFTL_GCPOLICY
+#define ESFTL_GCPOLICY ESFTL_GCCOSTBENEFIT
+#endif
+#define ESFTL_GCMAXAGE 16384 /* a block older than this many allocations is cleaned whatever it holds */
+#ifndef ESFTL_WEARLEVELSPREAD
+#define ESFTL_WEARLEVELSPREAD 128 /* erase count difference above which the least worn block is cleaned */
+#endif
+#define ESFTL_CHECKPOINTBLOCKS 2 /* last blocks of the flash, they hold the checkpoints of the map */
+#define ESFTL_BBTBLOCKS 2 /* blocks in front of the checkpoint blocks, the last ones in hybrid mode, each holds a copy of the bad block table */
+#define ESFTL_CHECKPOINTINTERVAL 512 /* log pages written between two checkpoints */
+#ifndef ESFTL_LAZYMOUNT
+#define ESFTL_LAZYMOUNT 0 /* 1 makes esFtl_Init return once the write frontier is found, see esFtl_MountStep */
+#endif
+#define ESFTL_LAZYMOUNTSTEPPAGES 256 /* log pages handled by one esFtl_MountStep */
+#define ESFTL_LAZYMOUNTWRITES 64 /* sectors written before the map is complete, held in RAM */
+
+#ifndef ESFTL_WRITEBUFFERSECTORS
+#define ESFTL_WRITEBUFFERSECTORS 0 /* sectors held in RAM by the write-back buffer, 2 KB each, 0 writes every call through */
+#endif
+#define ESFTL_WRITEBUFFERAGE 1000 /* ms a written sector may wait in the buffer, see esFtl_WriteBufferTick */
+#ifndef ESFTL_READCACHESECTORS
+#define ESFTL_READCACHESECTORS 0 /* recently read sectors held in RAM, 2 KB each, 0 reads every call from the flash */
+#endif
+#ifndef ESFTL_READAHEADSECTORS
+#define ESFTL_READAHEADSECTORS 0 /* largest read-ahead window, 2 KB of RAM each, 0 reads no sector ahead */
+#endif
+#define ESFTL_READAHEADTRIGGER 2 /* sequential reads which start the read-ahead */
+#ifndef ESFTL_SCRUBSTEPPAGES
+#define ESFTL_SCRUBSTEPPAGES 8 /* valid pages checked by the scrub step of esFtl_Idle, 0 leaves the scrubbing to the host */
+#endif
+#define ESFTL_SCRUBSECTORS 16 /* corrupted sectors the scrubber remembers, see esFtl_GetScrubStats */
+
+#ifndef ESFTL_NANDCOPYBACK
+#define ESFTL_NANDCOPYBACK 1 /* the disk driver moves pages inside the chip, see esFtl_NandFlashCopyPage */
+#endif
+
+#ifndef ESFTL_NANDCACHEREAD
+#define ESFTL_NANDCACHEREAD 1 /* the disk driver streams consecutive pages, see esFtl_NandFlashReadPages */
+#endif
+#ifndef ESFTL_NANDCHECKSUM
+#define ESFTL_NANDCHECKSUM 0 /* the disk driver computes checksums, see esFtl_NandFlashChecksum */
+#endif
+#ifndef ESFTL_CHECKSUM
+#if ESFTL_NANDCHECKSUM
+#define ESFTL_CHECKSUM ESFTL_CHECKSUMNAND /* checksum of a newly formatted image */
+#else
+#define ESFTL_CHECKSUM ESFTL_CHECKSUMCRC16
+#endif
+#endif
+
+#ifndef ESFTL_HYBRIDMAPPING
+/*
+ * 1 selects block mapping with page mapped log blocks. It is BAST only, a log
+ * block belongs to one logical block and there is no log shared by the random
+ * writes, so scattered small writes merge a whole block for a few sectors:
+ * bench measures a write amplification of about 44 for random and 36 for zipf
+ * writes against 1.0 for sequential ones. It suits mostly sequential data.
+ */
+#define ESFTL_HYBRIDMAPPING 0
+#endif
+#define ESFTL_HYBRIDLOGBLOCKS 8
+#define ESFTL_HYBRIDSPAREBLOCKS 24
 
 #endif
\ No newline at end of file
@@ -20,119 +20,327 @@
 #include "esFtl_cache.h"
 #include "esFtl_write.h"
 #include "esFtl_bbm.h"
+#include "esFtl_summary.h"
+#include "esFtl_blocks.h"
 #include "esFtl_defragment.h"
 
+#if !ESFTL_HYBRIDMAPPING
+
 /*
- * @brief mark the block as the starting point in order to find at the beginning
+ * A defragment pass is split into steps which keep their progress here, the
+ * victim is cleaned page by page and erased when all its valid pages are
+ * moved. Foreground writes between the steps only make pages of the victim
+ * stale, which are then skipped.
+ */
+static esFtl_BlockSummary victimSummary;
+static uint8_t victimOrder[ESFTL_NANDNUMPAGEBLOCK];
+static int victim = -1;
+static uint8_t victimPage = 0;
+static uint8_t victimHasSummary = 0;
+static uint8_t passActive = 0;
+static uint8_t stepRunning = 0;
+static int passFreeBlocks = 0;
+
+static int PassWanted(void);
+static void EndPass(void);
+static int OpenVictim(void);
+static int MovePage(uint8_t page);
+static int EraseVictim(uint8_t erase);
+static void SortBySector(const esFtl_BlockSummary *summary, uint8_t *order);
+
+/*
+ * @brief eliminate the useless pages by moving valid ones to new blocks, the victims are picked by the gc policy
  *
- * @param bno
- * @return 0 if it is successful
  */
-int esFtl_MarkedFirstBlock(int bno)
+void esFtl_Defrag(void)
 {
-    int rv = -1;
-    uint8_t markedByte = 0x55;
+    ESFTL_LOG("Defragment Start:%d %d\n", cursorStart, cursorEnd);
 
-    bno = bno % ESFTL_NANDNUMBLOCKS;
+    while (esFtl_DefragStep(0xFFFF, 0xFFFF))
+        ;
 
-    rv = esFtl_NandFlashWrite(bno * ESFTL_NANDNUMPAGEBLOCK, ESFTL_NANDPAGEDATASIZE + 5, &markedByte, 1);
-    if (rv)
-        ESFTL_LOG("MarkedFirstBlock %d Error\n", bno * ESFTL_NANDNUMPAGEBLOCK);
+    /* the blocks retired by the steps of the writes are erased as well */
+    while (esFtl_EraseDirtyBlock(ESFTL_ERASEDPOOLBLOCKS))
+        ;
 
-    return rv;
+    ESFTL_LOG("Defragment End\n");
 }
 
 /*
- * @brief eliminate the useless pages by moving valid ones to new blocks
+ * @brief do a bounded part of a defragment pass, it may be interleaved with reads and writes
  *
+ * @param moves count of valid pages which may be moved
+ * @param erases count of blocks which may be erased, a victim cleaned when
+ * none is left is retired and erased later by esFtl_EraseDirtyBlock
+ * @return 1 if the pass is not over
  */
-void esFtl_Defrag(void)
+int esFtl_DefragStep(uint16_t moves, uint16_t erases)
 {
-    uint8_t tempBuff[ESFTL_NANDPAGESIZE + 1];
-    uint16_t sno = 0, pno = 0, pnoOrg = 0;
-    int endBlock = 0, startBlock = 0, i = 0;
+    uint8_t erase = 0;
+    int rv = 1, moved = 0;
 
-    ESFTL_LOG("Defragment Start:%d %d\n", cursorStart, cursorEnd);
+    /* the moved pages are written by esFtl_FtlDriverWrite which may ask for a step itself */
+    if (stepRunning)
+        return 1;
+    stepRunning = 1;
 
-    endBlock = cursorEnd / ESFTL_NANDNUMPAGEBLOCK;
-    startBlock = cursorStart / ESFTL_NANDNUMPAGEBLOCK;
+    esFtl_FinishMount();
+    esFtl_BuildValidPages();
 
-    if (endBlock != startBlock)
+    while (rv)
     {
-        i = startBlock;
-        do
+        if (victim < 0)
         {
-            if (esFtl_IsBadBlock(i))
+            /* a block the scrubber found corrupted is cleaned whether a pass is wanted or not */
+            if ((esFtl_SuspectVictim() < 0 && !PassWanted()) || OpenVictim())
             {
-				i++;
-                continue;
+                EndPass();
+                rv = 0;
+                break;
             }
+        }
 
-            for (int j = 0; j < ESFTL_NANDNUMPAGEBLOCK; j++)
+        for (; victimPage < ESFTL_NANDNUMPAGEBLOCK && moves; victimPage++)
+        {
+            if (victimHasSummary && victimPage == ESFTL_SUMMARYENTRIES)
             {
-                pno = i * ESFTL_NANDNUMPAGEBLOCK + j;
-
-                if (pno == 0xFFFF)
-                    break;
-
-                if (!esFtl_NandFlashRead(pno, ESFTL_NANDPAGEDATASIZE, &tempBuff[ESFTL_NANDPAGEDATASIZE], 2))
-                {
-                    memcpy(&sno, &tempBuff[ESFTL_NANDPAGEDATASIZE], 2);
-                    pnoOrg = esFtl_FindSectorPage(sno);
-                    if (pnoOrg == pno)
-                    {
-                        if (!esFtl_NandFlashRead(pno, 0, tempBuff, ESFTL_NANDPAGEDATASIZE))
-                        {
-                            ESFTL_LOG("Sector %d is moved to page from %d to %d\n", sno, pno, cursorEnd);
-                            esFtl_FtlDriverWrite(sno - 1, tempBuff, 0, ESFTL_NANDPAGEDATASIZE);
-                        }
-                        else
-                        {
-                            ESFTL_LOG("esFtl: FATAL ERROR:%s %d\n", __FILE__, __LINE__);
-                        }
-                    }
-                }
-                else
-                {
-                    ESFTL_LOG("esFtl: FATAL ERROR:%s %d\n", __FILE__, __LINE__);
-                }
+                victimPage = ESFTL_NANDNUMPAGEBLOCK;
+                break;
             }
 
-            esFtl_MarkedFirstBlock(i + 1);
-            esFtl_NandFlashBlockErase(i);
+            moved = MovePage(victimOrder[victimPage]);
+            if (moved < 0)
+                break;
+            if (moved)
+                moves--;
+        }
+
+        /* a page which can not be moved keeps the victim out of the erase, the step gives up until the next call */
+        if (moved < 0)
+        {
+            rv = 0;
+            break;
+        }
 
-            ESFTL_LOG("Block %d processed\n", i);
+        if (victimPage < ESFTL_NANDNUMPAGEBLOCK)
+            break;
 
-            i++;
-            if (i >= ESFTL_NANDNUMBLOCKS)
-                i = 0;
-        } while (i != endBlock);
+        erase = erases > 0;
+        if (EraseVictim(erase))
+            rv = 0;
+        if (!erase)
+            break;
+        erases--;
     }
 
-    ESFTL_LOG("Defragment End\n");
+    stepRunning = 0;
+    return rv;
+}
 
-    esFtl_EvaluateCursorAndCache();
+/*
+ * @brief ask whether a pass is running, that is the idle hook has something to do
+ *
+ * @return 1 if it is
+ */
+int esFtl_DefragPending(void)
+{
+    return passActive || esFtl_IsDefragNeeded() || esFtl_SuspectVictim() >= 0;
 }
 
 /*
- * @brief determine the free space as count of page
+ * @brief forget the pass in progress, a mount starts again from the flash where
+ * the moves since the last flush of the map are not visible
  *
- * @return count of pages
  */
-int esFtl_CalcFreePages(void)
+void esFtl_ResetDefrag(void)
+{
+    victim = -1;
+    victimPage = 0;
+    passActive = 0;
+}
+
+/*
+ * @brief a pass starts below the soft limit and goes on until ESFTL_DEFRAGBLOCKS more blocks are free
+ *
+ * @return 1 if another victim should be cleaned
+ */
+static int PassWanted(void)
+{
+    int tooOld = esFtl_BlockAge(cursorStart / ESFTL_NANDNUMPAGEBLOCK) > ESFTL_GCMAXAGE;
+
+    if (!passActive)
+    {
+        if (esFtl_NumFreeBlocks() >= ESFTL_FREEBLOCKLIMITFORDEFRAGMENT && !tooOld)
+            return 0;
+
+        passActive = 1;
+        passFreeBlocks = esFtl_NumFreeBlocks();
+    }
+
+    return esFtl_NumFreeBlocks() < ESFTL_FREEBLOCKLIMITFORDEFRAGMENT + ESFTL_DEFRAGBLOCKS || tooOld;
+}
+
+static void EndPass(void)
+{
+    if (!passActive)
+        return;
+
+    passActive = 0;
+
+    /* the map and the cursors are kept up to date while the blocks are moved */
+    defragmentNeeded = esFtl_CheckIfDefragmentNeeded();
+    esFtl_Checkpoint(0);
+}
+
+/*
+ * @brief select the next victim and order its pages by sector
+ *
+ * @return 0 if there is a victim
+ */
+static int OpenVictim(void)
+{
+    int i = 0;
+
+    victim = esFtl_SelectVictimBlock();
+    if (victim < 0)
+        return -1;
+
+    victimHasSummary = !esFtl_ReadBlockSummary(victim, &victimSummary);
+    for (i = 0; i < ESFTL_NANDNUMPAGEBLOCK; i++)
+        victimOrder[i] = i;
+    if (victimHasSummary)
+        SortBySector(&victimSummary, victimOrder);
+
+    victimPage = 0;
+    return 0;
+}
+
+/*
+ * @brief move the page of the victim if it still holds the current copy of its sector
+ *
+ * @param page
+ * @return 1 if the page is moved, 0 if it is not valid, -1 if it can not be moved
+ */
+static int MovePage(uint8_t page)
+{
+    uint16_t spare[2] = {0};
+    uint16_t sno = 0, pno = victim * ESFTL_NANDNUMPAGEBLOCK + page;
+
+    /* a stale page is skipped without reading it or looking its sector up */
+    if (!esFtl_IsPageValid(pno))
+        return 0;
+
+    if (victimHasSummary)
+    {
+        spare[0] = victimSummary.sno[page];
+        spare[1] = victimSummary.pageCrc[page];
+    }
+    else if (esFtl_NandFlashRead(pno, ESFTL_SPAREOFFSET, (uint8_t *)spare, sizeof(spare)))
+    {
+        ESFTL_LOG("esFtl: FATAL ERROR:%s %d\n", __FILE__, __LINE__);
+        return 0;
+    }
+    sno = spare[0];
+
+    if (esFtl_IsMapSector(sno))
+    {
+        ESFTL_LOG("Translation page %d is moved from %d to %d\n", sno, pno, cursorEnd);
+        if (esFtl_RelocateMapPage(sno))
+            return -1;
+        return 1;
+    }
+
+    ESFTL_LOG("Sector %d is moved to page from %d to %d\n", sno, pno, cursorCold);
+
+    /* the moved pages are cold, they go to their own frontier and do not mix with the host writes */
+    if (esFtl_FtlDriverMove(sno - 1, pno, spare[1]))
+    {
+        ESFTL_LOG("esFtl: FATAL ERROR:%s %d\n", __FILE__, __LINE__);
+        return -1;
+    }
+
+    return 1;
+}
+
+/*
+ * @brief erase the victim once its valid pages are moved
+ *
+ * @param erase 0 to only retire the victim, it is erased later
+ * @return 1 if the pass is over since it does not gain space any more, or
+ * the victim has to wait since its map pages can not be written
+ */
+static int EraseVictim(uint8_t erase)
 {
-    int freePages = 0;
+    /* the map pages still pointing into the victim must reach the flash before it is erased */
+    if (esFtl_FlushMapJournal(victim))
+        return 1;
 
-    if (cursorStart > cursorEnd)
+    if (esFtl_IsFailedBlock(victim))
+    {
+        /* a block which failed a program is not used again, its pages are moved by now */
+        esFtl_MarkBadBlock(victim);
+        esFtl_ReleaseBlock(victim);
+    }
+    else if (!erase)
     {
-        freePages = cursorStart - cursorEnd;
+        esFtl_RetireBlock(victim);
     }
     else
     {
-        freePages = ((ESFTL_NANDNUMBLOCKS * ESFTL_NANDNUMPAGEBLOCK) - cursorEnd) + cursorStart;
+        if (esFtl_NandFlashBlockErase(victim))
+            esFtl_MarkBadBlock(victim);
+        esFtl_ReleaseBlock(victim);
     }
 
-    return freePages;
+    ESFTL_LOG("Block %d processed\n", victim);
+    victim = -1;
+
+    /* released blocks become free after the next checkpoint, which no longer refers to them */
+    if (esFtl_NumReleasedBlocks() >= ESFTL_DEFRAGBLOCKS / 4)
+    {
+        esFtl_Checkpoint(0);
+
+        /* the moved pages took as much space as the victims gave, the device is nearly full */
+        if (esFtl_NumFreeBlocks() <= passFreeBlocks)
+        {
+            EndPass();
+            return 1;
+        }
+        passFreeBlocks = esFtl_NumFreeBlocks();
+    }
+
+    return 0;
+}
+
+/*
+ * @brief determine the free space as count of page
+ *
+ * @return count of pages
+ */
+int esFtl_CalcFreePages(void)
+{
+    return esFtl_NumFreeBlocks() * ESFTL_NANDNUMPAGEBLOCK + (ESFTL_NANDNUMPAGEBLOCK - 1) - cursorEnd % ESFTL_NANDNUMPAGEBLOCK;
+}
+
+/*
+ * @brief order the pages of a block by their sectors, the sectors sharing a
+ * translation page are then moved one after the other
+ *
+ * @param summary
+ * @param order page indexes, the summary page stays the last one
+ */
+static void SortBySector(const esFtl_BlockSummary *summary, uint8_t *order)
+{
+    uint8_t page = 0;
+    int i = 0, j = 0;
+
+    for (i = 1; i < ESFTL_SUMMARYENTRIES; i++)
+    {
+        page = order[i];
+        for (j = i; j > 0 && summary->sno[order[j - 1]] > summary->sno[page]; j--)
+            order[j] = order[j - 1];
+        order[j] = page;
+    }
 }
 
 /*
@@ -149,3 +357,23 @@ int esFtl_CalcUsedPages(void)
 
     return used;
 }
+
+/*
+ * @brief check if the system reaches the limit for the defragmentation
+ *
+ * @return 1 if it is true
+ */
+int esFtl_CheckIfDefragmentNeeded(void)
+{
+    int freePages = esFtl_CalcFreePages();
+
+    if (freePages < ESFTL_FREEBLOCKLIMITFORDEFRAGMENT * ESFTL_NANDNUMPAGEBLOCK ||
+        esFtl_BlockAge(cursorStart / ESFTL_NANDNUMPAGEBLOCK) > ESFTL_GCMAXAGE)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+#endif
@@ -19,8 +19,11 @@
 #define ESFTL_DEFRAGMENT_H__
 
 void esFtl_Defrag(void);
-int esFtl_MarkedFirstBlock(int bno);
+int esFtl_DefragStep(uint16_t moves, uint16_t erases);
+int esFtl_DefragPending(void);
+void esFtl_ResetDefrag(void);
 int esFtl_CalcFreePages(void);
 int esFtl_CalcUsedPages(void);
+int esFtl_CheckIfDefragmentNeeded(void);
 
 #endif
\ No newline at end of file
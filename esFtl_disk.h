@@ -23,10 +23,20 @@
 #define ESFTL_NANDPAGESPARESIZE 128
 #define ESFTL_NANDNUMBLOCKS 1024
 #define ESFTL_NANDNUMPAGEBLOCK 64
+#define ESFTL_NANDCOPYUNSUPPORTED -4 /* the chip can not copy between the given pages, nothing is programmed */
 
 int esFtl_NandFlashInit(void);
 int esFtl_NandFlashRead(uint32_t page, uint32_t offset, uint8_t *buff, uint32_t count);
 int esFtl_NandFlashWrite(uint32_t page, uint32_t offset, const uint8_t *buff, uint32_t count);
 int esFtl_NandFlashBlockErase(uint32_t block);
+#if ESFTL_NANDCOPYBACK
+int esFtl_NandFlashCopyPage(uint32_t from, uint32_t to, uint32_t offset, const uint8_t *buff, uint32_t count);
+#endif
+#if ESFTL_NANDCACHEREAD
+int esFtl_NandFlashReadPages(uint32_t page, uint32_t count, uint8_t *buff);
+#endif
+#if ESFTL_NANDCHECKSUM
+uint16_t esFtl_NandFlashChecksum(const uint8_t *buff, uint32_t count);
+#endif
 
 #endif
\ No newline at end of file
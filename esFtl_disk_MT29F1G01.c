@@ -21,6 +21,9 @@
 #include "stm32f4xx_hal.h"
 #include "spi.h"
 #include "bsp.h"
+#if ESFTL_NANDCHECKSUM
+#include "crc.h"
+#endif
 
 #define MT29F1G01_DEVICE_ID 0x2c14
 #define W25N01GV_DEVICE_ID 0xefaa
@@ -43,6 +46,8 @@ enum
     SPI_NAND_PROGRAM_LOAD_INS = 0x02,
     SPI_NAND_PROGRAM_LOAD_RANDOM_INS = 0x84,
     SPI_NAND_READ_CACHE_INS = 0x03,
+    SPI_NAND_PAGE_READ_CACHE_SEQ_INS = 0x31,
+    SPI_NAND_PAGE_READ_CACHE_LAST_INS = 0x3F,
     SPI_NAND_READ_CACHE_X2_INS = 0x3B, // dual wire I/O
     SPI_NAND_READ_CACHE_X4_INS = 0x6B, // quad wire I/O
     SPI_NAND_READ_ID = 0x9F,
@@ -205,6 +210,163 @@ int esFtl_NandFlashWrite(uint32_t page, uint32_t offset, const uint8_t *buff, ui
     return 0;
 }
 
+#if ESFTL_NANDCOPYBACK
+/*
+ * @brief copy a page inside the chip, the page is read to the cache, the bytes
+ * from offset are replaced by the buffer and the cache is programmed to the other page
+ *
+ * @param from
+ * @param to
+ * @param offset
+ * @param buff
+ * @param count
+ * @return 0 if it is successful, ESFTL_NANDCOPYUNSUPPORTED if the pages are on different planes
+ */
+int esFtl_NandFlashCopyPage(uint32_t from, uint32_t to, uint32_t offset, const uint8_t *buff, uint32_t count)
+{
+    CharStream char_stream_send;
+    uint8_t chars[4] = {0};
+    uint8_t status_reg = 0;
+
+    if (from >= (ESFTL_NANDNUMBLOCKS * ESFTL_NANDNUMPAGEBLOCK) || to >= (ESFTL_NANDNUMBLOCKS * ESFTL_NANDNUMPAGEBLOCK))
+        return -1;
+
+    /* the two planes of MT29F1G01 have their own caches, odd blocks are on the second one */
+    if (DeviceId == MT29F1G01_DEVICE_ID && ((from / ESFTL_NANDNUMPAGEBLOCK) ^ (to / ESFTL_NANDNUMPAGEBLOCK)) & 1)
+        return ESFTL_NANDCOPYUNSUPPORTED;
+
+    if (IsFlashBusy())
+        return -2;
+
+    Set_Row_Stream(from, SPI_NAND_PAGE_READ_INS, chars);
+    char_stream_send.length = 4;
+    char_stream_send.pChar = chars;
+
+    Serialize_SPI(&char_stream_send, NULL, 1);
+
+    WAIT_EXECUTION_COMPLETE(SE_TIMEOUT);
+
+    FlashWriteEnable();
+
+    SPI_NAND_Select();
+    Set_Column_Stream(to, offset, SPI_NAND_PROGRAM_LOAD_RANDOM_INS, chars);
+
+    char_stream_send.length = 3;
+    char_stream_send.pChar = chars;
+
+    Serialize_SPI(&char_stream_send, NULL, 0);
+
+    char_stream_send.length = count;
+    char_stream_send.pChar = (uint8_t *)buff;
+
+    Serialize_SPI(&char_stream_send, NULL, 0);
+    SPI_NAND_Deselect();
+
+    Set_Row_Stream(to, SPI_NAND_PROGRAM_EXEC_INS, chars);
+    char_stream_send.length = 4;
+    char_stream_send.pChar = chars;
+
+    Serialize_SPI(&char_stream_send, NULL, 1);
+
+    WAIT_EXECUTION_COMPLETE(SE_TIMEOUT);
+
+    FlashReadStatusRegister(&status_reg);
+    if (status_reg & SPI_NAND_PF)
+        return -3;
+
+    return 0;
+}
+#endif
+
+#if ESFTL_NANDCACHEREAD
+/*
+ * @brief read the data areas of consecutive pages, the MT29F1G01 loads the
+ * next page to its cache while the previous one is read out, the W25N01GV
+ * reads them one by one
+ *
+ * @param page
+ * @param count
+ * @param buff room for count times ESFTL_NANDPAGEDATASIZE bytes
+ * @return 0 if it is successful
+ */
+int esFtl_NandFlashReadPages(uint32_t page, uint32_t count, uint8_t *buff)
+{
+    CharStream char_stream_send;
+    CharStream char_stream_recv;
+    uint8_t chars[4];
+    uint32_t i = 0;
+
+    if (page + count > ESFTL_NANDNUMBLOCKS * ESFTL_NANDNUMPAGEBLOCK)
+        return -1;
+
+    if (DeviceId != MT29F1G01_DEVICE_ID || count < 2)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (esFtl_NandFlashRead(page + i, 0, &buff[i * ESFTL_NANDPAGEDATASIZE], ESFTL_NANDPAGEDATASIZE))
+                return -1;
+        }
+        return 0;
+    }
+
+    Set_Row_Stream(page, SPI_NAND_PAGE_READ_INS, chars);
+    char_stream_send.length = 4;
+    char_stream_send.pChar = chars;
+    Serialize_SPI(&char_stream_send, NULL, 1);
+    WAIT_EXECUTION_COMPLETE(SE_TIMEOUT);
+
+    for (i = 0; i < count; i++)
+    {
+        /* the page in the cache moves to the data register, the next one is loaded meanwhile */
+        chars[0] = (i + 1 < count) ? SPI_NAND_PAGE_READ_CACHE_SEQ_INS : SPI_NAND_PAGE_READ_CACHE_LAST_INS;
+        char_stream_send.length = 1;
+        char_stream_send.pChar = chars;
+        Serialize_SPI(&char_stream_send, NULL, 1);
+        WAIT_EXECUTION_COMPLETE(SE_TIMEOUT);
+
+        Set_Column_Stream(page + i, 0, SPI_NAND_READ_CACHE_INS, chars);
+        char_stream_send.length = 4;
+        char_stream_send.pChar = chars;
+        char_stream_recv.length = ESFTL_NANDPAGEDATASIZE;
+        char_stream_recv.pChar = &buff[i * ESFTL_NANDPAGEDATASIZE];
+        Serialize_SPI(&char_stream_send, &char_stream_recv, 1);
+    }
+
+    return 0;
+}
+#endif
+
+#if ESFTL_NANDCHECKSUM
+/*
+ * @brief crc-32 of the crc unit of the mcu folded to 16 bits, the unit takes
+ * whole words so the last bytes are padded with 0xFF
+ *
+ * @param buff
+ * @param count
+ * @return value of the checksum
+ */
+uint16_t esFtl_NandFlashChecksum(const uint8_t *buff, uint32_t count)
+{
+    uint32_t word = 0, crc = 0;
+
+    __HAL_CRC_DR_RESET(&hcrc);
+    for (; count >= 4; count -= 4, buff += 4)
+    {
+        memcpy(&word, buff, 4);
+        crc = HAL_CRC_Accumulate(&hcrc, &word, 1);
+    }
+
+    if (count)
+    {
+        word = 0xFFFFFFFF;
+        memcpy(&word, buff, count);
+        crc = HAL_CRC_Accumulate(&hcrc, &word, 1);
+    }
+
+    return (uint16_t)(crc ^ (crc >> 16));
+}
+#endif
+
 /*
  * @brief reset a block to be ready to store data
  *
@@ -15,24 +15,676 @@
  *   limitations under the License.
  */
 
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if ESFTL_NANDCHECKSUM && defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
 #include "esFtl_definitions.h"
 #include "esFtl_disk.h"
+#include "esFtl_disk_simulator.h"
+
+/*
+ * Pages are kept bit-inverted so that a zero filled store (calloc'd RAM or a
+ * hole in a sparse image file) reads back as erased 0xFF. Pages which were
+ * never programmed therefore cost neither RAM nor disk space.
+ */
+
+#define SIM_NUMPAGES (ESFTL_NANDNUMBLOCKS * ESFTL_NANDNUMPAGEBLOCK)
+#define SIM_BLOCKBYTES ((uint64_t)ESFTL_NANDNUMPAGEBLOCK * ESFTL_NANDPAGESIZE)
+#define SIM_IMAGEBYTES ((uint64_t)SIM_NUMPAGES * ESFTL_NANDPAGESIZE)
+
+/*
+ * The timing model replays the transactions of esFtl_disk_MT29F1G01.c on a
+ * virtual clock: command bytes, the program load and cache read data phases
+ * and the status polling of WAIT_EXECUTION_COMPLETE while the chip is busy.
+ * A copy inside the chip reads the page to the cache, loads only the patched
+ * bytes over the bus and programs the cache to the new page. A cache read
+ * loads the next page while the previous one is read out, its tR is hidden
+ * behind the transfer.
+ */
+
+#define SIM_PAGEREADCMDBYTES 4
+#define SIM_READCACHECMDBYTES 4
+#define SIM_STATUSBYTES 3
+#define SIM_WRITEENABLEBYTES 1
+#define SIM_PROGRAMLOADCMDBYTES 3
+#define SIM_PROGRAMEXECBYTES 4
+#define SIM_BLOCKERASEBYTES 4
+#define SIM_PROGRAMLOADRANDOMCMDBYTES 3
+#define SIM_CACHEREADCMDBYTES 1
+#define SIM_CACHEREADBUSY 3000 /* ns, tRCBSY of the cache read, the cache is moved to the data register */
+
+const esFtl_SimTiming esFtl_SimTimingMT29F1G01 = {70000, 200000, 2000000, 42000000, 1, 1000, 1000, 2};
+const esFtl_SimTiming esFtl_SimTimingW25N01GV = {60000, 250000, 2000000, 42000000, 1, 1000, 1000, 1};
+
+static esFtl_SimConfig config = {NULL, NULL, 0, 1, NULL, 0};
+static esFtl_SimTiming timing = {70000, 200000, 2000000, 42000000, 1, 1000, 1000, 2};
+static uint64_t simClock = 0;
+static esFtl_SimStats stats;
+static uint8_t badBlocks[ESFTL_NANDNUMBLOCKS / 8];
+static uint8_t **ramPages = NULL;
+static uint8_t *image = NULL;
+static int imageFd = -1;
+static uint8_t initialized = 0;
+static uint32_t powerCutOps = 0; /* programs and erases left until the power goes, 0 keeps it on */
+static uint8_t powerLost = 0;
+
+static int ProgramPage(uint32_t page, uint32_t offset, const uint8_t *buff, uint32_t count);
+static uint8_t *PageSlot(uint32_t page, int allocate);
+static int IsSimBadBlock(uint32_t block);
+static void MarkFactoryBad(uint32_t block);
+static uint64_t BusTime(uint32_t bytes, uint8_t width);
+static uint64_t TransactionTime(uint32_t cmdBytes, uint32_t dataBytes);
+static uint64_t WaitTime(uint32_t busy);
+static int PowerStep(void);
+
+/*
+ * @brief select the backing store and the injected bad blocks, it must be called before esFtl_Init
+ *
+ * @param cfg
+ */
+void esFtl_SimConfigure(const esFtl_SimConfig *cfg)
+{
+    esFtl_SimClose();
+    config = *cfg;
+    powerCutOps = 0;
+    powerLost = 0;
+}
+
+/*
+ * @brief select the datasheet values used by the timing model
+ *
+ * @param t
+ */
+void esFtl_SimSetTiming(const esFtl_SimTiming *t)
+{
+    timing = *t;
+    if (!timing.busWidth)
+        timing.busWidth = 1;
+}
+
+/*
+ * @brief read the virtual clock, it only moves with flash operations and esFtl_SimAdvanceTime
+ *
+ * @return elapsed time as ns
+ */
+uint64_t esFtl_SimGetTime(void)
+{
+    return simClock;
+}
+
+/*
+ * @brief account time which is spent outside of the flash, e.g. by the cpu
+ *
+ * @param ns
+ */
+void esFtl_SimAdvanceTime(uint64_t ns)
+{
+    simClock += ns;
+}
+
+/*
+ * @brief make a block fail every following program and erase like a grown bad block
+ *
+ * @param block
+ */
+void esFtl_SimInjectBadBlock(uint32_t block)
+{
+    if (block < ESFTL_NANDNUMBLOCKS)
+        badBlocks[block / 8] |= 1 << (block % 8);
+}
+
+/*
+ * @brief cut the power after ops more programs and erases. The program the
+ * power goes in is torn, only the first half of its bytes reach the flash, an
+ * erase is not done at all, and the operations after it fail without touching
+ * the image. Reads still work; 0 turns the power on again
+ *
+ * @param ops
+ */
+void esFtl_SimCutPower(uint32_t ops)
+{
+    powerCutOps = ops;
+    powerLost = 0;
+}
+
+/*
+ * @brief ask whether the power cut set by esFtl_SimCutPower happened
+ *
+ * @return 1 if it did
+ */
+int esFtl_SimPowerLost(void)
+{
+    return powerLost;
+}
+
+/*
+ * @brief copy the operation counters
+ *
+ * @param out
+ */
+void esFtl_SimGetStats(esFtl_SimStats *out)
+{
+    *out = stats;
+}
+
+/*
+ * @brief clear the operation counters
+ *
+ */
+void esFtl_SimResetStats(void)
+{
+    uint32_t resident = stats.residentPages;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.residentPages = resident;
+}
+
+/*
+ * @brief release the flash image, an image file keeps its content for the next run
+ *
+ */
+void esFtl_SimClose(void)
+{
+    int i = 0;
+
+    if (ramPages)
+    {
+        for (i = 0; i < SIM_NUMPAGES; i++)
+            free(ramPages[i]);
+        free(ramPages);
+        ramPages = NULL;
+    }
+
+    if (image)
+    {
+        munmap(image, SIM_IMAGEBYTES);
+        image = NULL;
+    }
+
+    if (imageFd >= 0)
+    {
+        close(imageFd);
+        imageFd = -1;
+    }
+
+    memset(badBlocks, 0, sizeof(badBlocks));
+    memset(&stats, 0, sizeof(stats));
+    initialized = 0;
+}
+
+/*
+ * @brief open the flash image, the content survives further calls until esFtl_SimClose
+ *
+ * @return 0 if it is successful
+ */
+int esFtl_NandFlashInit(void)
+{
+    uint32_t i = 0;
+
+    if (initialized)
+        return 0;
+
+    if (config.imagePath)
+    {
+        imageFd = open(config.imagePath, O_RDWR | O_CREAT, 0644);
+        if (imageFd < 0)
+            return -1;
+
+        if (ftruncate(imageFd, SIM_IMAGEBYTES))
+        {
+            esFtl_SimClose();
+            return -1;
+        }
+
+        image = mmap(NULL, SIM_IMAGEBYTES, PROT_READ | PROT_WRITE, MAP_SHARED, imageFd, 0);
+        if (image == MAP_FAILED)
+        {
+            image = NULL;
+            esFtl_SimClose();
+            return -1;
+        }
+    }
+    else
+    {
+        ramPages = calloc(SIM_NUMPAGES, sizeof(uint8_t *));
+        if (!ramPages)
+            return -1;
+    }
+
+    for (i = 0; i < config.numBadBlocks; i++)
+    {
+        if (config.badBlocks[i] >= ESFTL_NANDNUMBLOCKS)
+            continue;
+
+        esFtl_SimInjectBadBlock(config.badBlocks[i]);
+        MarkFactoryBad(config.badBlocks[i]);
+    }
+
+    for (i = 0; i < config.numFactoryBadBlocks; i++)
+    {
+        if (config.factoryBadBlocks[i] < ESFTL_NANDNUMBLOCKS)
+            MarkFactoryBad(config.factoryBadBlocks[i]);
+    }
+
+    initialized = 1;
+    return 0;
+}
+
+/*
+ * @brief write the factory marker, a first spare byte of the first page other than 0xFF
+ *
+ * @param block
+ */
+static void MarkFactoryBad(uint32_t block)
+{
+    uint8_t *slot = PageSlot(block * ESFTL_NANDNUMPAGEBLOCK, 1);
+
+    if (slot)
+        slot[ESFTL_NANDPAGEDATASIZE] = 0xFF; /* the image holds the inverted bits, it reads 0x00 */
+}
+
+/*
+ * @brief fetch data from the image
+ *
+ * @param page
+ * @param offset
+ * @param buff
+ * @param count
+ * @return 0 if it is successful
+ */
+int esFtl_NandFlashRead(uint32_t page, uint32_t offset, uint8_t *buff, uint32_t count)
+{
+    uint8_t *slot;
+    uint64_t t = 0;
+    uint32_t i = 0;
+
+    if (!initialized || page >= SIM_NUMPAGES || offset + count > ESFTL_NANDPAGESIZE)
+        return -1;
+
+    stats.reads++;
+    stats.bytesRead += count;
+    t = TransactionTime(SIM_PAGEREADCMDBYTES, 0) + WaitTime(timing.tR) + TransactionTime(SIM_READCACHECMDBYTES, count);
+    stats.readTime += t;
+    simClock += t;
+
+    slot = PageSlot(page, 0);
+    if (!slot)
+    {
+        memset(buff, 0xFF, count);
+        return 0;
+    }
+
+    for (i = 0; i < count; i++)
+        buff[i] = ~slot[offset + i];
 
-// int esFtl_NandFlashInit(void)
-// {
-//     return 0;
-// }
+    return 0;
+}
 
-// int esFtl_NandFlashRead(uint32_t page, uint32_t offset, uint8_t *buff, uint32_t count)
-// {
-//     return 0;
-// }
+/*
+ * @brief program data to the image, bits can only be cleared until the block is erased
+ *
+ * @param page
+ * @param offset
+ * @param buff
+ * @param count
+ * @return 0 if it is successful
+ */
+int esFtl_NandFlashWrite(uint32_t page, uint32_t offset, const uint8_t *buff, uint32_t count)
+{
+    uint64_t t = 0;
+
+    if (!initialized || page >= SIM_NUMPAGES || offset + count > ESFTL_NANDPAGESIZE)
+        return -1;
+
+    switch (PowerStep())
+    {
+    case 1:
+        ProgramPage(page, offset, buff, count / 2);
+        return -1;
+    case 2:
+        return -1;
+    }
+
+    stats.programs++;
+    stats.bytesProgrammed += count;
+    t = TransactionTime(SIM_STATUSBYTES, 0) + TransactionTime(SIM_WRITEENABLEBYTES, 0) + TransactionTime(SIM_STATUSBYTES, 0) +
+        TransactionTime(SIM_PROGRAMLOADCMDBYTES, count) + TransactionTime(SIM_PROGRAMEXECBYTES, 0) +
+        WaitTime(timing.tPROG) + TransactionTime(SIM_STATUSBYTES, 0);
+    stats.programTime += t;
+    simClock += t;
+
+    return ProgramPage(page, offset, buff, count);
+}
+
+#if ESFTL_NANDCOPYBACK
+/*
+ * @brief copy a page inside the chip, the bytes from offset are replaced by the buffer on the way
+ *
+ * @param from
+ * @param to
+ * @param offset
+ * @param buff
+ * @param count
+ * @return 0 if it is successful, ESFTL_NANDCOPYUNSUPPORTED if the pages are on different planes
+ */
+int esFtl_NandFlashCopyPage(uint32_t from, uint32_t to, uint32_t offset, const uint8_t *buff, uint32_t count)
+{
+    uint8_t cache[ESFTL_NANDPAGESIZE];
+    uint8_t *slot;
+    uint64_t t = 0;
+    uint32_t i = 0;
+    int cut = 0;
+
+    if (!initialized || from >= SIM_NUMPAGES || to >= SIM_NUMPAGES || offset + count > ESFTL_NANDPAGESIZE)
+        return -1;
+
+    if (timing.planes > 1 && (from / ESFTL_NANDNUMPAGEBLOCK) % timing.planes != (to / ESFTL_NANDNUMPAGEBLOCK) % timing.planes)
+        return ESFTL_NANDCOPYUNSUPPORTED;
+
+    cut = PowerStep();
+    if (cut == 2)
+        return -1;
+
+    /* the page is programmed up to the last loaded byte, the copied part counts as programmed too */
+    stats.copies++;
+    stats.reads++;
+    stats.programs++;
+    stats.bytesProgrammed += offset + count;
+    t = TransactionTime(SIM_STATUSBYTES, 0) + TransactionTime(SIM_PAGEREADCMDBYTES, 0) + WaitTime(timing.tR);
+    stats.readTime += t;
+    simClock += t;
+    t = TransactionTime(SIM_WRITEENABLEBYTES, 0) + TransactionTime(SIM_STATUSBYTES, 0) +
+        TransactionTime(SIM_PROGRAMLOADRANDOMCMDBYTES, count) + TransactionTime(SIM_PROGRAMEXECBYTES, 0) +
+        WaitTime(timing.tPROG) + TransactionTime(SIM_STATUSBYTES, 0);
+    stats.programTime += t;
+    simClock += t;
+
+    slot = PageSlot(from, 0);
+    for (i = 0; i < ESFTL_NANDPAGESIZE; i++)
+        cache[i] = slot ? (uint8_t)~slot[i] : 0xFF;
+    memcpy(&cache[offset], buff, count);
+
+    if (cut)
+    {
+        ProgramPage(to, 0, cache, ESFTL_NANDPAGESIZE / 2);
+        return -1;
+    }
+
+    return ProgramPage(to, 0, cache, ESFTL_NANDPAGESIZE);
+}
+#endif
+
+#if ESFTL_NANDCACHEREAD
+/*
+ * @brief read the data areas of consecutive pages with the cache read
+ *
+ * @param page
+ * @param count
+ * @param buff room for count times ESFTL_NANDPAGEDATASIZE bytes
+ * @return 0 if it is successful
+ */
+int esFtl_NandFlashReadPages(uint32_t page, uint32_t count, uint8_t *buff)
+{
+    uint64_t t = 0, transfer = 0;
+    uint8_t *slot;
+    uint32_t i = 0, j = 0;
+
+    if (!initialized || page + count > SIM_NUMPAGES)
+        return -1;
+
+    transfer = TransactionTime(SIM_READCACHECMDBYTES, ESFTL_NANDPAGEDATASIZE);
+    t = TransactionTime(SIM_PAGEREADCMDBYTES, 0) + WaitTime(timing.tR);
+    for (i = 0; i < count; i++)
+    {
+        t += TransactionTime(SIM_CACHEREADCMDBYTES, 0) + WaitTime(SIM_CACHEREADBUSY) + transfer;
+
+        /* the next page is loaded while this one is read out */
+        if (i + 1 < count && timing.tR > transfer)
+            t += WaitTime(timing.tR - transfer);
+    }
+
+    stats.reads += count;
+    stats.bytesRead += (uint64_t)count * ESFTL_NANDPAGEDATASIZE;
+    stats.readTime += t;
+    simClock += t;
+
+    for (i = 0; i < count; i++, buff += ESFTL_NANDPAGEDATASIZE)
+    {
+        slot = PageSlot(page + i, 0);
+        if (!slot)
+        {
+            memset(buff, 0xFF, ESFTL_NANDPAGEDATASIZE);
+            continue;
+        }
+
+        for (j = 0; j < ESFTL_NANDPAGEDATASIZE; j++)
+            buff[j] = ~slot[j];
+    }
+
+    return 0;
+}
+#endif
+
+#if ESFTL_NANDCHECKSUM
+/*
+ * @brief crc-32c of the host folded to 16 bits, with sse4.2 when the compiler targets it
+ *
+ * @param buff
+ * @param count
+ * @return value of the checksum
+ */
+uint16_t esFtl_NandFlashChecksum(const uint8_t *buff, uint32_t count)
+{
+    uint32_t crc = 0xFFFFFFFF;
+#if defined(__SSE4_2__)
+    uint64_t word = 0;
+
+    for (; count >= 8; count -= 8, buff += 8)
+    {
+        memcpy(&word, buff, 8);
+        crc = (uint32_t)_mm_crc32_u64(crc, word);
+    }
+
+    for (; count; count--)
+        crc = _mm_crc32_u8(crc, *buff++);
+#else
+    int i = 0;
+
+    for (; count; count--)
+    {
+        crc ^= *buff++;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+    }
+#endif
+
+    crc = ~crc;
+    return (uint16_t)(crc ^ (crc >> 16));
+}
+#endif
+
+/*
+ * @brief reset a block to 0xFF and give its storage back
+ *
+ * @param block
+ * @return 0 if it is successful
+ */
+int esFtl_NandFlashBlockErase(uint32_t block)
+{
+    uint64_t t = 0;
+    uint32_t page = 0;
+    int i = 0;
+
+    if (!initialized || block >= ESFTL_NANDNUMBLOCKS)
+        return -1;
+
+    if (PowerStep())
+        return -1;
+
+    stats.erases++;
+    t = TransactionTime(SIM_STATUSBYTES, 0) + TransactionTime(SIM_WRITEENABLEBYTES, 0) + TransactionTime(SIM_STATUSBYTES, 0) +
+        TransactionTime(SIM_BLOCKERASEBYTES, 0) + WaitTime(timing.tBERS) + TransactionTime(SIM_STATUSBYTES, 0);
+    stats.eraseTime += t;
+    simClock += t;
+
+    if (IsSimBadBlock(block))
+        return -3;
+
+    page = block * ESFTL_NANDNUMPAGEBLOCK;
+
+    if (image)
+    {
+        if (fallocate(imageFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, block * SIM_BLOCKBYTES, SIM_BLOCKBYTES))
+            memset(&image[block * SIM_BLOCKBYTES], 0, SIM_BLOCKBYTES);
+    }
+    else
+    {
+        for (i = 0; i < ESFTL_NANDNUMPAGEBLOCK; i++)
+        {
+            if (ramPages[page + i])
+            {
+                free(ramPages[page + i]);
+                ramPages[page + i] = NULL;
+                stats.residentPages--;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * @brief program the bytes to the image, bits can only be cleared until the block is erased
+ *
+ * @param page
+ * @param offset
+ * @param buff
+ * @param count
+ * @return 0 if it is successful
+ */
+static int ProgramPage(uint32_t page, uint32_t offset, const uint8_t *buff, uint32_t count)
+{
+    uint8_t *slot;
+    uint8_t stored;
+    uint32_t i = 0;
+    int violation = 0, blank = 1;
+
+    if (IsSimBadBlock(page / ESFTL_NANDNUMPAGEBLOCK))
+        return -3;
+
+    slot = PageSlot(page, 0);
+    for (i = 0; i < count; i++)
+    {
+        stored = slot ? (uint8_t)~slot[offset + i] : 0xFF;
+        if ((stored & buff[i]) != buff[i])
+            violation = 1;
+        if (buff[i] != 0xFF)
+            blank = 0;
+    }
+
+    if (violation)
+    {
+        stats.programViolations++;
+        ESFTL_LOG("Simulator: program without erase on page %u\n", page);
+        if (config.strict)
+            return -3;
+    }
+
+    if (blank)
+        return 0;
+
+    if (!slot)
+    {
+        slot = PageSlot(page, 1);
+        if (!slot)
+            return -3;
+    }
+
+    for (i = 0; i < count; i++)
+        slot[offset + i] |= (uint8_t)~buff[i];
+
+    return 0;
+}
+
+/*
+ * @brief locate the stored bytes of a page
+ *
+ * @param page
+ * @param allocate
+ * @return NULL if the page is still erased and allocate is not set
+ */
+static uint8_t *PageSlot(uint32_t page, int allocate)
+{
+    if (image)
+        return &image[page * (uint64_t)ESFTL_NANDPAGESIZE];
+
+    if (!ramPages[page] && allocate)
+    {
+        ramPages[page] = calloc(1, ESFTL_NANDPAGESIZE);
+        if (ramPages[page])
+            stats.residentPages++;
+    }
+
+    return ramPages[page];
+}
+
+static int IsSimBadBlock(uint32_t block)
+{
+    return badBlocks[block / 8] & (1 << (block % 8));
+}
+
+static uint64_t BusTime(uint32_t bytes, uint8_t width)
+{
+    return (uint64_t)bytes * 8 * 1000000000ULL / ((uint64_t)timing.spiClockHz * width);
+}
+
+/*
+ * @brief time of one chip select cycle, the command is always sent on a single line
+ *
+ * @param cmdBytes
+ * @param dataBytes
+ * @return ns
+ */
+static uint64_t TransactionTime(uint32_t cmdBytes, uint32_t dataBytes)
+{
+    return timing.transactionOverhead + BusTime(cmdBytes, 1) + BusTime(dataBytes, timing.busWidth);
+}
+
+/*
+ * @brief time of WAIT_EXECUTION_COMPLETE, status is polled until the chip is ready
+ *
+ * @param busy
+ * @return ns
+ */
+static uint64_t WaitTime(uint32_t busy)
+{
+    uint64_t poll = TransactionTime(SIM_STATUSBYTES, 0);
+    uint64_t period = poll + timing.pollDelay;
+    uint64_t polls = (busy + period - 1) / period;
+
+    return polls * period + poll;
+}
+
+/*
+ * @brief count a program or an erase towards the power cut
+ *
+ * @return 0 if the power stays on, 1 if it goes during this operation, 2 if it is already gone
+ */
+static int PowerStep(void)
+{
+    if (powerLost)
+        return 2;
 
-// int esFtl_NandFlashWrite(uint32_t page, uint32_t offset, const uint8_t *buff, uint32_t count)
-// {
-//     return 0;
-// }
+    if (!powerCutOps || --powerCutOps)
+        return 0;
 
-// int esFtl_NandFlashBlockErase(uint32_t block){
-//     return 0;
-// }
\ No newline at end of file
+    powerLost = 1;
+    return 1;
+}
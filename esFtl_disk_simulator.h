@@ -0,0 +1,72 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef ESFTL_DISK_SIMULATOR_H__
+#define ESFTL_DISK_SIMULATOR_H__
+
+typedef struct
+{
+    const char *imagePath;     /* NULL keeps the flash image in RAM */
+    const uint16_t *badBlocks; /* blocks that fail every program and erase */
+    uint32_t numBadBlocks;
+    uint8_t strict;            /* reject programs that need a 0 -> 1 bit transition */
+    const uint16_t *factoryBadBlocks; /* blocks that only carry the factory bad block marker */
+    uint32_t numFactoryBadBlocks;
+} esFtl_SimConfig;
+
+typedef struct
+{
+    uint32_t tR;                  /* ns, page read to cache */
+    uint32_t tPROG;               /* ns, program execute */
+    uint32_t tBERS;               /* ns, block erase */
+    uint32_t spiClockHz;
+    uint8_t busWidth;             /* data lines used while loading and reading the cache */
+    uint32_t pollDelay;           /* ns slept between two status polls */
+    uint32_t transactionOverhead; /* ns spent around every chip select */
+    uint8_t planes;               /* a page is copied inside the chip only to a block of the same plane */
+} esFtl_SimTiming;
+
+typedef struct
+{
+    uint32_t reads;
+    uint32_t programs;
+    uint32_t erases;
+    uint32_t copies; /* pages copied inside the chip, they are counted as reads and programs too */
+    uint64_t bytesRead;
+    uint64_t bytesProgrammed;
+    uint32_t programViolations;
+    uint32_t residentPages;
+    uint64_t readTime;    /* ns */
+    uint64_t programTime; /* ns */
+    uint64_t eraseTime;   /* ns */
+} esFtl_SimStats;
+
+extern const esFtl_SimTiming esFtl_SimTimingMT29F1G01;
+extern const esFtl_SimTiming esFtl_SimTimingW25N01GV;
+
+void esFtl_SimConfigure(const esFtl_SimConfig *config);
+void esFtl_SimSetTiming(const esFtl_SimTiming *timing);
+uint64_t esFtl_SimGetTime(void);
+void esFtl_SimAdvanceTime(uint64_t ns);
+void esFtl_SimInjectBadBlock(uint32_t block);
+void esFtl_SimCutPower(uint32_t ops);
+int esFtl_SimPowerLost(void);
+void esFtl_SimGetStats(esFtl_SimStats *stats);
+void esFtl_SimResetStats(void);
+void esFtl_SimClose(void);
+
+#endif
\ No newline at end of file
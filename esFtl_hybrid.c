@@ -0,0 +1,805 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "esFtl_definitions.h"
+#include "esFtl_disk.h"
+#include "esFtl_bbm.h"
+#include "esFtl_cache.h"
+#include "esFtl_write.h"
+#include "esFtl_checksum.h"
+#include "esFtl_readcache.h"
+#include "esFtl_readahead.h"
+#include "esFtl_scrub.h"
+#include "esFtl_defragment.h"
+#include "esFtl_hybrid.h"
+#include "esFtl_buffer.h"
+#include "esFtl_vector.h"
+
+#if ESFTL_HYBRIDMAPPING
+
+/*
+ * Block mapped mode for targets which can not afford a sector map. Sector n
+ * of a logical block always sits in page n of its data block. Updates go to a
+ * log block which belongs to one logical block and is filled in write order,
+ * a release is logged as a page without data. A full log block is merged with
+ * its data block into a new one, or simply becomes the data block when it was
+ * written in page order. The first page of every block carries a header in
+ * its spare area so that mount reads one page per block. This is BAST, there
+ * is no log shared by the random writes as in FAST, so a write to a logical
+ * block without a log block may merge another one for a few of its pages.
+ */
+
+#define HEADEROFFSET (ESFTL_SPAREOFFSET + 8)
+#define BLOCKTYPELOG 0x7F
+#define BLOCKTYPEDATA 0x3F /* a log block becomes a data block by clearing one bit */
+#define PAGENONE 0xFF
+#define PAGERELEASED 0x80
+#define WRITERETRIES 4
+
+typedef struct
+{
+    uint32_t seq;
+    uint16_t lbn;
+    uint8_t type;
+    uint8_t reserved;
+    uint64_t valid; /* pages of a data block which hold a sector */
+} BlockHeader;
+
+typedef struct
+{
+    uint16_t lbn;
+    uint16_t pbn;
+    uint32_t seq;
+    uint32_t lastUse;
+    uint8_t next;
+    uint8_t failed; /* a page program failed, the block is marked bad when it is merged */
+    uint8_t pageOf[ESFTL_NANDNUMPAGEBLOCK];
+} LogBlock;
+
+static uint16_t dataMap[ESFTL_HYBRIDLOGICALBLOCKS];
+static uint64_t dataValid[ESFTL_HYBRIDLOGICALBLOCKS];
+static uint8_t freeBlocks[ESFTL_NANDNUMBLOCKS / 8];
+static LogBlock logBlocks[ESFTL_HYBRIDLOGBLOCKS];
+static uint8_t pageBuff[ESFTL_PAGEBUFFSIZE];
+static uint8_t batchBuff[ESFTL_PAGEBUFFSIZE]; /* pageBuff is taken by the merges a write may do */
+static uint32_t blockSeq = 0;
+static uint32_t logClock = 0;
+static uint16_t allocCursor = 0;
+
+static int ReadHeader(uint16_t pbn, BlockHeader *hdr);
+static int WriteHeader(uint16_t pbn, uint8_t type, uint16_t lbn, uint32_t seq, uint64_t valid);
+static int AllocateBlock(void);
+static void FreeBlock(uint16_t pbn);
+static LogBlock *FindLogBlock(uint16_t lbn);
+static LogBlock *OpenLogBlock(uint16_t lbn);
+static int MergeLogBlock(LogBlock *log);
+static int AppendLogPage(uint16_t sno, uint8_t *buffer, uint8_t released);
+static void ScanLogBlock(LogBlock *log);
+
+/*
+ * @brief rebuild the block map from the block headers
+ *
+ */
+void esFtl_HybridMount(void)
+{
+    BlockHeader hdr, cur;
+    uint8_t logCandidates[ESFTL_NANDNUMBLOCKS / 8];
+    LogBlock *log;
+    int i = 0, j = 0;
+
+    memset(dataMap, 0xFF, sizeof(dataMap));
+    memset(freeBlocks, 0, sizeof(freeBlocks));
+    memset(logCandidates, 0, sizeof(logCandidates));
+    for (i = 0; i < ESFTL_HYBRIDLOGBLOCKS; i++)
+        logBlocks[i].lbn = 0xFFFF;
+    blockSeq = 0;
+
+    for (i = 0; i < ESFTL_NANDNUMBLOCKS; i++)
+    {
+        if (esFtl_IsBadBlock(i))
+            continue;
+
+        if (ReadHeader(i, &hdr) || hdr.lbn >= ESFTL_HYBRIDLOGICALBLOCKS)
+        {
+            FreeBlock(i);
+            continue;
+        }
+
+        if (hdr.seq >= blockSeq)
+            blockSeq = hdr.seq + 1;
+
+        if (hdr.type == BLOCKTYPELOG)
+        {
+            logCandidates[i / 8] |= 1 << (i % 8);
+        }
+        else if (dataMap[hdr.lbn] == 0xFFFF)
+        {
+            dataMap[hdr.lbn] = i;
+            dataValid[hdr.lbn] = hdr.valid;
+        }
+        else if (!ReadHeader(dataMap[hdr.lbn], &cur) && cur.seq > hdr.seq)
+        {
+            FreeBlock(i);
+        }
+        else
+        {
+            FreeBlock(dataMap[hdr.lbn]);
+            dataMap[hdr.lbn] = i;
+            dataValid[hdr.lbn] = hdr.valid;
+        }
+    }
+
+    /* a log block older than its data block was merged already, merged log blocks keep their header until reused */
+    for (i = 0; i < ESFTL_NANDNUMBLOCKS; i++)
+    {
+        if (!(logCandidates[i / 8] & (1 << (i % 8))) || ReadHeader(i, &hdr))
+            continue;
+
+        if (dataMap[hdr.lbn] != 0xFFFF && !ReadHeader(dataMap[hdr.lbn], &cur) && cur.seq > hdr.seq)
+        {
+            FreeBlock(i);
+            continue;
+        }
+
+        log = FindLogBlock(hdr.lbn);
+        if (log && log->seq > hdr.seq)
+        {
+            FreeBlock(i);
+            continue;
+        }
+
+        if (log)
+        {
+            FreeBlock(log->pbn);
+        }
+        else
+        {
+            for (j = 0; j < ESFTL_HYBRIDLOGBLOCKS && !log; j++)
+            {
+                if (logBlocks[j].lbn == 0xFFFF)
+                    log = &logBlocks[j];
+            }
+        }
+
+        if (!log)
+        {
+            ESFTL_LOG("esFtl: FATAL ERROR:%d %s %d\n", i, __FILE__, __LINE__);
+            FreeBlock(i);
+            continue;
+        }
+
+        log->lbn = hdr.lbn;
+        log->pbn = i;
+        log->seq = hdr.seq;
+        log->failed = 0;
+        log->lastUse = ++logClock;
+    }
+
+    for (i = 0; i < ESFTL_HYBRIDLOGBLOCKS; i++)
+    {
+        if (logBlocks[i].lbn != 0xFFFF)
+            ScanLogBlock(&logBlocks[i]);
+    }
+
+    ESFTL_LOG("Hybrid mount: %d free pages\n", esFtl_CalcFreePages());
+}
+
+/*
+ * @brief find which page holds the sector, it costs no flash access
+ *
+ * @param sno
+ * @return -1 if the sector is not assigned yet
+ */
+int esFtl_FindSectorPage(uint16_t sno)
+{
+    LogBlock *log;
+    uint16_t lbn = 0;
+    uint8_t off = 0;
+
+    if (sno == 0 || sno == 0xFFFF)
+        return -1;
+
+    lbn = (sno - 1) / ESFTL_NANDNUMPAGEBLOCK;
+    off = (sno - 1) % ESFTL_NANDNUMPAGEBLOCK;
+    if (lbn >= ESFTL_HYBRIDLOGICALBLOCKS)
+        return -1;
+
+    log = FindLogBlock(lbn);
+    if (log && log->pageOf[off] != PAGENONE)
+    {
+        if (log->pageOf[off] & PAGERELEASED)
+            return -1;
+        return log->pbn * ESFTL_NANDNUMPAGEBLOCK + log->pageOf[off];
+    }
+
+    if (dataMap[lbn] == 0xFFFF || !(dataValid[lbn] & (1ULL << off)))
+        return -1;
+
+    return dataMap[lbn] * ESFTL_NANDNUMPAGEBLOCK + off;
+}
+
+/*
+ * @brief write the sector data, with a write buffer only the bytes from idx
+ * are taken and the sector is written to its log block later
+ *
+ * @param sno
+ * @param buffer
+ * @param idx
+ * @param count
+ * @return 0 if it is successful
+ */
+int esFtl_FtlDriverWrite(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count)
+{
+    if (sno / ESFTL_NANDNUMPAGEBLOCK >= ESFTL_HYBRIDLOGICALBLOCKS)
+        return -1;
+
+#if ESFTL_WRITEBUFFERSECTORS
+    return esFtl_BufferWrite(sno, buffer, idx, count);
+#else
+    return esFtl_WriteSector(sno, buffer);
+#endif
+}
+
+/*
+ * @brief write the whole sector data to the log block of its logical block
+ *
+ * @param sno
+ * @param buffer page data, followed by room for the spare bytes
+ * @return 0 if it is successful
+ */
+int esFtl_WriteSector(uint16_t sno, uint8_t *buffer)
+{
+    uint16_t crc;
+
+    sno++;
+
+    if ((sno - 1) / ESFTL_NANDNUMPAGEBLOCK >= ESFTL_HYBRIDLOGICALBLOCKS)
+        return -1;
+
+#if ESFTL_READCACHESECTORS
+    esFtl_ReadCacheDrop(sno - 1);
+#endif
+#if ESFTL_READAHEADSECTORS
+    esFtl_ReadAheadDrop(sno - 1);
+#endif
+    esFtl_ScrubDrop(sno - 1);
+
+    crc = esFtl_CalcChecksum(buffer, ESFTL_NANDPAGEDATASIZE);
+    buffer[ESFTL_NANDPAGEDATASIZE] = 0xFF;
+    memcpy(&buffer[ESFTL_SPAREOFFSET], &sno, 2);
+    memcpy(&buffer[ESFTL_SPAREOFFSET + 2], &crc, 2);
+
+    return AppendLogPage(sno, buffer, 0);
+}
+
+/*
+ * @brief find the pages of consecutive sectors
+ *
+ * @param sno
+ * @param count
+ * @param pages set to 0xFFFF for a sector which is not assigned
+ */
+void esFtl_FindSectorPages(uint16_t sno, uint16_t count, uint16_t *pages)
+{
+    uint16_t i = 0;
+    int pno = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        pno = esFtl_FindSectorPage(sno + i);
+        pages[i] = (pno < 0) ? 0xFFFF : pno;
+    }
+}
+
+/*
+ * @brief write consecutive sectors to the log blocks of their logical blocks
+ *
+ * @param sno
+ * @param buffer count sectors of ESFTL_NANDPAGEDATASIZE bytes
+ * @param count
+ * @return 0 if it is successful
+ */
+int esFtl_WriteRun(uint16_t sno, const uint8_t *buffer, uint16_t count)
+{
+    uint16_t i = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        memcpy(batchBuff, &buffer[i * ESFTL_NANDPAGEDATASIZE], ESFTL_NANDPAGEDATASIZE);
+        if (esFtl_WriteSector(sno + i, batchBuff))
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * @brief log the releases of consecutive sectors
+ *
+ * @param sno
+ * @param count
+ * @return 0
+ */
+int esFtl_ReleaseSectors(uint16_t sno, uint16_t count)
+{
+    uint16_t i = 0;
+
+    for (i = 0; i < count; i++)
+        esFtl_FtlDriverRelease(sno + i);
+
+    return 0;
+}
+
+/*
+ * @brief log the release of the sector
+ *
+ * @param sno
+ * @return 0
+ */
+int esFtl_FtlDriverRelease(uint16_t sno)
+{
+    uint8_t spare[4];
+
+    sno++;
+
+#if ESFTL_WRITEBUFFERSECTORS
+    esFtl_BufferDrop(sno - 1);
+#endif
+#if ESFTL_READCACHESECTORS
+    esFtl_ReadCacheDrop(sno - 1);
+#endif
+#if ESFTL_READAHEADSECTORS
+    esFtl_ReadAheadDrop(sno - 1);
+#endif
+    esFtl_ScrubDrop(sno - 1);
+
+    if (esFtl_FindSectorPage(sno) < 0)
+    {
+        ESFTL_LOG("FtlDriverRelease %d not found\n", sno);
+        return 0;
+    }
+
+    memcpy(&spare[0], &sno, 2);
+    memset(&spare[2], 0xFF, 2);
+
+    if (AppendLogPage(sno, spare, 1))
+        ESFTL_LOG("esFtl: FATAL ERROR:%d %s %d\n", sno, __FILE__, __LINE__);
+
+    return 0;
+}
+
+/*
+ * @brief merge every log block into its data block
+ *
+ */
+void esFtl_Defrag(void)
+{
+    int i = 0;
+
+    for (i = 0; i < ESFTL_HYBRIDLOGBLOCKS; i++)
+    {
+        if (logBlocks[i].lbn != 0xFFFF)
+            MergeLogBlock(&logBlocks[i]);
+    }
+}
+
+/*
+ * @brief merge the least recently used log block while merging is advised, a merge is not split
+ *
+ * @param moves
+ * @param erases
+ * @return 1 if more merges are advised
+ */
+int esFtl_DefragStep(uint16_t moves, uint16_t erases)
+{
+    LogBlock *log = NULL;
+    int i = 0;
+
+    if (!esFtl_IsDefragNeeded() || !moves || !erases)
+        return esFtl_IsDefragNeeded();
+
+    for (i = 0; i < ESFTL_HYBRIDLOGBLOCKS; i++)
+    {
+        if (logBlocks[i].lbn != 0xFFFF && (!log || logBlocks[i].lastUse < log->lastUse))
+            log = &logBlocks[i];
+    }
+
+    if (log)
+        MergeLogBlock(log);
+
+    return log && esFtl_IsDefragNeeded();
+}
+
+/*
+ * @brief ask whether the idle hook has something to merge
+ *
+ * @return 1 if it has
+ */
+int esFtl_DefragPending(void)
+{
+    return esFtl_IsDefragNeeded();
+}
+
+/*
+ * @brief ask whether merging the log blocks is advised
+ *
+ * @return 1 if the free block pool is about to run out
+ */
+uint8_t esFtl_IsDefragNeeded(void)
+{
+    return esFtl_CalcFreePages() < ESFTL_HYBRIDLOGBLOCKS * ESFTL_NANDNUMPAGEBLOCK;
+}
+
+/*
+ * @brief determine the free space as count of page
+ *
+ * @return count of pages
+ */
+int esFtl_CalcFreePages(void)
+{
+    int freePages = 0, i = 0;
+
+    for (i = 0; i < ESFTL_NANDNUMBLOCKS; i++)
+    {
+        if (freeBlocks[i / 8] & (1 << (i % 8)))
+            freePages += ESFTL_NANDNUMPAGEBLOCK;
+    }
+
+    for (i = 0; i < ESFTL_HYBRIDLOGBLOCKS; i++)
+    {
+        if (logBlocks[i].lbn != 0xFFFF)
+            freePages += ESFTL_NANDNUMPAGEBLOCK - logBlocks[i].next;
+    }
+
+    return freePages;
+}
+
+/*
+ * @brief determine the used space as count of page
+ *
+ * @return count of pages
+ */
+int esFtl_CalcUsedPages(void)
+{
+    return (ESFTL_NANDNUMBLOCKS * ESFTL_NANDNUMPAGEBLOCK) - esFtl_CalcFreePages();
+}
+
+/*
+ * @brief append a data or release page for the sector, a full log block is merged first
+ *
+ * @param sno
+ * @param buffer page data followed by the spare, only the spare for a release
+ * @param released
+ * @return 0 if it is successful
+ */
+static int AppendLogPage(uint16_t sno, uint8_t *buffer, uint8_t released)
+{
+    LogBlock *log;
+    uint16_t lbn = (sno - 1) / ESFTL_NANDNUMPAGEBLOCK;
+    uint8_t off = (sno - 1) % ESFTL_NANDNUMPAGEBLOCK;
+    uint8_t markedAsReleasedByte = 0xF0;
+    uint32_t pno = 0;
+    int retry = 0, rv = 0;
+
+    for (retry = 0; retry < WRITERETRIES; retry++)
+    {
+        log = FindLogBlock(lbn);
+        if (log && log->next >= ESFTL_NANDNUMPAGEBLOCK)
+        {
+            MergeLogBlock(log);
+            log = NULL;
+        }
+
+        if (!log)
+            log = OpenLogBlock(lbn);
+
+        if (!log)
+            return -1;
+
+        pno = log->pbn * ESFTL_NANDNUMPAGEBLOCK + log->next;
+        if (released)
+        {
+            /* the mark goes first, a release cut before its sector number leaves a page the mount skips */
+            rv = esFtl_NandFlashWrite(pno, ESFTL_SPAREOFFSET + 4, &markedAsReleasedByte, 1);
+            if (!rv)
+                rv = esFtl_NandFlashWrite(pno, ESFTL_SPAREOFFSET, buffer, 4);
+        }
+        else
+        {
+            rv = esFtl_NandFlashWrite(pno, 0, buffer, ESFTL_PAGEBUFFSIZE);
+        }
+
+        log->lastUse = ++logClock;
+
+        if (!rv)
+        {
+            log->pageOf[off] = log->next | (released ? PAGERELEASED : 0);
+            log->next++;
+            return 0;
+        }
+
+        /* the page is lost, close the block so that its content is merged away */
+        ESFTL_LOG("esFtl: FATAL ERROR:%d %s %d\n", pno, __FILE__, __LINE__);
+        log->next = ESFTL_NANDNUMPAGEBLOCK;
+        log->failed = 1;
+    }
+
+    return -1;
+}
+
+/*
+ * @brief get the log block of a logical block, the least recently used log block is merged if none is free
+ *
+ * @param lbn
+ * @return NULL if there is no free block
+ */
+static LogBlock *OpenLogBlock(uint16_t lbn)
+{
+    LogBlock *log = FindLogBlock(lbn);
+    int pbn = 0, i = 0;
+
+    if (log)
+        return log;
+
+    for (i = 0; i < ESFTL_HYBRIDLOGBLOCKS; i++)
+    {
+        if (logBlocks[i].lbn == 0xFFFF)
+        {
+            log = &logBlocks[i];
+            break;
+        }
+
+        if (!log || logBlocks[i].lastUse < log->lastUse)
+            log = &logBlocks[i];
+    }
+
+    if (log->lbn != 0xFFFF && MergeLogBlock(log))
+        return NULL;
+
+    for (i = 0; i < WRITERETRIES; i++)
+    {
+        pbn = AllocateBlock();
+        if (pbn < 0)
+            return NULL;
+
+        if (!WriteHeader(pbn, BLOCKTYPELOG, lbn, blockSeq, ~0ULL))
+            break;
+
+        esFtl_MarkBadBlock(pbn);
+        pbn = -1;
+    }
+
+    if (pbn < 0)
+        return NULL;
+
+    log->lbn = lbn;
+    log->pbn = pbn;
+    log->seq = blockSeq++;
+    log->next = 0;
+    log->failed = 0;
+    log->lastUse = ++logClock;
+    memset(log->pageOf, PAGENONE, sizeof(log->pageOf));
+    return log;
+}
+
+/*
+ * @brief fold a log block into the data block of its logical block
+ *
+ * @param log
+ * @return 0 if it is successful
+ */
+static int MergeLogBlock(LogBlock *log)
+{
+    uint16_t lbn = log->lbn, oldData = dataMap[log->lbn];
+    uint16_t sno = 0;
+    uint32_t src = 0;
+    uint64_t valid = 0;
+    int pbn = -1, retry = 0, i = 0, failed = 0;
+    uint8_t type = BLOCKTYPEDATA;
+
+    /* switch merge: the log block already holds every page in place */
+    for (i = 0; i < ESFTL_NANDNUMPAGEBLOCK; i++)
+    {
+        if (log->pageOf[i] != i)
+            break;
+    }
+
+    if (i == ESFTL_NANDNUMPAGEBLOCK && !esFtl_NandFlashWrite(log->pbn * ESFTL_NANDNUMPAGEBLOCK, HEADEROFFSET + 6, &type, 1))
+    {
+        dataMap[lbn] = log->pbn;
+        dataValid[lbn] = ~0ULL;
+        if (oldData != 0xFFFF)
+            FreeBlock(oldData);
+        log->lbn = 0xFFFF;
+        return 0;
+    }
+
+    for (retry = 0; retry < WRITERETRIES; retry++)
+    {
+        pbn = AllocateBlock();
+        if (pbn < 0)
+            return -1;
+
+        failed = 0;
+        valid = 0;
+        for (i = 0; i < ESFTL_NANDNUMPAGEBLOCK && !failed; i++)
+        {
+            if (log->pageOf[i] != PAGENONE)
+            {
+                if (log->pageOf[i] & PAGERELEASED)
+                    continue;
+                src = log->pbn * ESFTL_NANDNUMPAGEBLOCK + log->pageOf[i];
+            }
+            else if (oldData != 0xFFFF && (dataValid[lbn] & (1ULL << i)))
+            {
+                src = oldData * ESFTL_NANDNUMPAGEBLOCK + i;
+            }
+            else
+            {
+                continue;
+            }
+
+            if (esFtl_NandFlashRead(src, 0, pageBuff, ESFTL_PAGEBUFFSIZE))
+            {
+                ESFTL_LOG("esFtl: FATAL ERROR:%d %s %d\n", src, __FILE__, __LINE__);
+                continue;
+            }
+
+            memcpy(&sno, &pageBuff[ESFTL_SPAREOFFSET], 2);
+            if (sno == 0xFFFF)
+                continue;
+
+            if (esFtl_NandFlashWrite(pbn * ESFTL_NANDNUMPAGEBLOCK + i, 0, pageBuff, ESFTL_PAGEBUFFSIZE))
+                failed = 1;
+            else
+                valid |= 1ULL << i;
+        }
+
+        /* the header is written last, a merge cut by a power loss leaves a block without header */
+        if (!failed && !WriteHeader(pbn, BLOCKTYPEDATA, lbn, blockSeq, valid))
+            break;
+
+        esFtl_MarkBadBlock(pbn);
+        pbn = -1;
+    }
+
+    if (pbn < 0)
+        return -1;
+
+    blockSeq++;
+    dataMap[lbn] = pbn;
+    dataValid[lbn] = valid;
+    if (oldData != 0xFFFF)
+        FreeBlock(oldData);
+    if (log->failed)
+        esFtl_MarkBadBlock(log->pbn);
+    else
+        FreeBlock(log->pbn);
+    log->lbn = 0xFFFF;
+
+    ESFTL_LOG("Logical block %d merged to %d\n", lbn, pbn);
+    return 0;
+}
+
+/*
+ * @brief rebuild the page table of a log block from the spares of its pages
+ *
+ * @param log
+ */
+static void ScanLogBlock(LogBlock *log)
+{
+    uint8_t spare[5];
+    uint16_t sno = 0;
+    int i = 0;
+
+    memset(log->pageOf, PAGENONE, sizeof(log->pageOf));
+
+    for (i = 0; i < ESFTL_NANDNUMPAGEBLOCK; i++)
+    {
+        if (esFtl_NandFlashRead(log->pbn * ESFTL_NANDNUMPAGEBLOCK + i, ESFTL_SPAREOFFSET, spare, sizeof(spare)))
+            break;
+
+        /* a page with the release mark but no sector number is a release the power went in */
+        memcpy(&sno, spare, 2);
+        if (sno == 0xFFFF && spare[4] == 0xFF)
+            break;
+
+        if (sno != 0xFFFF && (sno - 1) / ESFTL_NANDNUMPAGEBLOCK == log->lbn)
+            log->pageOf[(sno - 1) % ESFTL_NANDNUMPAGEBLOCK] = i | (spare[4] != 0xFF ? PAGERELEASED : 0);
+    }
+
+    log->next = i;
+}
+
+static int ReadHeader(uint16_t pbn, BlockHeader *hdr)
+{
+    if (esFtl_NandFlashRead(pbn * ESFTL_NANDNUMPAGEBLOCK, HEADEROFFSET, (uint8_t *)hdr, sizeof(BlockHeader)))
+        return -1;
+
+    if ((hdr->type != BLOCKTYPELOG && hdr->type != BLOCKTYPEDATA) || hdr->seq == 0xFFFFFFFF)
+        return -1;
+
+    return 0;
+}
+
+static int WriteHeader(uint16_t pbn, uint8_t type, uint16_t lbn, uint32_t seq, uint64_t valid)
+{
+    BlockHeader hdr;
+    uint32_t head = sizeof(BlockHeader) - sizeof(hdr.valid);
+
+    hdr.seq = seq;
+    hdr.lbn = lbn;
+    hdr.type = type;
+    hdr.reserved = 0xFF;
+    hdr.valid = valid;
+
+    /* valid goes first, a header cut before its type and sequence is not taken by the mount */
+    if (esFtl_NandFlashWrite(pbn * ESFTL_NANDNUMPAGEBLOCK, HEADEROFFSET + head, (uint8_t *)&hdr.valid, sizeof(hdr.valid)))
+        return -1;
+
+    return esFtl_NandFlashWrite(pbn * ESFTL_NANDNUMPAGEBLOCK, HEADEROFFSET, (uint8_t *)&hdr, head);
+}
+
+/*
+ * @brief take a block from the free pool and erase it, the pool is walked round robin
+ *
+ * @return -1 if the pool is empty
+ */
+static int AllocateBlock(void)
+{
+    int i = 0, pbn = 0;
+
+    for (i = 0; i < ESFTL_NANDNUMBLOCKS; i++)
+    {
+        pbn = (allocCursor + i) % ESFTL_NANDNUMBLOCKS;
+        if (!(freeBlocks[pbn / 8] & (1 << (pbn % 8))) || esFtl_IsBadBlock(pbn))
+            continue;
+
+        freeBlocks[pbn / 8] &= ~(1 << (pbn % 8));
+        if (esFtl_NandFlashBlockErase(pbn))
+        {
+            ESFTL_LOG("Erase block fail %d!!\n", pbn);
+            esFtl_MarkBadBlock(pbn);
+            continue;
+        }
+
+        allocCursor = (pbn + 1) % ESFTL_NANDNUMBLOCKS;
+        return pbn;
+    }
+
+    return -1;
+}
+
+static void FreeBlock(uint16_t pbn)
+{
+    freeBlocks[pbn / 8] |= 1 << (pbn % 8);
+}
+
+static LogBlock *FindLogBlock(uint16_t lbn)
+{
+    int i = 0;
+
+    for (i = 0; i < ESFTL_HYBRIDLOGBLOCKS; i++)
+    {
+        if (logBlocks[i].lbn == lbn)
+            return &logBlocks[i];
+    }
+
+    return NULL;
+}
+
+#endif
@@ -20,39 +20,112 @@
 #include "esFtl_bbm.h"
 #include "esFtl_cache.h"
 #include "esFtl_defragment.h"
+#include "esFtl_hybrid.h"
+#include "esFtl_summary.h"
+#include "esFtl_blocks.h"
+#include "esFtl_buffer.h"
+#include "esFtl_checksum.h"
+#include "esFtl_readcache.h"
+#include "esFtl_readahead.h"
+#include "esFtl_scrub.h"
 #include "esFtl_init.h"
 
 /*
  * @brief initialize the disk first time and format it if it is requested
  *
  * @param format
- * @return 0
+ * @return 0 if it is successful, -1 if the checksum of the image is unknown or not supported by this build
  */
 int esFtl_Init(uint8_t format)
 {
-    uint8_t firstBlockMarked = 0;
-    int i = 0;
-
     esFtl_NandFlashInit();
 
+    /* a format writes this checksum to the bad block table, a mount takes the one of the table */
+    esFtl_SelectChecksum(ESFTL_CHECKSUM);
+
+    /* the bad blocks are known before a format erases anything, an erase may clear a factory marker */
+    if (esFtl_LoadBadBlocks(format))
+    {
+        ESFTL_LOG("Checksum of the image is unknown, it is not mounted\n");
+        return -1;
+    }
     if (format)
+        esFtl_FormatBlocks();
+
+#if ESFTL_WRITEBUFFERSECTORS
+    esFtl_ResetWriteBuffer();
+#endif
+#if ESFTL_READCACHESECTORS
+    esFtl_ResetReadCache();
+#endif
+#if ESFTL_READAHEADSECTORS
+    esFtl_ResetReadAhead();
+#endif
+    esFtl_ResetScrub();
+#if ESFTL_HYBRIDMAPPING
+    esFtl_HybridMount();
+#else
+    esFtl_ResetBlockSummary();
+    esFtl_ResetDefrag();
+    if (esFtl_LoadCheckpoint(ESFTL_LAZYMOUNT))
     {
-        for (i = 0; i < ESFTL_NANDNUMBLOCKS; i++)
-        {
-            if (esFtl_NandFlashBlockErase(i) != 0)
-            {
-                ESFTL_LOG("Erase block fail %d!!\n", i);
-            }
-            else if (!firstBlockMarked)
-            {
-                if (!esFtl_MarkedFirstBlock(i))
-                    firstBlockMarked = 1;
-            }
-        }
+#if ESFTL_LAZYMOUNT
+        esFtl_EvaluateCursorLazy();
+#else
+        esFtl_EvaluateCursorAndCache();
+        esFtl_Checkpoint(0);
+#endif
     }
+#endif
+    return 0;
+}
+
+/*
+ * @brief write everything kept in RAM to the flash, the next mount does not scan the log
+ *
+ * @return 0 if it is successful
+ */
+int esFtl_Shutdown(void)
+{
+    if (esFtl_Sync())
+        return -1;
+
+#if ESFTL_HYBRIDMAPPING
+    return 0;
+#else
+    return esFtl_Checkpoint(1);
+#endif
+}
+
+/*
+ * @brief do a bounded part of the background work, it is meant to be called while the device is idle
+ *
+ * @return 1 if there is more to do
+ */
+int esFtl_Idle(void)
+{
+#if !ESFTL_HYBRIDMAPPING
+    if (esFtl_MountStep())
+        return 1;
+#endif
+
+#if ESFTL_WRITEBUFFERSECTORS
+    /* the sectors which waited too long in the write buffer go first */
+    if (esFtl_BufferFlushExpired(1))
+        return 1;
+#endif
+
+#if !ESFTL_HYBRIDMAPPING
+    /* the next blocks to be allocated are erased before the defragment goes on */
+    if (esFtl_EraseDirtyBlock(ESFTL_ERASEDPOOLBLOCKS))
+        return 1;
+#endif
+    if (esFtl_DefragPending())
+        return esFtl_DefragStep(ESFTL_DEFRAGSTEPPAGES, 1);
 
-    esFtl_TestForBadBlocks();
-    esFtl_EvaluateCursorAndCache();
-    esFtl_ControlPageCorruptions();
+#if ESFTL_SCRUBSTEPPAGES
+    /* the scrubber takes what is left of the idle time, it does not ask for more */
+    esFtl_ScrubStep(ESFTL_SCRUBSTEPPAGES);
+#endif
     return 0;
 }
\ No newline at end of file
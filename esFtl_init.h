@@ -19,5 +19,7 @@
 #define ESFTL_INIT_H__
 
 int esFtl_Init(uint8_t format);
+int esFtl_Shutdown(void);
+int esFtl_Idle(void);
 
 #endif
\ No newline at end of file
@@ -19,6 +19,9 @@
 #include "esFtl_disk.h"
 #include "esFtl_cache.h"
 #include "esFtl_read.h"
+#include "esFtl_buffer.h"
+#include "esFtl_readcache.h"
+#include "esFtl_readahead.h"
 
 /*
  * @brief read the page data of the sector
@@ -32,14 +35,49 @@
 int esFtl_Read(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count)
 {
     int pno = 0, rv = -1;
+#if ESFTL_READCACHESECTORS
+    uint8_t *data;
+#endif
     sno++;
 
     memset(&buffer[idx], 0xFF, count);
 
+    if (sno >= ESFTL_MAPSNOBASE)
+        return -1;
+
+#if ESFTL_WRITEBUFFERSECTORS
+    /* a sector which is not on the flash yet is read back from the write buffer */
+    if (!esFtl_BufferRead(sno - 1, buffer, idx, count))
+        return 0;
+#endif
+
+#if ESFTL_READAHEADSECTORS
+    if (!esFtl_ReadAhead(sno - 1, buffer, idx, count))
+        return 0;
+#endif
+
+#if ESFTL_READCACHESECTORS
+    if (!esFtl_ReadCacheGet(sno - 1, buffer, idx, count))
+        return 0;
+#endif
+
     pno = esFtl_FindSectorPage(sno);
     if (pno >= 0)
     {
-        rv = esFtl_NandFlashRead(pno, idx, buffer, count);
+#if ESFTL_READCACHESECTORS
+        /* the whole page data is taken in, a later read of another part of the sector hits too */
+        if (idx + count <= ESFTL_NANDPAGEDATASIZE)
+        {
+            data = esFtl_ReadCacheTake(sno - 1);
+            rv = esFtl_NandFlashRead(pno, 0, data, ESFTL_NANDPAGEDATASIZE);
+            if (rv)
+                esFtl_ReadCacheDrop(sno - 1);
+            else
+                memcpy(buffer, &data[idx], count);
+        }
+        else
+#endif
+            rv = esFtl_NandFlashRead(pno, idx, buffer, count);
         if (rv)
         {
             ESFTL_LOG("esFTL: FATAL ERROR:%d %s %d\n", pno, __FILE__, __LINE__);
@@ -47,4 +85,30 @@ int esFtl_Read(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count)
     }
 
     return rv;
+}
+
+/*
+ * @brief read the data areas of consecutive pages, with one cache read if the disk driver has it
+ *
+ * @param pno
+ * @param count
+ * @param buffer room for count times ESFTL_NANDPAGEDATASIZE bytes
+ * @return 0 if it is successful
+ */
+int esFtl_ReadPages(uint16_t pno, uint16_t count, uint8_t *buffer)
+{
+    uint16_t i = 0;
+
+#if ESFTL_NANDCACHEREAD
+    if (count > 1)
+        return esFtl_NandFlashReadPages(pno, count, buffer);
+#endif
+
+    for (i = 0; i < count; i++)
+    {
+        if (esFtl_NandFlashRead(pno + i, 0, &buffer[(uint32_t)i * ESFTL_NANDPAGEDATASIZE], ESFTL_NANDPAGEDATASIZE))
+            return -1;
+    }
+
+    return 0;
 }
\ No newline at end of file
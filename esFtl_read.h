@@ -19,5 +19,6 @@
 #define ESFTL_READ_H__
 
 int esFtl_Read(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count);
+int esFtl_ReadPages(uint16_t pno, uint16_t count, uint8_t *buffer);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,208 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "esFtl_definitions.h"
+#include "esFtl_disk.h"
+#include "esFtl_cache.h"
+#include "esFtl_read.h"
+#include "esFtl_readahead.h"
+
+#if ESFTL_READAHEADSECTORS
+
+/*
+ * A host reading a file calls esFtl_Read sector by sector. Once
+ * ESFTL_READAHEADTRIGGER reads followed each other, the next read which
+ * misses the window reads the following sectors too: their pages are looked
+ * up at once and the consecutive ones are streamed with the cache read of
+ * the chip. The window starts at twice the trigger and doubles with every
+ * window the host reads up to ESFTL_READAHEADSECTORS, a read out of order
+ * drops it back to nothing.
+ */
+#define NOSECTOR 0xFFFF
+
+static uint8_t aheadData[ESFTL_READAHEADSECTORS][ESFTL_NANDPAGEDATASIZE];
+static uint8_t aheadHeld[ESFTL_READAHEADSECTORS]; /* 1 read ahead, 2 also read by the host */
+static uint16_t aheadFirst = NOSECTOR;
+static uint16_t aheadCount = 0;
+static uint16_t window = 0;
+static uint16_t lastSno = NOSECTOR;
+static uint16_t streak = 0;
+static esFtl_ReadAheadStats aheadStats;
+
+static void Prefetch(uint16_t sno);
+static void DropWindow(void);
+
+/*
+ * @brief forget the window, a mount starts without one
+ *
+ */
+void esFtl_ResetReadAhead(void)
+{
+    aheadFirst = NOSECTOR;
+    aheadCount = 0;
+    window = 0;
+    lastSno = NOSECTOR;
+    streak = 0;
+}
+
+/*
+ * @brief follow the reads of the host and serve the sequential ones from the
+ * window, the data is put to the buffer like a flash read does
+ *
+ * @param sno
+ * @param buffer
+ * @param idx
+ * @param count
+ * @return 0 if the sector is served from the window
+ */
+int esFtl_ReadAhead(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count)
+{
+    uint16_t i = 0;
+
+    /* the parts of one sector read one after the other do not break the run */
+    if (sno != lastSno)
+    {
+        if (lastSno != NOSECTOR && sno == lastSno + 1)
+        {
+            streak++;
+        }
+        else
+        {
+            streak = 0;
+            window = 0;
+            DropWindow();
+        }
+        lastSno = sno;
+    }
+
+    if (idx + count > ESFTL_NANDPAGEDATASIZE)
+        return -1;
+
+    i = sno - aheadFirst;
+    if (aheadFirst == NOSECTOR || sno < aheadFirst || i >= aheadCount || !aheadHeld[i])
+    {
+        if (streak < ESFTL_READAHEADTRIGGER)
+            return -1;
+
+        Prefetch(sno);
+        i = 0;
+        if (!aheadCount || !aheadHeld[0])
+            return -1;
+    }
+
+    memcpy(buffer, &aheadData[i][idx], count);
+    if (aheadHeld[i] == 1)
+    {
+        aheadHeld[i] = 2;
+        aheadStats.hits++;
+    }
+    return 0;
+}
+
+/*
+ * @brief forget a sector of the window, it is written or released
+ *
+ * @param sno
+ */
+void esFtl_ReadAheadDrop(uint16_t sno)
+{
+    uint16_t i = sno - aheadFirst;
+
+    if (aheadFirst != NOSECTOR && sno >= aheadFirst && i < aheadCount)
+        aheadHeld[i] = 0;
+}
+
+/*
+ * @brief copy the counters of the read-ahead
+ *
+ * @param stats
+ */
+void esFtl_GetReadAheadStats(esFtl_ReadAheadStats *stats)
+{
+    *stats = aheadStats;
+}
+
+/*
+ * @brief read the window starting at the sector, the runs of consecutive
+ * pages are read with one cache read each
+ *
+ * @param sno
+ */
+static void Prefetch(uint16_t sno)
+{
+    uint16_t pages[ESFTL_READAHEADSECTORS];
+    uint16_t i = 0, n = 0;
+
+    DropWindow();
+
+    window = window ? window * 2 : ESFTL_READAHEADTRIGGER * 2;
+    if (window > ESFTL_READAHEADSECTORS)
+        window = ESFTL_READAHEADSECTORS;
+    if (sno + 1 + window > ESFTL_MAPSNOBASE)
+        window = ESFTL_MAPSNOBASE - sno - 1;
+
+    esFtl_FindSectorPages(sno + 1, window, pages);
+
+    aheadFirst = sno;
+    aheadCount = window;
+    aheadStats.windows++;
+
+    for (i = 0; i < window; i += n)
+    {
+        n = 1;
+        if (pages[i] == 0xFFFF)
+        {
+            aheadHeld[i] = 0;
+            continue;
+        }
+
+        while (i + n < window && pages[i + n] == pages[i] + n)
+            n++;
+
+        if (esFtl_ReadPages(pages[i], n, aheadData[i]))
+        {
+            memset(&aheadHeld[i], 0, n);
+            continue;
+        }
+
+        memset(&aheadHeld[i], 1, n);
+        aheadStats.prefetched += n;
+    }
+}
+
+static void DropWindow(void)
+{
+    uint16_t i = 0;
+
+    for (i = 0; i < aheadCount; i++)
+    {
+        if (aheadHeld[i] == 1)
+            aheadStats.wasted++;
+    }
+
+    aheadFirst = NOSECTOR;
+    aheadCount = 0;
+}
+
+#else
+
+void esFtl_GetReadAheadStats(esFtl_ReadAheadStats *stats)
+{
+    memset(stats, 0, sizeof(esFtl_ReadAheadStats));
+}
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef ESFTL_READAHEAD_H__
+#define ESFTL_READAHEAD_H__
+
+typedef struct
+{
+    uint32_t windows;    /* read-ahead windows read from the flash */
+    uint32_t prefetched; /* sectors read ahead */
+    uint32_t hits;
+    uint32_t wasted;     /* sectors read ahead and dropped before they were read */
+} esFtl_ReadAheadStats;
+
+void esFtl_GetReadAheadStats(esFtl_ReadAheadStats *stats);
+#if ESFTL_READAHEADSECTORS
+void esFtl_ResetReadAhead(void);
+int esFtl_ReadAhead(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count);
+void esFtl_ReadAheadDrop(uint16_t sno);
+#endif
+
+#endif
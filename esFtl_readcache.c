@@ -0,0 +1,161 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "esFtl_definitions.h"
+#include "esFtl_disk.h"
+#include "esFtl_readcache.h"
+
+#if ESFTL_READCACHESECTORS
+
+/*
+ * The contents of recently read sectors are held in RAM, a read of a held
+ * sector costs no flash access. A sector is taken in on a miss of esFtl_Read
+ * and replaced by the CLOCK policy: the hand sweeps the slots, a slot read
+ * since the last sweep gets a second chance. The slots are looked up by
+ * sector, so a page moved by the defragment stays valid while a write or a
+ * release of the sector drops it.
+ */
+#define SLOTFREE 0xFFFF
+
+typedef struct
+{
+    uint8_t data[ESFTL_NANDPAGEDATASIZE];
+    uint16_t sno;
+    uint8_t referenced;
+} CacheSlot;
+
+static CacheSlot slots[ESFTL_READCACHESECTORS];
+static esFtl_ReadCacheStats cacheStats;
+static uint16_t hand = 0;
+
+static CacheSlot *FindSlot(uint16_t sno);
+
+/*
+ * @brief forget the held sectors, a mount starts with an empty cache
+ *
+ */
+void esFtl_ResetReadCache(void)
+{
+    int i = 0;
+
+    for (i = 0; i < ESFTL_READCACHESECTORS; i++)
+        slots[i].sno = SLOTFREE;
+    hand = 0;
+}
+
+/*
+ * @brief serve a read from the cache, the data is put to the buffer like a flash read does
+ *
+ * @param sno
+ * @param buffer
+ * @param idx
+ * @param count
+ * @return 0 if the sector is held
+ */
+int esFtl_ReadCacheGet(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count)
+{
+    CacheSlot *slot = FindSlot(sno);
+
+    if (!slot || idx + count > ESFTL_NANDPAGEDATASIZE)
+    {
+        cacheStats.misses++;
+        return -1;
+    }
+
+    memcpy(buffer, &slot->data[idx], count);
+    slot->referenced = 1;
+    cacheStats.hits++;
+    return 0;
+}
+
+/*
+ * @brief get a slot for a sector which missed, the caller reads the page data
+ * into it and drops the sector if the read fails
+ *
+ * @param sno
+ * @return room for ESFTL_NANDPAGEDATASIZE bytes
+ */
+uint8_t *esFtl_ReadCacheTake(uint16_t sno)
+{
+    CacheSlot *slot;
+
+    while (1)
+    {
+        slot = &slots[hand];
+        hand = (hand + 1) % ESFTL_READCACHESECTORS;
+
+        if (slot->sno == SLOTFREE || !slot->referenced)
+            break;
+
+        slot->referenced = 0;
+    }
+
+    if (slot->sno != SLOTFREE)
+        cacheStats.evictions++;
+
+    slot->sno = sno;
+    slot->referenced = 0;
+    return slot->data;
+}
+
+/*
+ * @brief forget a held sector, it is written, released or could not be read
+ *
+ * @param sno
+ */
+void esFtl_ReadCacheDrop(uint16_t sno)
+{
+    CacheSlot *slot = FindSlot(sno);
+
+    if (slot)
+    {
+        slot->sno = SLOTFREE;
+        cacheStats.invalidations++;
+    }
+}
+
+/*
+ * @brief copy the counters of the cache
+ *
+ * @param stats
+ */
+void esFtl_GetReadCacheStats(esFtl_ReadCacheStats *stats)
+{
+    *stats = cacheStats;
+}
+
+static CacheSlot *FindSlot(uint16_t sno)
+{
+    int i = 0;
+
+    for (i = 0; i < ESFTL_READCACHESECTORS; i++)
+    {
+        if (slots[i].sno == sno)
+            return &slots[i];
+    }
+
+    return NULL;
+}
+
+#else
+
+void esFtl_GetReadCacheStats(esFtl_ReadCacheStats *stats)
+{
+    memset(stats, 0, sizeof(esFtl_ReadCacheStats));
+}
+
+#endif
@@ -0,0 +1,37 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef ESFTL_READCACHE_H__
+#define ESFTL_READCACHE_H__
+
+typedef struct
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t invalidations; /* held sectors dropped by a write, a release or a failed read */
+} esFtl_ReadCacheStats;
+
+void esFtl_GetReadCacheStats(esFtl_ReadCacheStats *stats);
+#if ESFTL_READCACHESECTORS
+void esFtl_ResetReadCache(void);
+int esFtl_ReadCacheGet(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count);
+uint8_t *esFtl_ReadCacheTake(uint16_t sno);
+void esFtl_ReadCacheDrop(uint16_t sno);
+#endif
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "esFtl_definitions.h"
+#include "esFtl_disk.h"
+#include "esFtl_cache.h"
+#include "esFtl_bbm.h"
+#include "esFtl_blocks.h"
+#include "esFtl_checksum.h"
+#include "esFtl_hybrid.h"
+#include "esFtl_scrub.h"
+
+/*
+ * The scrubber reads the valid pages again and compares their data with the
+ * checksum in their spare area, a bounded count of pages per step so that it
+ * can run while the device is idle. Its cursor walks the device from the
+ * first page to the last and starts again, the progress is kept between the
+ * steps. The sector of a corrupted page is kept in a list until the host
+ * writes it again. In page mode the block holding it is handed to the
+ * defragment, which moves its valid pages to other blocks and erases it.
+ * Every page is moved with its stored crc, so a corrupted sector stays
+ * detectable, and a sector already on the list does not hand its new block
+ * over again. The hybrid mode walks the sectors and only reports what it
+ * finds.
+ */
+#if ESFTL_HYBRIDMAPPING
+#define SCRUBSPAN ((uint32_t)ESFTL_HYBRIDLOGICALBLOCKS * ESFTL_NANDNUMPAGEBLOCK) /* sectors */
+#else
+#define SCRUBSPAN ((uint32_t)ESFTL_NANDNUMBLOCKS * ESFTL_NANDNUMPAGEBLOCK) /* pages */
+#endif
+
+static uint32_t scrubCursor = 0;
+static esFtl_ScrubStats scrubStats;
+
+static int CheckNext(uint8_t *buff);
+static int AddCorruptedSector(uint16_t sno);
+
+/*
+ * @brief forget the progress and the counters, a mount starts a new pass
+ *
+ */
+void esFtl_ResetScrub(void)
+{
+    scrubCursor = 0;
+    memset(&scrubStats, 0, sizeof(scrubStats));
+    scrubStats.lastCorruptedPage = 0xFFFFFFFF;
+}
+
+/*
+ * @brief check a bounded count of pages, it goes on where the last step stopped
+ *
+ * @param pages count of pages which may be read
+ * @return 1 if the pass is not over
+ */
+int esFtl_ScrubStep(uint16_t pages)
+{
+    uint8_t buff[ESFTL_PAGEBUFFSIZE];
+
+#if !ESFTL_HYBRIDMAPPING
+    /* only the pages holding the current copy of a sector are checked */
+    esFtl_BuildValidPages();
+#endif
+
+    for (; scrubCursor < SCRUBSPAN && pages; scrubCursor++)
+    {
+        if (CheckNext(buff))
+            pages--;
+    }
+
+    if (scrubCursor < SCRUBSPAN)
+    {
+        scrubStats.coverage = (uint16_t)((uint64_t)scrubCursor * 1000 / SCRUBSPAN);
+        return 1;
+    }
+
+    ESFTL_LOG("Scrub pass %d: %d pages are checked %d corrupted found\n", scrubStats.passes, scrubStats.checkedPages, scrubStats.corruptedPages);
+    scrubCursor = 0;
+    scrubStats.coverage = 0;
+    scrubStats.passes++;
+    return 0;
+}
+
+/*
+ * @brief forget a corrupted sector, it is called when the sector is written or released
+ *
+ * @param sno
+ */
+void esFtl_ScrubDrop(uint16_t sno)
+{
+    uint16_t i = 0;
+
+    for (i = 0; i < scrubStats.numCorruptedSectors; i++)
+    {
+        if (scrubStats.corruptedSectors[i] == sno)
+        {
+            scrubStats.corruptedSectors[i] = scrubStats.corruptedSectors[--scrubStats.numCorruptedSectors];
+            return;
+        }
+    }
+}
+
+/*
+ * @brief check every valid page at once, it is a whole pass of the scrubber from the first page
+ *
+ */
+void esFtl_ControlPageCorruptions(void)
+{
+    scrubCursor = 0;
+    while (esFtl_ScrubStep(0xFFFF))
+        ;
+}
+
+/*
+ * @brief get the counters of the scrubber and the part of the current pass done
+ *
+ * @param stats
+ */
+void esFtl_GetScrubStats(esFtl_ScrubStats *stats)
+{
+    *stats = scrubStats;
+}
+
+#if ESFTL_HYBRIDMAPPING
+/*
+ * @brief check the sector at the cursor if it is mapped
+ *
+ * @param buff room for a page and its spare bytes
+ * @return 1 if a page is read
+ */
+static int CheckNext(uint8_t *buff)
+{
+    int pno = esFtl_FindSectorPage(scrubCursor + 1);
+
+    if (pno < 0)
+        return 0;
+
+    scrubStats.checkedPages++;
+    if (esFtl_CheckCorruption(scrubCursor, buff))
+    {
+        scrubStats.corruptedPages++;
+        scrubStats.lastCorruptedPage = pno;
+        AddCorruptedSector(scrubCursor);
+    }
+
+    return 1;
+}
+#else
+/*
+ * @brief check the page at the cursor if it is valid, the block of a newly
+ * corrupted page is marked suspect so that the defragment cleans it
+ *
+ * @param buff room for a page and its spare bytes
+ * @return 1 if a page is read
+ */
+static int CheckNext(uint8_t *buff)
+{
+    uint16_t sno = 0, crc = 0;
+    uint16_t pno = scrubCursor;
+
+    if (!esFtl_IsPageValid(pno))
+        return 0;
+
+    scrubStats.checkedPages++;
+    if (esFtl_NandFlashRead(pno, 0, buff, ESFTL_PAGEBUFFSIZE))
+    {
+        /* the page may read again later, nothing is known about its sector */
+        ESFTL_LOG("esFtl: FATAL ERROR: %d %s %d\n", pno, __FILE__, __LINE__);
+        return 1;
+    }
+
+    memcpy(&sno, &buff[ESFTL_SPAREOFFSET], 2);
+    memcpy(&crc, &buff[ESFTL_SPAREOFFSET + 2], 2);
+    if (crc == esFtl_CalcChecksum(buff, ESFTL_NANDPAGEDATASIZE))
+        return 1;
+
+    ESFTL_LOG("Page %d is corrupted (Sector %d)\n", pno, sno);
+    scrubStats.corruptedPages++;
+    scrubStats.lastCorruptedPage = pno;
+
+    /* the block is cleaned once per corruption, the page keeps its crc when it is moved */
+    if (AddCorruptedSector(sno - 1) && esFtl_SuspectBlock(pno / ESFTL_NANDNUMPAGEBLOCK))
+        scrubStats.suspectBlocks++;
+
+    return 1;
+}
+#endif
+
+/*
+ * @brief put a sector on the list of the corrupted ones
+ *
+ * @param sno
+ * @return 1 if it was not on the list
+ */
+static int AddCorruptedSector(uint16_t sno)
+{
+    uint16_t i = 0;
+
+    for (i = 0; i < scrubStats.numCorruptedSectors; i++)
+    {
+        if (scrubStats.corruptedSectors[i] == sno)
+            return 0;
+    }
+
+    /* a full list keeps the sectors found first, the counters still grow */
+    if (scrubStats.numCorruptedSectors < ESFTL_SCRUBSECTORS)
+        scrubStats.corruptedSectors[scrubStats.numCorruptedSectors++] = sno;
+
+    return 1;
+}
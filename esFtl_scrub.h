@@ -0,0 +1,39 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef ESFTL_SCRUB_H__
+#define ESFTL_SCRUB_H__
+
+typedef struct
+{
+    uint32_t checkedPages;       /* pages read and checked since the mount */
+    uint32_t corruptedPages;     /* pages whose data did not match their checksum */
+    uint32_t suspectBlocks;      /* blocks handed to the defragment to be cleaned */
+    uint32_t passes;             /* passes over the whole device completed since the mount */
+    uint32_t lastCorruptedPage;  /* 0xFFFFFFFF if none is found */
+    uint16_t coverage;           /* part of the current pass done, in 1/1000 */
+    uint16_t numCorruptedSectors;
+    uint16_t corruptedSectors[ESFTL_SCRUBSECTORS]; /* sectors found corrupted, a sector leaves the list when it is written */
+} esFtl_ScrubStats;
+
+void esFtl_ResetScrub(void);
+int esFtl_ScrubStep(uint16_t pages);
+void esFtl_ScrubDrop(uint16_t sno);
+void esFtl_ControlPageCorruptions(void);
+void esFtl_GetScrubStats(esFtl_ScrubStats *stats);
+
+#endif
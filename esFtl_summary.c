@@ -0,0 +1,186 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "esFtl_definitions.h"
+#include "esFtl_disk.h"
+#include "esFtl_write.h"
+#include "esFtl_checksum.h"
+#include "esFtl_summary.h"
+#include "esFtl_blocks.h"
+
+#if !ESFTL_HYBRIDMAPPING
+
+/*
+ * The summaries of the blocks being filled, one for the host writes and one
+ * for the moved pages, are collected in RAM while their pages are written.
+ * Pages written before a mount are not known, their spares are read when the
+ * summary is written.
+ */
+#define SUMMARYMAGIC 0x53424645
+#define SUMMARYCRCOFFSET (sizeof(uint32_t) + 2 * sizeof(uint16_t))
+
+static esFtl_BlockSummary openSummary[2];
+static uint64_t openSummaryKnown[2];
+
+static int SelectBlock(uint16_t block);
+static uint16_t SummaryCrc(esFtl_BlockSummary *summary);
+
+/*
+ * @brief forget the collected entries, the block being filled is read back from the flash when it is closed
+ *
+ */
+void esFtl_ResetBlockSummary(void)
+{
+    memset(openSummary, 0xFF, sizeof(openSummary));
+    memset(openSummaryKnown, 0, sizeof(openSummaryKnown));
+}
+
+/*
+ * @brief note a written page in the summary of its block
+ *
+ * @param pno
+ * @param sno 0xFFFF if the page failed to be written
+ * @param crc
+ */
+void esFtl_SummaryAddPage(uint16_t pno, uint16_t sno, uint16_t crc)
+{
+    uint16_t i = pno % ESFTL_NANDNUMPAGEBLOCK;
+    int open = 0;
+
+    if (esFtl_IsSummaryPage(pno))
+        return;
+
+    open = SelectBlock(pno / ESFTL_NANDNUMPAGEBLOCK);
+
+    openSummary[open].sno[i] = sno;
+    openSummary[open].pageCrc[i] = crc;
+    openSummary[open].released[i] = 0xFF;
+    openSummaryKnown[open] |= (uint64_t)1 << i;
+}
+
+/*
+ * @brief note the release mark of a page of the block being filled
+ *
+ * @param pno
+ */
+void esFtl_SummaryReleasePage(uint16_t pno)
+{
+    uint16_t i = pno % ESFTL_NANDNUMPAGEBLOCK;
+    int open = 0;
+
+    for (open = 0; open < 2; open++)
+    {
+        if (openSummary[open].block == pno / ESFTL_NANDNUMPAGEBLOCK && !esFtl_IsSummaryPage(pno))
+            openSummary[open].released[i] = 0xF0;
+    }
+}
+
+/*
+ * @brief ask whether the page is reserved for the summary of its block
+ *
+ * @param pno
+ * @return 1 if it is the last page of the block
+ */
+int esFtl_IsSummaryPage(uint16_t pno)
+{
+    return pno % ESFTL_NANDNUMPAGEBLOCK == ESFTL_NANDNUMPAGEBLOCK - 1;
+}
+
+/*
+ * @brief write the summary of a filled block to its last page
+ *
+ * @param pno the last page of the block
+ * @return 0 if it is successful
+ */
+int esFtl_WriteBlockSummary(uint16_t pno)
+{
+    uint8_t buff[ESFTL_PAGEBUFFSIZE];
+    uint8_t spare[5];
+    uint16_t block = pno / ESFTL_NANDNUMPAGEBLOCK, sno = ESFTL_SUMMARYSNO, crc = 0;
+    esFtl_BlockSummary *summary = &openSummary[SelectBlock(block)];
+    uint64_t known = openSummaryKnown[summary - openSummary];
+    int i = 0;
+
+    for (i = 0; i < ESFTL_SUMMARYENTRIES; i++)
+    {
+        if (known & ((uint64_t)1 << i))
+            continue;
+
+        if (esFtl_NandFlashRead(block * ESFTL_NANDNUMPAGEBLOCK + i, ESFTL_SPAREOFFSET, spare, sizeof(spare)))
+            memset(spare, 0xFF, sizeof(spare));
+
+        memcpy(&summary->sno[i], &spare[0], 2);
+        memcpy(&summary->pageCrc[i], &spare[2], 2);
+        summary->released[i] = spare[4];
+    }
+
+    summary->magic = SUMMARYMAGIC;
+    summary->crc = SummaryCrc(summary);
+
+    memset(buff, 0xFF, sizeof(buff));
+    memcpy(buff, summary, sizeof(esFtl_BlockSummary));
+    crc = esFtl_CalcChecksum(buff, ESFTL_NANDPAGEDATASIZE);
+    memcpy(&buff[ESFTL_SPAREOFFSET], &sno, 2);
+    memcpy(&buff[ESFTL_SPAREOFFSET + 2], &crc, 2);
+
+    return esFtl_NandFlashWrite(pno, 0, buff, sizeof(buff)) ? -1 : 0;
+}
+
+/*
+ * @brief read the summary of a block, a block which is not filled or was
+ * written by an older version has none
+ *
+ * @param block
+ * @param summary
+ * @return 0 if a valid summary is found
+ */
+int esFtl_ReadBlockSummary(uint16_t block, esFtl_BlockSummary *summary)
+{
+    if (esFtl_NandFlashRead(block * ESFTL_NANDNUMPAGEBLOCK + ESFTL_NANDNUMPAGEBLOCK - 1, 0, (uint8_t *)summary, sizeof(esFtl_BlockSummary)))
+        return -1;
+
+    if (summary->magic != SUMMARYMAGIC || summary->block != block || summary->crc != SummaryCrc(summary))
+        return -1;
+
+    return 0;
+}
+
+/*
+ * @brief find the summary collected for the block, the one of its frontier is started again for a new block
+ *
+ * @param block
+ * @return index of the summary
+ */
+static int SelectBlock(uint16_t block)
+{
+    int open = esFtl_IsColdBlock(block);
+
+    if (openSummary[open].block == block && openSummaryKnown[open])
+        return open;
+
+    memset(&openSummary[open], 0xFF, sizeof(esFtl_BlockSummary));
+    openSummary[open].block = block;
+    openSummaryKnown[open] = 0;
+    return open;
+}
+
+static uint16_t SummaryCrc(esFtl_BlockSummary *summary)
+{
+    return esFtl_CalcChecksum((uint8_t *)summary + SUMMARYCRCOFFSET, sizeof(esFtl_BlockSummary) - SUMMARYCRCOFFSET);
+}
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef ESFTL_SUMMARY_H__
+#define ESFTL_SUMMARY_H__
+
+#define ESFTL_SUMMARYSNO 0xFFFE /* sector number of the summary page in its spare */
+#define ESFTL_SUMMARYENTRIES (ESFTL_NANDNUMPAGEBLOCK - 1)
+
+/*
+ * The last page of every filled log block holds the sector number, the crc
+ * and the release state of the other pages of the block, so a scanner reads
+ * one page instead of the spare of each page.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint16_t block;
+    uint16_t crc;
+    uint16_t sno[ESFTL_SUMMARYENTRIES];
+    uint16_t pageCrc[ESFTL_SUMMARYENTRIES];
+    uint8_t released[ESFTL_SUMMARYENTRIES];
+} esFtl_BlockSummary;
+
+void esFtl_ResetBlockSummary(void);
+void esFtl_SummaryAddPage(uint16_t pno, uint16_t sno, uint16_t crc);
+void esFtl_SummaryReleasePage(uint16_t pno);
+int esFtl_IsSummaryPage(uint16_t pno);
+int esFtl_WriteBlockSummary(uint16_t pno);
+int esFtl_ReadBlockSummary(uint16_t block, esFtl_BlockSummary *summary);
+
+#endif
\ No newline at end of file
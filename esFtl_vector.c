@@ -0,0 +1,177 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "esFtl_definitions.h"
+#include "esFtl_disk.h"
+#include "esFtl_cache.h"
+#include "esFtl_read.h"
+#include "esFtl_write.h"
+#include "esFtl_buffer.h"
+#include "esFtl_readcache.h"
+#include "esFtl_vector.h"
+
+/*
+ * Multi-sector requests of a file system are served as runs of consecutive
+ * sectors. The pages of a run are looked up with one access to each of
+ * their translation pages and written one after the other, the bookkeeping
+ * every single write does is done once per run, see esFtl_WriteRun.
+ */
+#define RUNSECTORS 64 /* sectors looked up at once by a read */
+
+static int ReadRun(uint16_t sno, uint8_t *buffer, uint16_t count);
+
+/*
+ * @brief read consecutive sectors
+ *
+ * @param sno
+ * @param buffer room for count sectors of ESFTL_NANDPAGEDATASIZE bytes
+ * @param count
+ * @return -1 if a sector is not assigned or can not be read, it is filled with 0xFF
+ */
+int esFtl_ReadSectors(uint16_t sno, uint8_t *buffer, uint16_t count)
+{
+    return ReadRun(sno, buffer, count);
+}
+
+/*
+ * @brief write consecutive sectors, they are written as whole sectors
+ *
+ * @param sno
+ * @param buffer count sectors of ESFTL_NANDPAGEDATASIZE bytes
+ * @param count
+ * @return 0 if it is successful
+ */
+int esFtl_WriteSectors(uint16_t sno, const uint8_t *buffer, uint16_t count)
+{
+    uint16_t i = 0;
+
+#if ESFTL_WRITEBUFFERSECTORS
+    /* the held copies are overwritten as a whole, the run does not go through the buffer */
+    for (i = 0; i < count; i++)
+        esFtl_BufferDrop(sno + i);
+#endif
+    (void)i;
+
+    return esFtl_WriteRun(sno, buffer, count);
+}
+
+/*
+ * @brief read the runs of sectors given by the segments
+ *
+ * @param segments
+ * @param numSegments
+ * @return -1 if a sector is not assigned or can not be read
+ */
+int esFtl_ReadSegments(const esFtl_Segment *segments, uint16_t numSegments)
+{
+    uint16_t i = 0;
+    int rv = 0;
+
+    for (i = 0; i < numSegments; i++)
+    {
+        if (ReadRun(segments[i].sno, segments[i].buffer, segments[i].count))
+            rv = -1;
+    }
+
+    return rv;
+}
+
+/*
+ * @brief write the runs of sectors given by the segments, the writing stops at the first failure
+ *
+ * @param segments
+ * @param numSegments
+ * @return 0 if it is successful
+ */
+int esFtl_WriteSegments(const esFtl_Segment *segments, uint16_t numSegments)
+{
+    uint16_t i = 0;
+
+    for (i = 0; i < numSegments; i++)
+    {
+        if (esFtl_WriteSectors(segments[i].sno, segments[i].buffer, segments[i].count))
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * @brief look up the pages of RUNSECTORS sectors at once and read them, the
+ * sectors whose pages follow each other are streamed with one cache read
+ *
+ * @param sno
+ * @param buffer
+ * @param count
+ * @return -1 if a sector is not assigned or can not be read
+ */
+static int ReadRun(uint16_t sno, uint8_t *buffer, uint16_t count)
+{
+    uint16_t pages[RUNSECTORS];
+    uint16_t i = 0, j = 0, k = 0, n = 0;
+    uint8_t *sector;
+    int rv = 0;
+
+    if ((uint32_t)sno + 1 + count > ESFTL_MAPSNOBASE)
+        return -1;
+
+    for (i = 0; i < count; i += n)
+    {
+        n = (count - i > RUNSECTORS) ? RUNSECTORS : count - i;
+        esFtl_FindSectorPages(sno + 1 + i, n, pages);
+
+        for (j = 0; j < n; j = k)
+        {
+            sector = &buffer[(uint32_t)(i + j) * ESFTL_NANDPAGEDATASIZE];
+            k = j + 1;
+
+#if ESFTL_WRITEBUFFERSECTORS
+            if (!esFtl_BufferRead(sno + i + j, sector, 0, ESFTL_NANDPAGEDATASIZE))
+                continue;
+#endif
+#if ESFTL_READCACHESECTORS
+            /* a run is not taken into the cache, it would push the hot sectors out */
+            if (!esFtl_ReadCacheGet(sno + i + j, sector, 0, ESFTL_NANDPAGEDATASIZE))
+                continue;
+#endif
+
+            if (pages[j] == 0xFFFF)
+            {
+                memset(sector, 0xFF, ESFTL_NANDPAGEDATASIZE);
+                rv = -1;
+                continue;
+            }
+
+            while (k < n && pages[k] == pages[j] + (k - j))
+                k++;
+
+            if (esFtl_ReadPages(pages[j], k - j, sector))
+            {
+                ESFTL_LOG("esFTL: FATAL ERROR:%d %s %d\n", pages[j], __FILE__, __LINE__);
+                rv = -1;
+            }
+
+#if ESFTL_WRITEBUFFERSECTORS
+            /* a sector of the stream which is held in the write buffer is newer than its page */
+            for (j = j + 1; j < k; j++)
+                esFtl_BufferRead(sno + i + j, &buffer[(uint32_t)(i + j) * ESFTL_NANDPAGEDATASIZE], 0, ESFTL_NANDPAGEDATASIZE);
+#endif
+        }
+    }
+
+    return rv;
+}
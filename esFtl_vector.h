@@ -0,0 +1,34 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef ESFTL_VECTOR_H__
+#define ESFTL_VECTOR_H__
+
+typedef struct
+{
+    uint16_t sno;
+    uint16_t count;
+    uint8_t *buffer; /* count sectors of ESFTL_NANDPAGEDATASIZE bytes */
+} esFtl_Segment;
+
+int esFtl_ReadSectors(uint16_t sno, uint8_t *buffer, uint16_t count);
+int esFtl_WriteSectors(uint16_t sno, const uint8_t *buffer, uint16_t count);
+int esFtl_ReleaseSectors(uint16_t sno, uint16_t count);
+int esFtl_ReadSegments(const esFtl_Segment *segments, uint16_t numSegments);
+int esFtl_WriteSegments(const esFtl_Segment *segments, uint16_t numSegments);
+
+#endif
@@ -21,57 +21,289 @@
 #include "esFtl_defragment.h"
 #include "esFtl_bbm.h"
 #include "esFtl_write.h"
+#include "esFtl_summary.h"
+#include "esFtl_blocks.h"
+#include "esFtl_buffer.h"
+#include "esFtl_vector.h"
+#include "esFtl_checksum.h"
+#include "esFtl_readcache.h"
+#include "esFtl_readahead.h"
+#include "esFtl_scrub.h"
 
-static int CheckIfDefragmentNeeded(void);
+#if !ESFTL_HYBRIDMAPPING
+
+#define BATCHPAGES ESFTL_NANDNUMPAGEBLOCK /* pages of a run written between two looks at the free space and the checkpoint */
+
+static uint8_t batchBuff[ESFTL_PAGEBUFFSIZE];
+
+static int CommitPage(uint16_t sno, int pno);
+static void AfterWrites(uint16_t pages);
+static void ReleaseSector(uint16_t sno, uint8_t defer);
+static int AppendPage(uint16_t sno, uint8_t *buffer, uint16_t crc, uint8_t cold);
+static int NextFreePage(uint8_t cold, int keep);
+static int KeepBlocks(uint16_t sno, uint8_t cold);
 
 /*
- * @brief read the sector data to a page
+ * @brief write the sector data, with a write buffer only the bytes from idx
+ * are taken and the sector is written to a page later
  *
  * @param sno
  * @param buffer
  * @param idx
  * @param count
- * @return 0
+ * @return 0 if it is successful
  */
 int esFtl_FtlDriverWrite(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count)
 {
-    uint16_t crc;
+    if (sno >= ESFTL_MAXSECTORS)
+        return -1;
+
+#if ESFTL_WRITEBUFFERSECTORS
+    return esFtl_BufferWrite(sno, buffer, idx, count);
+#else
+    return esFtl_WriteSector(sno, buffer);
+#endif
+}
+
+/*
+ * @brief write the whole sector data to a page
+ *
+ * @param sno
+ * @param buffer page data, followed by room for the spare bytes
+ * @return 0 if it is successful
+ */
+int esFtl_WriteSector(uint16_t sno, uint8_t *buffer)
+{
+    int pno = 0;
 
     sno++;
 
-    crc = esFtl_CalcCrc16(0xFFFF, (unsigned char *)buffer, ESFTL_NANDPAGEDATASIZE);
+    if (sno > ESFTL_MAXSECTORS)
+        return -1;
 
-    memcpy(&buffer[ESFTL_NANDPAGEDATASIZE], &sno, 2);
-    memcpy(&buffer[ESFTL_NANDPAGEDATASIZE + 2], &crc, 2);
+#if ESFTL_READCACHESECTORS
+    esFtl_ReadCacheDrop(sno - 1);
+#endif
+#if ESFTL_READAHEADSECTORS
+    esFtl_ReadAheadDrop(sno - 1);
+#endif
+    esFtl_ScrubDrop(sno - 1);
 
-    while (1)
+    if (esFtl_PrepareSectorCache(sno))
+        return -1;
+
+    pno = esFtl_WritePage(sno, buffer);
+    if (pno < 0)
+        return -1;
+
+    return CommitPage(sno, pno);
+}
+
+/*
+ * @brief write consecutive sectors, the pages follow each other on the flash
+ * and the free space, the defragment and the checkpoint are looked after once
+ * per BATCHPAGES pages
+ *
+ * @param sno
+ * @param buffer count sectors of ESFTL_NANDPAGEDATASIZE bytes
+ * @param count
+ * @return 0 if it is successful
+ */
+int esFtl_WriteRun(uint16_t sno, const uint8_t *buffer, uint16_t count)
+{
+    uint16_t i = 0, n = 0;
+    int pno = 0;
+
+    sno++;
+
+    if ((uint32_t)sno - 1 + count > ESFTL_MAXSECTORS)
+        return -1;
+
+    for (n = 0; i < count; i++)
     {
-        if (esFtl_CheckIfPageInBadBlock(cursorEnd))
+        /* the spare bytes are put after the data, the caller's buffer has no room for them */
+        memcpy(batchBuff, &buffer[i * ESFTL_NANDPAGEDATASIZE], ESFTL_NANDPAGEDATASIZE);
+#if ESFTL_READCACHESECTORS
+        esFtl_ReadCacheDrop(sno + i - 1);
+#endif
+#if ESFTL_READAHEADSECTORS
+        esFtl_ReadAheadDrop(sno + i - 1);
+#endif
+        esFtl_ScrubDrop(sno + i - 1);
+
+        if (esFtl_PrepareSectorCache(sno + i))
+            break;
+
+        pno = AppendPage(sno + i, batchBuff, esFtl_CalcChecksum(batchBuff, ESFTL_NANDPAGEDATASIZE), 0);
+        if (pno < 0)
+            break;
+
+        if (esFtl_SetSectorCache(sno + i, pno))
+            break;
+        if (lastOpSectorNo < sno + i)
+            lastOpSectorNo = sno + i;
+
+        if (++n == BATCHPAGES)
         {
-            esFtl_IncrementCursorEnd();
-            continue;
+            AfterWrites(n);
+            n = 0;
         }
+    }
+
+    if (n)
+        AfterWrites(n);
 
-        if (esFtl_NandFlashWrite(cursorEnd, 0, buffer, ESFTL_NANDPAGEDATASIZE + 4))
+    return (i < count) ? -1 : 0;
+}
+
+/*
+ * @brief move a sector to the cold frontier, inside the chip if it can copy
+ * the page, the data then does not cross the bus. The stored crc is kept either way
+ *
+ * @param sno
+ * @param from page holding the current copy of the sector
+ * @param crc stored crc of the sector
+ * @return 0 if it is successful
+ */
+int esFtl_FtlDriverMove(uint16_t sno, uint16_t from, uint16_t crc)
+{
+    uint8_t buffer[ESFTL_NANDPAGESIZE + 1];
+    int pno = -1;
+
+    sno++;
+
+    if (sno >= ESFTL_MAPSNOBASE)
+        return -1;
+
+    if (esFtl_PrepareSectorCache(sno))
+        return -1;
+
+#if ESFTL_NANDCOPYBACK
+    pno = esFtl_CopyPage(sno, from, crc);
+#endif
+    if (pno < 0)
+    {
+        if (esFtl_NandFlashRead(from, 0, buffer, ESFTL_NANDPAGEDATASIZE))
+            return -1;
+
+        /* the stored crc goes with the data, a corrupted sector stays detectable */
+        pno = AppendPage(sno, buffer, crc, 1);
+        if (pno < 0)
+            return -1;
+    }
+
+    return CommitPage(sno, pno);
+}
+
+/*
+ * @brief append a page to the end of the log, the spare data is put after the
+ * page data so the buffer must hold ESFTL_PAGEBUFFSIZE bytes
+ *
+ * @param sno
+ * @param buffer
+ * @return page number which the data is written to, -1 if the device is full
+ */
+int esFtl_WritePage(uint16_t sno, uint8_t *buffer)
+{
+    return AppendPage(sno, buffer, esFtl_CalcChecksum(buffer, ESFTL_NANDPAGEDATASIZE), 0);
+}
+
+/*
+ * @brief append a page to the host or to the cold frontier
+ *
+ * @param sno
+ * @param buffer
+ * @param crc checksum of the page data
+ * @param cold 1 for a page moved by the defragment
+ * @return page number which the data is written to, -1 if the device is full
+ */
+static int AppendPage(uint16_t sno, uint8_t *buffer, uint16_t crc, uint8_t cold)
+{
+    int *cursor = cold ? &cursorCold : &cursorEnd;
+    int pno = 0;
+
+    buffer[ESFTL_NANDPAGEDATASIZE] = 0xFF;
+    memcpy(&buffer[ESFTL_SPAREOFFSET], &sno, 2);
+    memcpy(&buffer[ESFTL_SPAREOFFSET + 2], &crc, 2);
+
+    while (1)
+    {
+        if (NextFreePage(cold, KeepBlocks(sno, cold)))
+            return -1;
+
+        if (esFtl_NandFlashWrite(*cursor, 0, buffer, ESFTL_PAGEBUFFSIZE))
         {
-            esFtl_IncrementCursorEnd();
+            esFtl_FailBlock(*cursor / ESFTL_NANDNUMPAGEBLOCK);
+            esFtl_SummaryAddPage(*cursor, 0xFFFF, 0);
+            esFtl_IncrementCursor(cold);
 
-            ESFTL_LOG("esFtl: FATAL ERROR:%d %s %d\n", cursorEnd, __FILE__, __LINE__);
+            ESFTL_LOG("esFtl: FATAL ERROR:%d %s %d\n", *cursor, __FILE__, __LINE__);
         }
         else
         {
-            esFtl_SetSectorCache(sno, cursorEnd);
-            esFtl_IncrementCursorEnd();
+            pno = *cursor;
+            esFtl_SummaryAddPage(*cursor, sno, crc);
+            esFtl_IncrementCursor(cold);
+            break;
+        }
+    }
+
+    return pno;
+}
+
+#if ESFTL_NANDCOPYBACK
+/*
+ * @brief append a copy of a page to the cold frontier, the spare area is
+ * written again for the new page
+ *
+ * @param sno
+ * @param from
+ * @param crc
+ * @return page number which the data is copied to, -1 if it is not copied
+ */
+int esFtl_CopyPage(uint16_t sno, uint16_t from, uint16_t crc)
+{
+    uint8_t spare[8];
+    int pno = 0, rv = 0;
+
+    /* the release mark and the block sequence bytes of a first page are not copied from the source */
+    memset(spare, 0xFF, sizeof(spare));
+    memcpy(&spare[0], &sno, 2);
+    memcpy(&spare[2], &crc, 2);
+
+    while (1)
+    {
+        if (NextFreePage(1, KeepBlocks(sno, 1)))
+            return -1;
+
+        /* the first page of a block already holds the block tag, the copied spare area would not match it */
+        if (!(cursorCold % ESFTL_NANDNUMPAGEBLOCK))
+            return -1;
+
+        rv = esFtl_NandFlashCopyPage(from, cursorCold, ESFTL_SPAREOFFSET, spare, sizeof(spare));
+        if (rv == ESFTL_NANDCOPYUNSUPPORTED)
+            return -1;
+
+        if (rv)
+        {
+            esFtl_FailBlock(cursorCold / ESFTL_NANDNUMPAGEBLOCK);
+            esFtl_SummaryAddPage(cursorCold, 0xFFFF, 0);
+            esFtl_IncrementCursor(1);
 
-            if (lastOpSectorNo < sno)
-                lastOpSectorNo = sno;
+            ESFTL_LOG("esFtl: FATAL ERROR:%d %s %d\n", cursorCold, __FILE__, __LINE__);
+        }
+        else
+        {
+            pno = cursorCold;
+            esFtl_SummaryAddPage(cursorCold, sno, crc);
+            esFtl_IncrementCursor(1);
             break;
         }
     }
 
-    defragmentNeeded = CheckIfDefragmentNeeded();
-    return 0;
+    return pno;
 }
+#endif
 
 /*
  * @brief mark the page as released in order to get it return to the system
@@ -80,66 +312,190 @@ int esFtl_FtlDriverWrite(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t c
  * @return 0
  */
 int esFtl_FtlDriverRelease(uint16_t sno)
+{
+    if (sno + 1 >= ESFTL_MAPSNOBASE)
+        return -1;
+
+    ReleaseSector(sno + 1, 0);
+    return 0;
+}
+
+/*
+ * @brief release consecutive sectors, a translation page which has to be
+ * written for the releases is written once after all of them
+ *
+ * @param sno
+ * @param count
+ * @return 0
+ */
+int esFtl_ReleaseSectors(uint16_t sno, uint16_t count)
+{
+    uint16_t i = 0;
+
+    if ((uint32_t)sno + 1 + count > ESFTL_MAPSNOBASE)
+        return -1;
+
+    for (i = 0; i < count; i++)
+        ReleaseSector(sno + 1 + i, 1);
+
+    if (esFtl_FlushWantedMapPages())
+        ESFTL_LOG("esFtl: FATAL ERROR:%d %s %d\n", sno, __FILE__, __LINE__);
+
+    return 0;
+}
+
+/*
+ * @brief remove the sector from the map and mark its page as released
+ *
+ * @param sno
+ * @param defer 1 if the translation page is written after the batch
+ */
+static void ReleaseSector(uint16_t sno, uint8_t defer)
 {
     int pno = 0;
     uint8_t markedAsReleasedByte = 0xF0;
 
-    sno++;
+#if ESFTL_WRITEBUFFERSECTORS
+    esFtl_BufferDrop(sno - 1);
+#endif
+#if ESFTL_READCACHESECTORS
+    esFtl_ReadCacheDrop(sno - 1);
+#endif
+#if ESFTL_READAHEADSECTORS
+    esFtl_ReadAheadDrop(sno - 1);
+#endif
+    esFtl_ScrubDrop(sno - 1);
 
     pno = esFtl_FindSectorPage(sno);
     if (pno >= 0)
     {
-        if (esFtl_NandFlashWrite(pno, ESFTL_NANDPAGEDATASIZE + 4, &markedAsReleasedByte, 1))
+        if (esFtl_ReleaseSectorCache(sno, pno, defer))
+        {
+            ESFTL_LOG("esFtl: FATAL ERROR:%d %s %d\n", pno, __FILE__, __LINE__);
+        }
+        else if (esFtl_NandFlashWrite(pno, ESFTL_SPAREOFFSET + 4, &markedAsReleasedByte, 1))
         {
             ESFTL_LOG("esFtl: FATAL ERROR:%d %s %d\n", pno, __FILE__, __LINE__);
         }
         else
         {
-            esFtl_SetSectorCache(sno, 0xFFFF);
+            esFtl_SummaryReleasePage(pno);
         }
     }
     else
     {
         ESFTL_LOG("FtlDriverRelease %d not found\n", sno);
     }
+}
+
+/*
+ * @brief map the sector to its new page and do what follows every write
+ *
+ * @param sno
+ * @param pno
+ * @return 0 if it is successful, -1 if the sector can not be mapped
+ */
+static int CommitPage(uint16_t sno, int pno)
+{
+    if (esFtl_SetSectorCache(sno, pno))
+        return -1;
+
+    if (lastOpSectorNo < sno)
+        lastOpSectorNo = sno;
 
+    AfterWrites(1);
     return 0;
 }
 
 /*
- * @brief calculate crc
+ * @brief look at the free space and the checkpoint after some pages are written
  *
- * @param crc
- * @param data_p
- * @param length
- * @return value of the crc
+ * @param pages
  */
-uint16_t esFtl_CalcCrc16(uint16_t crc, uint8_t *data_p, uint32_t length)
+static void AfterWrites(uint16_t pages)
 {
-    uint8_t x;
+    defragmentNeeded = esFtl_CheckIfDefragmentNeeded();
+    esFtl_CheckpointIfDue();
 
-    while (length--)
+    /* below the hard limit the writes pay for the defragment the idle hook did not do, a step per page, the erases are left to it */
+    while (pages-- && esFtl_NumFreeBlocks() < ESFTL_DEFRAGHARDLIMIT)
     {
-        x = crc >> 8 ^ *data_p++;
-        x ^= x >> 4;
-        crc = (crc << 8) ^ ((uint16_t)(x << 12)) ^ ((uint16_t)(x << 5)) ^ ((uint16_t)x);
+        if (!esFtl_DefragStep(ESFTL_DEFRAGSTEPPAGES, 0))
+            break;
     }
-    return crc;
+
+    /* the released blocks are free after a checkpoint, the host should not fail while they wait for the next one */
+    if (!esFtl_HasFreeBlock(ESFTL_RESERVEBLOCKS) && esFtl_NumReleasedBlocks())
+        esFtl_Checkpoint(0);
 }
 
 /*
- * @brief check if the system reaches the limit for the defragmentation
+ * @brief count the free blocks a page may not take: the host pages leave the
+ * reserve to the defragment and the translation pages, the moved pages leave
+ * the last block to the translation pages, so an evicted one can always be written
  *
- * @return 1 if it is true
+ * @param sno
+ * @param cold 1 for a page moved by the defragment
+ * @return free blocks which have to be left
  */
-static int CheckIfDefragmentNeeded(void)
+static int KeepBlocks(uint16_t sno, uint8_t cold)
 {
-    int freePages = esFtl_CalcFreePages();
+    if (esFtl_IsMapSector(sno))
+        return 0;
+
+    return cold ? 1 : ESFTL_RESERVEBLOCKS;
+}
 
-    if (freePages < ESFTL_FREEBLOCKLIMITFORDEFRAGMENT * ESFTL_NANDNUMPAGEBLOCK)
+/*
+ * @brief move the cursor of a frontier over bad blocks and write the summary when it reaches the last page of a block
+ *
+ * @param cold 1 for the cold frontier, it is opened by its first page
+ * @param keep free blocks the frontier may not take, see KeepBlocks
+ * @return 0 if the cursor is a page which can be programmed, -1 if the device is full
+ */
+static int NextFreePage(uint8_t cold, int keep)
+{
+    int *cursor = cold ? &cursorCold : &cursorEnd;
+    int block = 0;
+
+    if (*cursor < 0)
     {
-        return 1;
+        block = esFtl_AllocateBlock(1);
+        if (block < 0)
+            return -1;
+        *cursor = block * ESFTL_NANDNUMPAGEBLOCK;
     }
 
-    return 0;
+    while (1)
+    {
+        if (esFtl_CheckIfPageInBadBlock(*cursor))
+        {
+            esFtl_IncrementCursor(cold);
+            continue;
+        }
+
+        /* a block which failed a program gets no more pages, it is closed by its summary */
+        if (esFtl_IsFailedBlock(*cursor / ESFTL_NANDNUMPAGEBLOCK) && !esFtl_IsSummaryPage(*cursor))
+        {
+            *cursor += ESFTL_NANDNUMPAGEBLOCK - 1 - *cursor % ESFTL_NANDNUMPAGEBLOCK;
+            continue;
+        }
+
+        if (esFtl_IsSummaryPage(*cursor))
+        {
+            /* the block is full, the frontier can not go on without a free block */
+            if (!esFtl_HasFreeBlock(keep))
+                return -1;
+
+            if (esFtl_WriteBlockSummary(*cursor))
+                ESFTL_LOG("esFtl: FATAL ERROR:%d %s %d\n", *cursor, __FILE__, __LINE__);
+
+            esFtl_IncrementCursor(cold);
+            continue;
+        }
+
+        return 0;
+    }
 }
+
+#endif
@@ -20,6 +20,12 @@
 
 int esFtl_FtlDriverWrite(uint16_t sno, uint8_t *buffer, uint32_t idx, uint32_t count);
 int esFtl_FtlDriverRelease(uint16_t sno);
-uint16_t esFtl_CalcCrc16(uint16_t crc, uint8_t *data_p, uint32_t length);
+int esFtl_WriteSector(uint16_t sno, uint8_t *buffer);
+int esFtl_WriteRun(uint16_t sno, const uint8_t *buffer, uint16_t count);
+int esFtl_WritePage(uint16_t sno, uint8_t *buffer);
+int esFtl_FtlDriverMove(uint16_t sno, uint16_t from, uint16_t crc);
+#if ESFTL_NANDCOPYBACK
+int esFtl_CopyPage(uint16_t sno, uint16_t from, uint16_t crc);
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,423 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Micro-benchmarks of the FTL hot paths with a regression gate. Every result
+ * is printed as "name metric value" and compared with the same line of the
+ * baseline file, the run fails when a value grew beyond the threshold. Flash
+ * operation counts and simulated time are deterministic and gated tightly,
+ * wall clock numbers depend on the host and are gated loosely; refresh them
+ * with --update on the machine which runs the gate.
+ *
+ *   cc -O2 -o microbench microbench.c esFtl_bbm.c esFtl_cache.c esFtl_defragment.c \
+ *      esFtl_init.c esFtl_read.c esFtl_write.c esFtl_disk_simulator.c esFtl_hybrid.c esFtl_checkpoint.c esFtl_summary.c esFtl_blocks.c esFtl_buffer.c esFtl_vector.c esFtl_checksum.c esFtl_readcache.c esFtl_readahead.c esFtl_scrub.c
+ *   ./microbench [--baseline FILE] [--update] [--threshold 0.05] [--wall-threshold 0.5]
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "esFtl.h"
+#include "esFtl_bbm.h"
+#include "esFtl_cache.h"
+#include "esFtl_disk_simulator.h"
+
+#define MICRO_MAXRESULTS 64
+#define MICRO_CACHEDSPAN (ESFTL_MAPCACHEPAGES * ESFTL_MAPENTRIESPERPAGE - 1) /* sector n is kept as n + 1 */
+#define MICRO_HIGHSECTOR 4096
+#define MICRO_HIGHSECTORS 32
+#define MICRO_SCRUBSTEPS 64
+#define MICRO_WALLREPEAT 5
+
+typedef struct
+{
+    char name[48];
+    char metric[24];
+    double value;
+} MicroResult;
+
+static MicroResult results[MICRO_MAXRESULTS];
+static int numResults = 0;
+static uint8_t pageBuff[ESFTL_NANDPAGESIZE];
+static esFtl_SimStats statsStart;
+static uint64_t simStart = 0;
+static double wallStart = 0;
+
+static void Report(const char *name, const char *metric, double value);
+static void StartMeasure(void);
+static void StopMeasure(const char *name, uint32_t ops, int wall);
+static double WallTime(void);
+static void PrepareFullDevice(void);
+static void BenchCrc(void);
+static void BenchBadBlockTable(void);
+static uint16_t ReferenceCrc16(uint16_t crc, const uint8_t *data, uint32_t length);
+static void BenchFindSectorPage(void);
+static void BenchFlashScans(void);
+static void BenchMount(void);
+static int CompareWithBaseline(const char *path, double threshold, double wallThreshold);
+static int WriteBaseline(const char *path);
+
+int main(int argc, char **argv)
+{
+    const char *baseline = "microbench_baseline.txt";
+    double threshold = 0.05, wallThreshold = 0.5;
+    int update = 0, i = 0;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--update"))
+            update = 1;
+        else if (!strcmp(argv[i], "--baseline") && i + 1 < argc)
+            baseline = argv[++i];
+        else if (!strcmp(argv[i], "--threshold") && i + 1 < argc)
+            threshold = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--wall-threshold") && i + 1 < argc)
+            wallThreshold = atof(argv[++i]);
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    BenchCrc();
+    BenchBadBlockTable();
+    PrepareFullDevice();
+    BenchFindSectorPage();
+    BenchFlashScans();
+    BenchMount();
+    esFtl_SimClose();
+
+    for (i = 0; i < numResults; i++)
+        printf("%s %s %.3f\n", results[i].name, results[i].metric, results[i].value);
+
+    if (update)
+        return WriteBaseline(baseline);
+
+    return CompareWithBaseline(baseline, threshold, wallThreshold);
+}
+
+/*
+ * @brief crc of one page data area, the table driven crc is checked against
+ * the bitwise one for every length and alignment first
+ *
+ */
+static void BenchCrc(void)
+{
+    volatile uint16_t sink = 0;
+    double best = 0, t = 0;
+    int rep = 0, i = 0, mismatches = 0;
+
+    for (i = 0; i < ESFTL_NANDPAGEDATASIZE; i++)
+        pageBuff[i] = (uint8_t)(i * 31 + 7);
+
+    for (i = 0; i <= ESFTL_NANDPAGEDATASIZE - 3; i++)
+    {
+        if (esFtl_CalcCrc16(0xFFFF, &pageBuff[i % 4], i) != ReferenceCrc16(0xFFFF, &pageBuff[i % 4], i))
+            mismatches++;
+    }
+    Report("crc16_mismatches", "count", mismatches);
+
+    for (rep = 0; rep < MICRO_WALLREPEAT; rep++)
+    {
+        t = WallTime();
+        for (i = 0; i < 20000; i++)
+            sink ^= esFtl_CalcCrc16(0xFFFF, pageBuff, ESFTL_NANDPAGEDATASIZE);
+        t = (WallTime() - t) * 1e9 / 20000;
+        if (rep == 0 || t < best)
+            best = t;
+    }
+
+    (void)sink;
+    Report("crc16_2048", "wall_ns", best);
+}
+
+/*
+ * @brief blocks with a factory marker must be in the table after a format and after
+ * a mount which rebuilds the lost table of a written device, no other block may be
+ *
+ */
+static void BenchBadBlockTable(void)
+{
+    static const uint16_t marked[] = {3, 100, 517};
+    esFtl_SimConfig cfg;
+    int wrong = 0, pass = 0, i = 0;
+    uint32_t block = 0;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.factoryBadBlocks = marked;
+    cfg.numFactoryBadBlocks = sizeof(marked) / sizeof(marked[0]);
+    esFtl_SimConfigure(&cfg);
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        if (pass == 0)
+            esFtl_Init(1);
+        else
+        {
+            for (i = 0; i < MICRO_HIGHSECTORS * 8; i++)
+            {
+                memset(pageBuff, (uint8_t)i, ESFTL_NANDPAGEDATASIZE);
+                esFtl_FtlDriverWrite(i, pageBuff, 0, ESFTL_NANDPAGEDATASIZE);
+            }
+            esFtl_Shutdown();
+
+            for (i = 0; i < ESFTL_BBTBLOCKS; i++)
+                esFtl_NandFlashBlockErase(ESFTL_BBTFIRSTBLOCK + i);
+            esFtl_Init(0);
+        }
+
+        for (block = 0; block < ESFTL_BBTFIRSTBLOCK; block++)
+        {
+            for (i = 0; i < (int)cfg.numFactoryBadBlocks && marked[i] != block; i++)
+                ;
+            if (!esFtl_IsBadBlock(block) != (i == (int)cfg.numFactoryBadBlocks))
+                wrong++; /* a marked block is good or an unmarked one is bad */
+        }
+    }
+
+    Report("bbt_factory_marker_errors", "count", wrong);
+}
+
+static uint16_t ReferenceCrc16(uint16_t crc, const uint8_t *data, uint32_t length)
+{
+    uint8_t x;
+
+    while (length--)
+    {
+        x = crc >> 8 ^ *data++;
+        x ^= x >> 4;
+        crc = (crc << 8) ^ ((uint16_t)(x << 12)) ^ ((uint16_t)(x << 5)) ^ ((uint16_t)x);
+    }
+    return crc;
+}
+
+/*
+ * @brief fill the log up to the defragment limit, a few sectors whose
+ * translation pages are not cached are written first
+ *
+ */
+static void PrepareFullDevice(void)
+{
+    esFtl_SimConfig cfg;
+    uint32_t i = 0;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.strict = 1;
+    esFtl_SimConfigure(&cfg);
+    esFtl_SimSetTiming(&esFtl_SimTimingMT29F1G01);
+    esFtl_Init(1);
+
+    for (i = 0; i < MICRO_HIGHSECTORS; i++)
+    {
+        memset(pageBuff, (uint8_t)i, ESFTL_NANDPAGEDATASIZE);
+        esFtl_FtlDriverWrite(MICRO_HIGHSECTOR + i * ESFTL_MAPENTRIESPERPAGE, pageBuff, 0, ESFTL_NANDPAGEDATASIZE);
+    }
+
+    for (i = 0; !esFtl_IsDefragNeeded(); i++)
+    {
+        memset(pageBuff, (uint8_t)i, ESFTL_NANDPAGEDATASIZE);
+        esFtl_FtlDriverWrite(i % MICRO_CACHEDSPAN, pageBuff, 0, ESFTL_NANDPAGEDATASIZE);
+    }
+}
+
+static void BenchFindSectorPage(void)
+{
+    volatile int sink = 0;
+    double best = 0, t = 0;
+    int rep = 0, i = 0;
+
+    StartMeasure();
+    for (i = 0; i < MICRO_CACHEDSPAN; i++)
+        sink += esFtl_FindSectorPage(i + 1);
+    StopMeasure("find_sector_cached", MICRO_CACHEDSPAN, 0);
+
+    for (rep = 0; rep < MICRO_WALLREPEAT; rep++)
+    {
+        t = WallTime();
+        for (i = 0; i < 1000000; i++)
+            sink += esFtl_FindSectorPage(i % MICRO_CACHEDSPAN + 1);
+        t = (WallTime() - t) * 1e9 / 1000000;
+        if (rep == 0 || t < best)
+            best = t;
+    }
+    Report("find_sector_cached", "wall_ns", best);
+
+    StartMeasure();
+    for (i = 0; i < MICRO_HIGHSECTORS; i++)
+        sink += esFtl_FindSectorPage(MICRO_HIGHSECTOR + i * ESFTL_MAPENTRIESPERPAGE + 1);
+    StopMeasure("find_sector_uncached", MICRO_HIGHSECTORS, 1);
+
+    (void)sink;
+}
+
+static void BenchFlashScans(void)
+{
+    uint32_t i = 0;
+
+    StartMeasure();
+    esFtl_EvaluateCursorAndCache();
+    StopMeasure("evaluate_full_device", 1, 1);
+
+    StartMeasure();
+    esFtl_ControlPageCorruptions();
+    StopMeasure("control_page_corruptions", 1, 1);
+
+    StartMeasure();
+    for (i = 0; i < MICRO_SCRUBSTEPS; i++)
+        esFtl_ScrubStep(ESFTL_SCRUBSTEPPAGES);
+    StopMeasure("scrub_step", MICRO_SCRUBSTEPS, 1);
+
+    StartMeasure();
+    esFtl_Defrag();
+    StopMeasure("defrag_pass", 1, 1);
+}
+
+/*
+ * @brief mount after a power loss with a journal of half a checkpoint interval, then after a clean
+ * shutdown, and the time until a lazy mount without checkpoint can serve requests
+ *
+ */
+static void BenchMount(void)
+{
+    uint32_t i = 0;
+
+    esFtl_Checkpoint(0);
+    for (i = 0; i < ESFTL_CHECKPOINTINTERVAL / 2; i++)
+    {
+        memset(pageBuff, (uint8_t)i, ESFTL_NANDPAGEDATASIZE);
+        esFtl_FtlDriverWrite(i % MICRO_CACHEDSPAN, pageBuff, 0, ESFTL_NANDPAGEDATASIZE);
+    }
+
+    StartMeasure();
+    esFtl_Init(0);
+    StopMeasure("mount_journal", 1, 1);
+
+    esFtl_Shutdown();
+    StartMeasure();
+    esFtl_Init(0);
+    StopMeasure("mount_clean", 1, 1);
+
+    StartMeasure();
+    esFtl_EvaluateCursorLazy();
+    StopMeasure("evaluate_lazy_frontier", 1, 1);
+    esFtl_FinishMount();
+}
+
+static void StartMeasure(void)
+{
+    esFtl_SimGetStats(&statsStart);
+    simStart = esFtl_SimGetTime();
+    wallStart = WallTime();
+}
+
+/*
+ * @brief report the flash operations, simulated and wall time per operation since StartMeasure
+ *
+ * @param name
+ * @param ops
+ * @param wall 0 if the wall time is measured separately
+ */
+static void StopMeasure(const char *name, uint32_t ops, int wall)
+{
+    esFtl_SimStats stats;
+    double elapsed = WallTime() - wallStart;
+
+    esFtl_SimGetStats(&stats);
+    Report(name, "nand_reads", (double)(stats.reads - statsStart.reads) / ops);
+    Report(name, "nand_programs", (double)(stats.programs - statsStart.programs) / ops);
+    Report(name, "nand_erases", (double)(stats.erases - statsStart.erases) / ops);
+    Report(name, "sim_ns", (double)(esFtl_SimGetTime() - simStart) / ops);
+    if (wall)
+        Report(name, "wall_ns", elapsed * 1e9 / ops);
+}
+
+static void Report(const char *name, const char *metric, double value)
+{
+    if (numResults >= MICRO_MAXRESULTS)
+        return;
+
+    snprintf(results[numResults].name, sizeof(results[numResults].name), "%s", name);
+    snprintf(results[numResults].metric, sizeof(results[numResults].metric), "%s", metric);
+    results[numResults].value = value;
+    numResults++;
+}
+
+/*
+ * @brief compare the results with the baseline file
+ *
+ * @param path
+ * @param threshold allowed growth of the deterministic metrics
+ * @param wallThreshold allowed growth of the wall clock metrics
+ * @return 0 if nothing got slower
+ */
+static int CompareWithBaseline(const char *path, double threshold, double wallThreshold)
+{
+    char name[48], metric[24];
+    double value = 0, limit = 0;
+    int failed = 0, i = 0;
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+    {
+        fprintf(stderr, "no baseline %s, run with --update to create it\n", path);
+        return 1;
+    }
+
+    while (fscanf(f, "%47s %23s %lf", name, metric, &value) == 3)
+    {
+        for (i = 0; i < numResults; i++)
+        {
+            if (strcmp(results[i].name, name) || strcmp(results[i].metric, metric))
+                continue;
+
+            limit = value * (1.0 + (strcmp(metric, "wall_ns") ? threshold : wallThreshold));
+            if (results[i].value > limit + 1e-9)
+            {
+                fprintf(stderr, "REGRESSION %s %s %.3f > baseline %.3f\n", name, metric, results[i].value, value);
+                failed = 1;
+            }
+            break;
+        }
+    }
+
+    fclose(f);
+    return failed;
+}
+
+static int WriteBaseline(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    int i = 0;
+
+    if (!f)
+        return 1;
+
+    for (i = 0; i < numResults; i++)
+        fprintf(f, "%s %s %.3f\n", results[i].name, results[i].metric, results[i].value);
+
+    fclose(f);
+    return 0;
+}
+
+static double WallTime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
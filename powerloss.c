@@ -0,0 +1,408 @@
+/*
+ *   Copyright (c) 2023 thearistotlemethod@gmail.com
+ *   All rights reserved.
+
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+
+ *   http://www.apache.org/licenses/LICENSE-2.0
+
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Power loss test on the NAND simulator. The device is filled and then goes
+ * through cycles: random writes, runs, releases and idle steps run until
+ * esFtl_SimCutPower takes the power away after a random count of programs
+ * and erases, tearing the program it happens in. The device is mounted again
+ * with esFtl_Init(0), every fourth time after a second cut during a first
+ * mount, and every sector is read back: an acknowledged write must be there,
+ * the write the power went in may be there or not, and a released sector may
+ * read back unassigned. The cycle after such a mount loses the power within
+ * its first programs and erases, where a lazy mount finishes and the first
+ * checkpoint after the cut is written. Some cycles make a block go bad so the
+ * bad block table is written while the power may go. The cuts land in the
+ * checkpoints, the journal of the translation pages, the defragment and the
+ * erases of the idle hook; build it with ESFTL_LAZYMOUNT or
+ * ESFTL_HYBRIDMAPPING set to 1 to test the lazy mount or the hybrid mapping.
+ * It prints one JSON line and exits with 1 when a sector was lost or a mount
+ * failed.
+ *
+ *   cc -O2 -o powerloss powerloss.c esFtl_bbm.c esFtl_cache.c esFtl_defragment.c \
+ *      esFtl_init.c esFtl_read.c esFtl_write.c esFtl_disk_simulator.c esFtl_hybrid.c esFtl_checkpoint.c esFtl_summary.c esFtl_blocks.c esFtl_buffer.c esFtl_vector.c esFtl_checksum.c esFtl_readcache.c esFtl_readahead.c esFtl_scrub.c
+ *   ./powerloss [--cycles N] [--span N] [--gap N] [--seed N]
+ */
+
+#include <stdlib.h>
+
+#include "esFtl.h"
+#include "esFtl_cache.h"
+#include "esFtl_hybrid.h"
+#include "esFtl_disk_simulator.h"
+
+#if ESFTL_HYBRIDMAPPING
+#define POWER_MAXSPAN (ESFTL_HYBRIDLOGICALBLOCKS * ESFTL_NANDNUMPAGEBLOCK)
+#define POWER_MAPPING "hybrid"
+#elif ESFTL_LAZYMOUNT
+#define POWER_MAXSPAN ESFTL_MAXSECTORS
+#define POWER_MAPPING "lazy"
+#else
+#define POWER_MAXSPAN ESFTL_MAXSECTORS
+#define POWER_MAPPING "page"
+#endif
+#define POWER_MAXRUN 16            /* sectors of a run written by one esFtl_WriteSectors */
+#define POWER_SYNCEVERY 16         /* operations between two esFtl_Sync, the write buffer holds the writes until then */
+#define POWER_MOUNTCUTEVERY 4      /* every 4th cycle the power goes again during the first mount */
+#define POWER_MOUNTCUTOPS 64       /* programs and erases until that cut, and until the next one after the mount */
+#define POWER_BADBLOCKEVERY 10     /* every 10th cycle a block goes bad */
+#define POWER_BADBLOCKRANGE (ESFTL_NANDNUMBLOCKS - 8) /* the checkpoint and bad block table blocks do not go bad */
+
+typedef struct
+{
+    uint32_t cycles;
+    uint32_t span;
+    uint32_t gap;
+    uint32_t seed;
+} PowerOptions;
+
+typedef struct
+{
+    uint32_t durable; /* acknowledged version, 0 if the sector may be unassigned */
+    uint32_t floor;   /* the versions from here to written may have reached the flash */
+    uint32_t written; /* last version given to the FTL */
+    uint8_t released; /* released after the acknowledged version, it may read back unassigned */
+} SectorState;
+
+static PowerOptions options = {100, 16384, 3000, 1};
+static uint32_t rngState = 1;
+static SectorState *sectors = NULL;
+static uint16_t unsynced[POWER_SYNCEVERY * POWER_MAXRUN];
+static uint32_t numUnsynced = 0;
+static uint8_t pageBuff[ESFTL_NANDPAGESIZE];
+static uint8_t expectBuff[ESFTL_NANDPAGESIZE];
+static uint8_t runBuff[POWER_MAXRUN * ESFTL_NANDPAGEDATASIZE];
+static uint32_t hostWrites = 0;
+static uint32_t refusedWrites = 0;
+static uint32_t mountCuts = 0;
+static uint32_t badBlocks = 0;
+static uint32_t checkedSectors = 0;
+static uint32_t lostSectors = 0;
+
+static uint32_t Random(void);
+static void RunOperation(uint32_t op);
+static void WriteOne(uint16_t sno);
+static void WriteRun(uint16_t sno, uint16_t count);
+static void Release(uint16_t sno);
+static void Acknowledge(uint16_t sno);
+static void Sync(void);
+static int Remount(uint32_t cycle);
+static void CheckSectors(uint32_t cycle);
+static int ReadVersion(uint16_t sno, uint32_t *version);
+static void FillSector(uint8_t *buff, uint16_t sno, uint32_t version);
+
+int main(int argc, char **argv)
+{
+    esFtl_SimConfig cfg;
+    uint32_t cycle = 0, op = 0, i = 0;
+    int rv = 0;
+
+    for (i = 1; i + 1 < (uint32_t)argc; i += 2)
+    {
+        if (!strcmp(argv[i], "--cycles"))
+            options.cycles = strtoul(argv[i + 1], NULL, 0);
+        else if (!strcmp(argv[i], "--span"))
+            options.span = strtoul(argv[i + 1], NULL, 0);
+        else if (!strcmp(argv[i], "--gap"))
+            options.gap = strtoul(argv[i + 1], NULL, 0);
+        else if (!strcmp(argv[i], "--seed"))
+            options.seed = strtoul(argv[i + 1], NULL, 0);
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    if (options.span <= POWER_MAXRUN || options.span > POWER_MAXSPAN || options.gap == 0)
+    {
+        fprintf(stderr, "span must be %d..%d and gap above 0\n", POWER_MAXRUN + 1, POWER_MAXSPAN);
+        return 2;
+    }
+
+    sectors = calloc(options.span, sizeof(SectorState));
+    if (!sectors)
+        return 1;
+    rngState = options.seed ? options.seed : 1;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.strict = 1;
+    esFtl_SimConfigure(&cfg);
+    esFtl_Init(1);
+
+    for (i = 0; i < options.span; i++)
+        WriteOne(i);
+    Sync();
+
+    for (cycle = 1; cycle <= options.cycles && !rv; cycle++)
+    {
+        if (cycle % POWER_BADBLOCKEVERY == 0)
+        {
+            esFtl_SimInjectBadBlock(Random() % POWER_BADBLOCKRANGE);
+            badBlocks++;
+        }
+
+        /* the cycles after a mount cut lose the power again soon, in the writes which finish a lazy mount */
+        esFtl_SimCutPower(1 + Random() % (cycle % POWER_MOUNTCUTEVERY == 1 ? POWER_MOUNTCUTOPS : options.gap));
+        for (op = 0; !esFtl_SimPowerLost(); op++)
+            RunOperation(op);
+
+        rv = Remount(cycle);
+        CheckSectors(cycle);
+    }
+
+    printf("{\"test\":\"powerloss\",\"mapping\":\"%s\",\"write_buffer\":%d,\"cycles\":%u,\"span\":%u,\"seed\":%u,",
+           POWER_MAPPING, ESFTL_WRITEBUFFERSECTORS, cycle - 1, options.span, options.seed);
+    printf("\"mount_cuts\":%u,\"bad_blocks\":%u,\"host_writes\":%u,\"refused_writes\":%u,", mountCuts, badBlocks, hostWrites,
+           refusedWrites);
+    printf("\"checked_sectors\":%u,\"lost_sectors\":%u,\"mount_failed\":%d}\n", checkedSectors, lostSectors, rv != 0);
+
+    esFtl_SimClose();
+    free(sectors);
+    return (rv || lostSectors) ? 1 : 0;
+}
+
+static uint32_t Random(void)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+/*
+ * @brief do one host operation, mostly single writes, some runs, releases and idle steps
+ *
+ * @param op count of operations since the power came back
+ */
+static void RunOperation(uint32_t op)
+{
+    uint32_t r = Random() % 100;
+    uint16_t sno = Random() % options.span;
+
+    if (r < 70)
+        WriteOne(sno);
+    else if (r < 80)
+        WriteRun(sno < options.span - POWER_MAXRUN ? sno : options.span - POWER_MAXRUN, 1 + Random() % POWER_MAXRUN);
+    else if (r < 85)
+        Release(sno);
+    else
+        esFtl_Idle();
+
+    if (op % POWER_SYNCEVERY == POWER_SYNCEVERY - 1)
+        Sync();
+}
+
+static void WriteOne(uint16_t sno)
+{
+    uint32_t version = ++sectors[sno].written;
+
+    FillSector(pageBuff, sno, version);
+    if (esFtl_FtlDriverWrite(sno, pageBuff, 0, ESFTL_NANDPAGEDATASIZE))
+    {
+        if (!esFtl_SimPowerLost())
+            refusedWrites++;
+        return;
+    }
+
+    hostWrites++;
+    Acknowledge(sno);
+}
+
+/*
+ * @brief write a run with one call, it does not go through the write buffer
+ *
+ * @param sno
+ * @param count
+ */
+static void WriteRun(uint16_t sno, uint16_t count)
+{
+    uint16_t i = 0;
+
+    for (i = 0; i < count; i++)
+        FillSector(&runBuff[i * ESFTL_NANDPAGEDATASIZE], sno + i, ++sectors[sno + i].written);
+
+    if (esFtl_WriteSectors(sno, runBuff, count))
+    {
+        if (!esFtl_SimPowerLost())
+            refusedWrites += count;
+        return;
+    }
+
+    hostWrites += count;
+    for (i = 0; i < count; i++)
+    {
+        if (!esFtl_SimPowerLost())
+        {
+            sectors[sno + i].durable = sectors[sno + i].written;
+            sectors[sno + i].released = 0;
+        }
+    }
+}
+
+/*
+ * @brief release a sector, a release the power goes in may have reached the
+ * translation page and a buffered write of the sector is dropped with it
+ *
+ * @param sno
+ */
+static void Release(uint16_t sno)
+{
+    uint32_t i = 0;
+
+    sectors[sno].released = 1;
+    esFtl_FtlDriverRelease(sno);
+
+    for (i = 0; i < numUnsynced; i++)
+    {
+        if (unsynced[i] == sno)
+            unsynced[i--] = unsynced[--numUnsynced];
+    }
+}
+
+/*
+ * @brief a write which returned is on the flash, with a write buffer only after the next sync
+ *
+ * @param sno
+ */
+static void Acknowledge(uint16_t sno)
+{
+    if (esFtl_SimPowerLost())
+        return;
+
+#if ESFTL_WRITEBUFFERSECTORS
+    if (numUnsynced < sizeof(unsynced) / sizeof(unsynced[0]))
+    {
+        unsynced[numUnsynced++] = sno;
+        return;
+    }
+    Sync();
+#endif
+    sectors[sno].durable = sectors[sno].written;
+    sectors[sno].released = 0;
+}
+
+/*
+ * @brief write the buffered sectors out, they are acknowledged once it returns
+ *
+ */
+static void Sync(void)
+{
+    uint32_t i = 0;
+
+    if (esFtl_Sync() || esFtl_SimPowerLost())
+        return;
+
+    for (i = 0; i < numUnsynced; i++)
+    {
+        sectors[unsynced[i]].durable = sectors[unsynced[i]].written;
+        sectors[unsynced[i]].released = 0;
+    }
+    numUnsynced = 0;
+}
+
+/*
+ * @brief turn the power on and mount, some mounts lose the power themselves first
+ *
+ * @param cycle
+ * @return 0 if the device is mounted
+ */
+static int Remount(uint32_t cycle)
+{
+    numUnsynced = 0;
+
+    if (cycle % POWER_MOUNTCUTEVERY == 0)
+    {
+        esFtl_SimCutPower(1 + Random() % POWER_MOUNTCUTOPS);
+        esFtl_Init(0);
+        if (esFtl_SimPowerLost())
+            mountCuts++;
+    }
+
+    esFtl_SimCutPower(0);
+    if (esFtl_Init(0))
+    {
+        fprintf(stderr, "cycle %u: the device is not mounted\n", cycle);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * @brief read every sector back, what it holds becomes the acknowledged version
+ * since the writes which were lost with the power may not come back later
+ *
+ * @param cycle
+ */
+static void CheckSectors(uint32_t cycle)
+{
+    SectorState *st;
+    uint32_t version = 0, i = 0;
+    int ok = 0;
+
+    for (i = 0; i < options.span; i++)
+    {
+        st = &sectors[i];
+        checkedSectors++;
+
+        if (ReadVersion(i, &version))
+            ok = 0;
+        else if (!version)
+            ok = !st->durable || st->released;
+        else
+            ok = version == st->durable || (version > st->durable && version >= st->floor && version <= st->written);
+
+        if (!ok)
+        {
+            if (lostSectors < 10)
+                fprintf(stderr, "cycle %u sector %u: read version %u, acknowledged %u, written %u\n", cycle, i, version,
+                        st->durable, st->written);
+            lostSectors++;
+            version = 0;
+        }
+
+        st->durable = version;
+        st->floor = st->written + 1;
+        st->released = 0;
+    }
+}
+
+/*
+ * @brief find the version a sector holds
+ *
+ * @param sno
+ * @param version 0 if the sector is unassigned
+ * @return 0 if the sector is unassigned or holds a whole version, -1 if it holds anything else
+ */
+static int ReadVersion(uint16_t sno, uint32_t *version)
+{
+    *version = 0;
+    if (esFtl_Read(sno, pageBuff, 0, ESFTL_NANDPAGEDATASIZE))
+        return 0;
+
+    memcpy(version, &pageBuff[4], 4);
+    FillSector(expectBuff, sno, *version);
+    return memcmp(pageBuff, expectBuff, ESFTL_NANDPAGEDATASIZE) ? -1 : 0;
+}
+
+static void FillSector(uint8_t *buff, uint16_t sno, uint32_t version)
+{
+    memset(buff, (uint8_t)(sno * 7 + version), ESFTL_NANDPAGEDATASIZE);
+    memcpy(&buff[0], &(uint32_t){sno}, 4);
+    memcpy(&buff[4], &version, 4);
+}
@@ -22,12 +22,16 @@ const char *testData = "Test Data";
 int test(void)
 {
     int rv = -1;
-    char buffer[ESFTL_NANDPAGESIZE];
+    uint8_t buffer[ESFTL_NANDPAGESIZE];
 
     esFtl_Init(1);
-    esFtl_FtlDriverWrite(0, testData, 0, strlen(testData));
 
-    esFtl_FtlDriverRead(0, buffer, 0, ESFTL_NANDPAGEDATASIZE);
+    memset(buffer, 0xFF, sizeof(buffer));
+    memcpy(buffer, testData, strlen(testData));
+    esFtl_FtlDriverWrite(0, buffer, 0, strlen(testData));
+
+    memset(buffer, 0, sizeof(buffer));
+    esFtl_Read(0, buffer, 0, ESFTL_NANDPAGEDATASIZE);
 
     if (memcmp(testData, buffer, strlen(testData)))
         printf("Test Failed!!!\n");